@@ -0,0 +1,41 @@
+#! /usr/bin/env bash
+# Runs blit_cairo with each kind of content into an image and into a pixmap backbuffer and
+# prints the average frame time for each, server side work included (BLIT_SYNC=1)
+# Content drawn with cairo calls should favor the pixmap, content that writes pixels the image
+# Usage: ./backbuf.sh [frames] [contents...]
+# Needs Xvfb, CC is used to build like build.sh
+
+FRAMES=${1:-300}
+shift
+CONTENTS=${@:-fill motion sprites commands vector}
+DISPLAY_NUM=${BACKBUF_DISPLAY:-:96}
+
+Xvfb $DISPLAY_NUM -screen 0 1280x720x24 -nolisten tcp &
+XVFB=$!
+trap "kill $XVFB; rm -f ./backbuf_blit_cairo ./backbuf_blit_cairo.log" EXIT
+sleep 1
+
+$CC -Wall --pedantic --std=gnu11 -O2 -pthread -o ./backbuf_blit_cairo blit_cairo.c \
+  $(pkg-config --cflags --libs cairo x11 x11-xcb xcb xcb-randr xcb-render xcb-sync xcb-xtest gl glu xcb-glx) || exit 1
+
+STATUS=0
+
+printf "%-10s %-8s %s\n" content mode "render (last 100 frames)"
+
+for content in $CONTENTS; do
+  for mode in image pixmap; do
+    # A low frame rate keeps the scheduler from stepping down, which only the image can do
+    DISPLAY=$DISPLAY_NUM BLIT_CONTENT=$content BLIT_BACKBUF=$mode BLIT_SYNC=1 BLIT_FPS=10 \
+      BLIT_SOAK=$FRAMES ./backbuf_blit_cairo > ./backbuf_blit_cairo.log 2>&1
+    result=$?
+
+    printf "%-10s %-8s %s\n" $content $mode "$(grep "^render:" ./backbuf_blit_cairo.log | tail -n 1)"
+
+    if [ $result -ne 0 ]; then
+      echo "== $content with $mode FAILED"
+      STATUS=1
+    fi
+  done
+done
+
+exit $STATUS
@@ -0,0 +1,38 @@
+#! /usr/bin/env bash
+# Uploads 4K frames from blit_cairo over 1 to 8 connections at once (BLIT_CONNECTIONS) and
+# prints the upload throughput and times for each, server side work included (BLIT_SYNC=1)
+# Usage: ./bands.sh [frames] [connections...]
+# Needs Xvfb, CC is used to build like build.sh
+
+FRAMES=${1:-300}
+shift
+CONNECTIONS=${@:-1 2 4 8}
+DISPLAY_NUM=${BANDS_DISPLAY:-:93}
+
+Xvfb $DISPLAY_NUM -screen 0 3840x2160x24 -nolisten tcp &
+XVFB=$!
+trap "kill $XVFB; rm -f ./bands_blit_cairo ./bands_blit_cairo.log" EXIT
+sleep 1
+
+$CC -Wall --pedantic --std=gnu11 -O2 -pthread -o ./bands_blit_cairo blit_cairo.c \
+  $(pkg-config --cflags --libs cairo x11 x11-xcb xcb xcb-randr xcb-render xcb-sync xcb-xtest gl glu xcb-glx) || exit 1
+
+STATUS=0
+
+for connections in $CONNECTIONS; do
+  echo "== $connections connections, $FRAMES frames"
+
+  # A low frame rate keeps the scheduler from stepping down, every frame is a full 4K upload
+  DISPLAY=$DISPLAY_NUM BLIT_CONNECTIONS=$connections BLIT_CONTENT=motion BLIT_SYNC=1 BLIT_FPS=10 \
+    BLIT_SOAK=$FRAMES ./bands_blit_cairo > ./bands_blit_cairo.log 2>&1
+  result=$?
+
+  grep "^bands:" ./bands_blit_cairo.log | tail -n 3
+
+  if [ $result -ne 0 ]; then
+    echo "== $connections connections FAILED"
+    STATUS=1
+  fi
+done
+
+exit $STATUS
@@ -0,0 +1,319 @@
+/*
+ * Benchmark for blit_asset.h
+ * Usage: bench_asset [files...]
+ * Without files it writes a synthetic set first, BLIT_ASSET_MB (500) megabytes of decoded pixels
+ * as 2048x2048 PPM, PAM and QOI images in a temporary directory, and removes it afterwards
+ * The files are dropped from the page cache before the first pass (clean pages can be without
+ * root), so the first startup time is as close to cold as it gets here, the second is warm
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blit_asset.h"
+#include "blit_stats.h"
+
+#define SIZE 2048
+#define BAND 64
+#define MAX_FILES 4096
+
+static void
+genImage(uint8_t *rgba,
+         int seed) {
+  /* Something like a sprite sheet: flat cells, gradients and a noisy corner */
+  uint32_t state = (uint32_t)seed * 2654435761u + 1;
+
+  for (int y = 0; y < SIZE; y++) {
+    for (int x = 0; x < SIZE; x++) {
+      uint8_t *p = rgba + ((size_t)y * SIZE + x) * 4;
+      int cell = (x / 128 + y / 128 + seed) % 4;
+
+      if (x >= SIZE * 3 / 4 && y >= SIZE * 3 / 4) {
+        state = state * 1664525u + 1013904223u;
+        p[0] = (uint8_t)(state >> 24);
+        p[1] = (uint8_t)(state >> 16);
+        p[2] = (uint8_t)(state >> 8);
+        p[3] = 255;
+      }
+      else if (cell == 0) {
+        p[0] = 40;
+        p[1] = 40;
+        p[2] = 60;
+        p[3] = 0;
+      }
+      else {
+        p[0] = (uint8_t)(x * cell);
+        p[1] = (uint8_t)(y + seed);
+        p[2] = (uint8_t)((x ^ y) & 0xf0);
+        p[3] = (uint8_t)(cell == 3 ? (x & 0xff) : 255);
+      }
+    }
+  }
+}
+
+static void
+writeQOI(FILE *file,
+         const uint8_t *rgba,
+         int channels) {
+  /* The reference encoder, only here to make test files */
+  uint8_t header[14] = {'q', 'o', 'i', 'f',
+                        SIZE >> 24, (SIZE >> 16) & 0xff, (SIZE >> 8) & 0xff, SIZE & 0xff,
+                        SIZE >> 24, (SIZE >> 16) & 0xff, (SIZE >> 8) & 0xff, SIZE & 0xff,
+                        (uint8_t)channels, 0};
+  uint8_t index[64][4];
+  uint8_t prev[4] = {0, 0, 0, 255};
+  int run = 0;
+  size_t count = (size_t)SIZE * SIZE;
+
+  memset(index, 0, sizeof(index));
+  fwrite(header, 1, sizeof(header), file);
+
+  for (size_t i = 0; i < count; i++) {
+    uint8_t px[4] = {rgba[i * 4], rgba[i * 4 + 1], rgba[i * 4 + 2], channels == 4 ? rgba[i * 4 + 3] : 255};
+
+    if (memcmp(px, prev, 4) == 0) {
+      run++;
+      if (run == 62 || i == count - 1) {
+        fputc(0xc0 | (run - 1), file);
+        run = 0;
+      }
+      continue;
+    }
+
+    if (run > 0) {
+      fputc(0xc0 | (run - 1), file);
+      run = 0;
+    }
+
+    int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+
+    if (memcmp(index[hash], px, 4) == 0) {
+      fputc(hash, file);
+    }
+    else {
+      memcpy(index[hash], px, 4);
+
+      if (px[3] == prev[3]) {
+        int dr = (int8_t)(px[0] - prev[0]);
+        int dg = (int8_t)(px[1] - prev[1]);
+        int db = (int8_t)(px[2] - prev[2]);
+        int dr_dg = dr - dg;
+        int db_dg = db - dg;
+
+        if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+          fputc(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2), file);
+        }
+        else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 && db_dg > -9 && db_dg < 8) {
+          fputc(0x80 | (dg + 32), file);
+          fputc((dr_dg + 8) << 4 | (db_dg + 8), file);
+        }
+        else {
+          fputc(0xfe, file);
+          fwrite(px, 1, 3, file);
+        }
+      }
+      else {
+        fputc(0xff, file);
+        fwrite(px, 1, 4, file);
+      }
+    }
+    memcpy(prev, px, 4);
+  }
+
+  static const uint8_t end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+  fwrite(end, 1, sizeof(end), file);
+}
+
+static void
+writeRaw(FILE *file,
+         const uint8_t *rgba,
+         int channels) {
+  /* PPM for RGB, PAM for RGBA */
+  if (channels == 3) {
+    fprintf(file, "P6\n# bench_asset\n%d %d\n255\n", SIZE, SIZE);
+  }
+  else {
+    fprintf(file, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", SIZE, SIZE);
+  }
+
+  for (size_t i = 0; i < (size_t)SIZE * SIZE; i++) {
+    fwrite(rgba + i * 4, 1, (size_t)channels, file);
+  }
+}
+
+static int
+genSet(const char *dir,
+       char **paths) {
+  int mb = getenv("BLIT_ASSET_MB") != NULL ? atoi(getenv("BLIT_ASSET_MB")) : 500;
+  int count = mb * 1024 * 1024 / (SIZE * SIZE * 4);
+  uint8_t *rgba = malloc((size_t)SIZE * SIZE * 4);
+  static const char *names[4] = {"ppm", "pam", "qoi", "qoi"};
+
+  count = count < 1 ? 1 : count > MAX_FILES ? MAX_FILES : count;
+  printf("Writing %d %dx%d images to %s\n", count, SIZE, SIZE, dir);
+
+  for (int i = 0; i < count; i++) {
+    /* PPM, PAM with alpha, QOI without and with alpha */
+    int kind = i % 4;
+    int channels = kind == 0 || kind == 2 ? 3 : 4;
+
+    paths[i] = malloc(strlen(dir) + 32);
+    sprintf(paths[i], "%s/%04d-%d.%s", dir, i, channels, names[kind]);
+
+    FILE *file = fopen(paths[i], "wb");
+
+    genImage(rgba, i);
+
+    if (kind < 2) {
+      writeRaw(file, rgba, channels);
+    }
+    else {
+      writeQOI(file, rgba, channels);
+    }
+
+    /* Clean pages can be dropped from the cache by anyone, dirty ones can't */
+    fflush(file);
+    fsync(fileno(file));
+    posix_fadvise(fileno(file), 0, 0, POSIX_FADV_DONTNEED);
+    fclose(file);
+  }
+
+  free(rgba);
+  return count;
+}
+
+static void
+benchPass(char **paths,
+          int count,
+          const char *name) {
+  /* Startup, i.e. everything open and decoded, then per format throughput */
+  stat_t open_time = newStat("open");
+  uint64_t bytes_in[3] = {0, 0, 0};
+  uint64_t bytes_out[3] = {0, 0, 0};
+  uint64_t decode_ns[3] = {0, 0, 0};
+  uint64_t start = getTimeNs();
+
+  printf("== %s\n", name);
+
+  for (int i = 0; i < count; i++) {
+    uint64_t t = getTimeNs();
+    asset_t *asset = openAsset(paths[i]);
+    statAdd(&open_time, getTimeNs() - t);
+
+    if (asset == NULL) {
+      continue;
+    }
+
+    t = getTimeNs();
+    surface_t s = assetSurface(asset);
+    decode_ns[asset->format] += getTimeNs() - t;
+
+    if (s.pixels == NULL) {
+      closeAsset(asset);
+      continue;
+    }
+
+    bytes_in[asset->format] += asset->size;
+    bytes_out[asset->format] += (uint64_t)s.stride * s.height;
+
+    memFree(s.pixels);
+    closeAsset(asset);
+  }
+
+  uint64_t total = getTimeNs() - start;
+  static const char *formats[3] = {"PPM", "PAM", "QOI"};
+
+  statPrint(&open_time, 1e3, "us");
+
+  for (int f = 0; f < 3; f++) {
+    if (decode_ns[f] == 0) {
+      continue;
+    }
+    printf("%s: %.0f MB/s decoded, %.0f MB/s read (%.0f MB of files)\n",
+           formats[f],
+           bytes_out[f] / (decode_ns[f] / 1e9) / 1e6,
+           bytes_in[f] / (decode_ns[f] / 1e9) / 1e6,
+           bytes_in[f] / 1e6);
+  }
+
+  uint64_t out = bytes_out[0] + bytes_out[1] + bytes_out[2];
+
+  printf("startup: %.0f MB decoded in %.2fs, %.0f MB/s\n", out / 1e6, total / 1e9, out / (total / 1e9) / 1e6);
+}
+
+static void
+benchBands(char **paths,
+           int count) {
+  /* Same images streamed through one band of BAND rows, the memory a tile upload needs */
+  uint32_t *band = malloc((size_t)SIZE * BAND * 4);
+  uint64_t bytes = 0;
+  uint64_t start = getTimeNs();
+
+  for (int i = 0; i < count; i++) {
+    asset_t *asset = openAsset(paths[i]);
+
+    if (asset == NULL) {
+      continue;
+    }
+
+    if (asset->width <= SIZE) {
+      surface_t dst = surface(band, asset->width, BAND, asset->width * 4);
+
+      for (int y = 0; y < asset->height; y += BAND) {
+        bytes += (uint64_t)assetRows(asset, y, BAND, &dst) * dst.stride;
+      }
+    }
+    closeAsset(asset);
+  }
+
+  uint64_t total = getTimeNs() - start;
+
+  printf("bands of %d rows: %.0f MB in %.2fs, %.0f MB/s, %d KiB buffer\n",
+         BAND,
+         bytes / 1e6,
+         total / 1e9,
+         bytes / (total / 1e9) / 1e6,
+         SIZE * BAND * 4 / 1024);
+
+  free(band);
+}
+
+int
+main(int argc,
+     char **argv) {
+  char *paths[MAX_FILES];
+  char dir[] = "/tmp/bench_assetXXXXXX";
+  int generated = argc < 2;
+  int count = 0;
+
+  if (generated) {
+    if (mkdtemp(dir) == NULL) {
+      fprintf(stderr, "Could not make a temporary directory\n");
+      return 1;
+    }
+    count = genSet(dir, paths);
+  }
+  else {
+    for (int i = 1; i < argc && count < MAX_FILES; i++) {
+      paths[count++] = argv[i];
+    }
+  }
+
+  benchPass(paths, count, "first pass (cold if the files were generated)");
+  benchPass(paths, count, "second pass (warm)");
+  benchBands(paths, count);
+
+  if (generated) {
+    for (int i = 0; i < count; i++) {
+      unlink(paths[i]);
+      free(paths[i]);
+    }
+    rmdir(dir);
+  }
+
+  return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * Benchmark for blit_sprite.h
+ * Usage: bench_blit [blits per frame] [sprite size]
+ * Blits sprites from a 1024x1024 atlas into a 1920x1080 surface and reports blits per second
+ * for each blend mode, with and without sorting the batch
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blit_sprite.h"
+#include "blit_stats.h"
+
+#define FRAMES 20
+
+static surface_t
+allocSurface(int width,
+             int height) {
+  uint32_t *pixels = malloc((size_t)width * height * 4);
+  return surface(pixels, width, height, width * 4);
+}
+
+static void
+fillAtlas(surface_t *atlas,
+          int size) {
+  /* Premultiplied circles on a transparent background, one color per sprite */
+  for (int y = 0; y < atlas->height; y++) {
+    uint32_t *row = surfaceRow(atlas, y);
+
+    for (int x = 0; x < atlas->width; x++) {
+      int cx = x % size - size / 2;
+      int cy = y % size - size / 2;
+      uint32_t a = cx * cx + cy * cy < (size / 2) * (size / 2) ? 200 : 0;
+      uint32_t sprite = (uint32_t)((y / size) * (atlas->width / size) + x / size);
+
+      row[x] = a << 24 |
+               mulDiv255((sprite * 37) & 0xff, a) << 16 |
+               mulDiv255((sprite * 91) & 0xff, a) << 8 |
+               mulDiv255((sprite * 53) & 0xff, a);
+    }
+  }
+}
+
+int
+main(int argc, char **argv) {
+  int count = argc > 1 ? atoi(argv[1]) : 20000;
+  int size = argc > 2 ? atoi(argv[2]) : 32;
+
+  surface_t atlas = allocSurface(1024, 1024);
+  surface_t dst = allocSurface(1920, 1080);
+
+  fillAtlas(&atlas, size);
+  memset(dst.pixels, 0x20, (size_t)dst.stride * dst.height);
+
+  static const struct {
+    const char *name;
+    uint8_t flags;
+    uint8_t opacity;
+  } modes[] = {
+    {"copy", 0, 255},
+    {"colorkey", BLIT_COLORKEY, 255},
+    {"alpha", BLIT_ALPHA, 255},
+    {"alpha+opacity", BLIT_ALPHA, 128},
+    {"alpha+key+opacity", BLIT_ALPHA | BLIT_COLORKEY, 128},
+  };
+
+  blit_batch_t batch;
+  memset(&batch, 0, sizeof(batch));
+
+  int per_row = atlas.width / size;
+
+  printf("%d blits of %dx%d per frame, %d frames\n", count, size, size, FRAMES);
+  printf("%-18s %-8s %14s %12s\n", "mode", "sorted", "blits/s", "Mpixels/s");
+
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+    for (int sort = 0; sort < 2; sort++) {
+      stat_t frame = newStat("frame");
+
+      srand(1);
+
+      for (int f = 0; f < FRAMES; f++) {
+        blitBatchClear(&batch);
+
+        for (int i = 0; i < count; i++) {
+          int sprite = rand() % (per_row * per_row);
+
+          blit_t b = blit(&atlas,
+                          (sprite % per_row) * size,
+                          (sprite / per_row) * size,
+                          size,
+                          size,
+                          rand() % (dst.width + size) - size,
+                          rand() % (dst.height + size) - size);
+
+          b.flags = modes[m].flags;
+          b.opacity = modes[m].opacity;
+          b.colorkey = 0;
+
+          blitBatchAdd(&batch, b);
+        }
+
+        uint64_t start = getTimeNs();
+        blitBatchRun(&dst, &batch, sort);
+        statAdd(&frame, getTimeNs() - start);
+      }
+
+      double seconds = statAvg(&frame) / 1e9;
+
+      printf("%-18s %-8s %14.0f %12.1f\n",
+             modes[m].name,
+             sort ? "yes" : "no",
+             count / seconds,
+             (double)count * size * size / seconds / 1e6);
+    }
+  }
+
+  blitBatchFree(&batch);
+  free(atlas.pixels);
+  free(dst.pixels);
+
+  return 0;
+}
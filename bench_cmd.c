@@ -0,0 +1,123 @@
+/*
+ * Benchmark for blit_cmd.h
+ * Usage: bench_cmd [recording]
+ * Replays a file written with BLIT_RECORD through the software executor, the same frames every run
+ * Without one it records FRAMES frames of the demo scene at 1920x1080 to a temporary file first
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blit_cmd.h"
+#include "blit_stats.h"
+
+#define FRAMES 300
+
+static FILE*
+recordDemo(void) {
+  FILE *file = tmpfile();
+  surface_t atlas = genAtlas(32);
+  cmd_buffer_t buf;
+  stat_t record = newStat("record");
+
+  memset(&buf, 0, sizeof(buf));
+  cmdWriteHeader(file, &atlas, 1);
+
+  for (int v = 0; v < FRAMES; v++) {
+    uint64_t start = getTimeNs();
+
+    cmdRecordDemo(&buf, 32, 2000, v, 1920, 1080);
+    statAdd(&record, getTimeNs() - start);
+
+    /* A still frame every now and then, to show reuse */
+    cmdWriteFrame(file, &buf);
+    if (v % 10 == 0) {
+      cmdWriteFrame(file, &buf);
+    }
+  }
+
+  statPrint(&record, 1e3, "us");
+
+  cmdFree(&buf);
+  memFree(atlas.pixels);
+  rewind(file);
+
+  return file;
+}
+
+int
+main(int argc, char **argv) {
+  FILE *file = argc > 1 ? fopen(argv[1], "rb") : recordDemo();
+
+  if (file == NULL) {
+    fprintf(stderr, "Could not open %s\n", argv[1]);
+    return 1;
+  }
+
+  surface_t atlases[CMD_ATLASES];
+  memset(atlases, 0, sizeof(atlases));
+
+  int count = cmdReadHeader(file, atlases);
+
+  if (count < 0) {
+    fprintf(stderr, "Not a command recording\n");
+    return 1;
+  }
+
+  cmd_buffer_t buf;
+  cmd_buffer_t last;
+  memset(&buf, 0, sizeof(buf));
+  memset(&last, 0, sizeof(last));
+
+  surface_t dst;
+  memset(&dst, 0, sizeof(dst));
+
+  stat_t replay = newStat("replay");
+  stat_t bytes = newStat("bytes/frame");
+  stat_t commands = newStat("commands/frame");
+  uint64_t frames = 0;
+  uint64_t reused = 0;
+
+  while (cmdReadFrame(file, &buf)) {
+    frames++;
+
+    if (buf.width != dst.width || buf.height != dst.height) {
+      free(dst.pixels);
+      dst = surface(malloc((size_t)buf.width * buf.height * 4), buf.width, buf.height, buf.width * 4);
+      memset(dst.pixels, 0, (size_t)dst.stride * dst.height);
+    }
+
+    statAdd(&bytes, buf.len);
+    statAdd(&commands, buf.count);
+
+    /* Nothing changed, the picture from last time is still right */
+    if (cmdEqual(&buf, &last)) {
+      reused++;
+      continue;
+    }
+
+    uint64_t start = getTimeNs();
+    cmdExecSurface(&buf, &dst, atlases);
+    statAdd(&replay, getTimeNs() - start);
+
+    cmdSwap(&buf, &last);
+  }
+
+  printf("%llu frames, %d atlases, %llu reused\n",
+         (unsigned long long)frames,
+         count,
+         (unsigned long long)reused);
+  statPrint(&commands, 1, "");
+  statPrint(&bytes, 1024, "KiB");
+  statPrint(&replay, 1e6, "ms");
+
+  cmdFree(&buf);
+  cmdFree(&last);
+  free(dst.pixels);
+
+  cmdFreeAtlases(atlases, count);
+  fclose(file);
+
+  return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Benchmark for blit_convert.h
+ * Usage: bench_convert [width] [height]
+ * Converts a 1920x1080 xRGB frame into each visual format and reports MB/s of source pixels
+ * No display is needed, the converters are built straight from the channel masks
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blit_convert.h"
+#include "blit_stats.h"
+
+#define FRAMES 30
+
+static converter_t*
+maskConverter(uint8_t depth,
+              uint8_t bpp,
+              uint32_t red_mask,
+              uint32_t green_mask,
+              uint32_t blue_mask,
+              int fast16) {
+  converter_t *conv = memCalloc(1, sizeof(converter_t));
+
+  conv->kind = CONVERT_TRUECOLOR;
+  conv->depth = depth;
+  conv->bpp = bpp;
+  conv->fast16 = fast16;
+  maskBits(red_mask, &conv->shifts[0], &conv->bits[0]);
+  maskBits(green_mask, &conv->shifts[1], &conv->bits[1]);
+  maskBits(blue_mask, &conv->shifts[2], &conv->bits[2]);
+  buildLuts(conv);
+
+  return conv;
+}
+
+static converter_t*
+paletteConverter(void) {
+  converter_t *conv = memCalloc(1, sizeof(converter_t));
+
+  conv->kind = CONVERT_PALETTE;
+  conv->depth = 8;
+  conv->bpp = 8;
+
+  for (int i = 0; i < 216; i++) {
+    conv->palette[i] = (uint32_t)i + 16;
+  }
+  buildLuts(conv);
+
+  return conv;
+}
+
+int
+main(int argc, char **argv) {
+  int width = argc > 2 ? atoi(argv[1]) : 1920;
+  int height = argc > 2 ? atoi(argv[2]) : 1080;
+
+  uint32_t *src = malloc((size_t)width * height * 4);
+  uint8_t *dst = malloc((size_t)width * height * 4);
+
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      src[(size_t)y * width + x] = (uint32_t)(x * 0x010203 + y * 0x030201);
+    }
+  }
+  memset(dst, 0, (size_t)width * height * 4);
+
+  struct {
+    const char *name;
+    converter_t *conv;
+  } formats[] = {
+    {"565 sse2", maskConverter(16, 16, 0xf800, 0x07e0, 0x001f, 1)},
+    {"565 lut", maskConverter(16, 16, 0xf800, 0x07e0, 0x001f, 0)},
+    {"555 sse2", maskConverter(15, 16, 0x7c00, 0x03e0, 0x001f, 2)},
+    {"555 lut", maskConverter(15, 16, 0x7c00, 0x03e0, 0x001f, 0)},
+    {"332 lut", maskConverter(8, 8, 0xe0, 0x1c, 0x03, 0)},
+    {"palette", paletteConverter()},
+  };
+
+  printf("%dx%d, %d frames\n", width, height, FRAMES);
+  printf("%-10s %10s %10s\n", "format", "ms/frame", "MB/s");
+
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    converter_t *conv = formats[i].conv;
+    size_t stride = convertStride(conv, width);
+    stat_t frame = newStat("frame");
+
+    for (int f = 0; f < FRAMES; f++) {
+      uint64_t start = getTimeNs();
+
+      for (int y = 0; y < height; y++) {
+        convertRow(conv, src + (size_t)y * width, dst + y * stride, width, 0, y);
+      }
+      statAdd(&frame, getTimeNs() - start);
+    }
+
+    printf("%-10s %10.2f %10.1f\n",
+           formats[i].name,
+           statAvg(&frame) / 1e6,
+           (double)width * height * 4 / (statAvg(&frame) / 1e9) / 1e6);
+
+    freeConverter(conv);
+  }
+
+  free(src);
+  free(dst);
+
+  return 0;
+}
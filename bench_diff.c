@@ -0,0 +1,343 @@
+/*
+ * Benchmark for blit_diff.h
+ * Usage: bench_diff [width] [height]
+ * For a growing fraction of changed tiles, compares diffing + uploading the dirty tiles
+ * against uploading the whole frame. Uploads go to a pixmap with xcb_put_image if there
+ * is a display, otherwise a memcpy stands in for them, which is far cheaper than a real
+ * upload, so only the break-even with a display says anything about presenting
+ * Changed tiles get one pixel changed in their first row, a random row, or their last pixel,
+ * the last being the worst case for the early exit
+ * Unchanged frames are also compared against memcpy, the compares read two frames for every
+ * one a memcpy reads, so past a point they're bound by memory, not by the instructions
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xcb/xcb.h>
+
+#include "blit_diff.h"
+#include "blit_stats.h"
+
+#define ITERATIONS 100
+
+typedef enum {
+  CHANGE_FIRST,
+  CHANGE_RANDOM,
+  CHANGE_LAST
+} change_t;
+
+static const char *change_names[] = {"first", "random", "last"};
+
+typedef struct {
+  xcb_connection_t *display;
+  xcb_pixmap_t pixmap;
+  xcb_gcontext_t gc;
+  uint8_t depth;
+  uint8_t *shadow; /* stands in for the server when there is no display */
+  size_t max_bytes;
+} upload_t;
+
+static upload_t
+getUpload(int width,
+          int height) {
+  upload_t upload;
+  memset(&upload, 0, sizeof(upload));
+
+  upload.shadow = calloc((size_t)width * height, 4);
+  memset(upload.shadow, 0, (size_t)width * height * 4);
+
+  if (getenv("DISPLAY") == NULL) {
+    printf("No display, timing memcpy as the upload\n");
+    return upload;
+  }
+
+  xcb_connection_t *display = xcb_connect(NULL, NULL);
+
+  if (xcb_connection_has_error(display)) {
+    printf("Could not open the display, timing memcpy as the upload\n");
+    xcb_disconnect(display);
+    return upload;
+  }
+
+  xcb_screen_t *screen = xcb_setup_roots_iterator(xcb_get_setup(display)).data;
+
+  upload.display = display;
+  upload.depth = screen->root_depth;
+  upload.pixmap = xcb_generate_id(display);
+  upload.gc = xcb_generate_id(display);
+  upload.max_bytes = (size_t)xcb_get_maximum_request_length(display) * 4 - 64;
+
+  xcb_create_pixmap(display, upload.depth, upload.pixmap, screen->root, width, height);
+  xcb_create_gc(display, upload.gc, upload.pixmap, 0, NULL);
+
+  printf("Timing xcb_put_image into a %dx%d pixmap\n", width, height);
+
+  return upload;
+}
+
+static void
+uploadRect(upload_t *upload,
+           const uint8_t *data,
+           int stride,
+           int x,
+           int y,
+           int w,
+           int h) {
+  static uint8_t *rows = NULL;
+  static size_t rows_size = 0;
+
+  if (upload->display == NULL) {
+    for (int row = y; row < y + h; row++) {
+      memcpy(upload->shadow + ((size_t)row * stride) + (size_t)x * 4,
+             data + (size_t)row * stride + (size_t)x * 4,
+             (size_t)w * 4);
+    }
+    return;
+  }
+
+  int band = (int)(upload->max_bytes / ((size_t)w * 4));
+
+  if ((size_t)w * 4 * band > rows_size) {
+    rows_size = (size_t)w * 4 * band;
+    rows = realloc(rows, rows_size);
+  }
+
+  for (int top = y; top < y + h; top += band) {
+    int n = y + h - top < band ? y + h - top : band;
+
+    for (int row = 0; row < n; row++) {
+      memcpy(rows + (size_t)row * w * 4,
+             data + (size_t)(top + row) * stride + (size_t)x * 4,
+             (size_t)w * 4);
+    }
+
+    xcb_put_image(upload->display,
+                  XCB_IMAGE_FORMAT_Z_PIXMAP,
+                  upload->pixmap,
+                  upload->gc,
+                  w, n,
+                  x, top,
+                  0,
+                  upload->depth,
+                  (uint32_t)w * 4 * n,
+                  rows);
+  }
+}
+
+static void
+uploadSync(upload_t *upload) {
+  /* Wait until the server has actually processed the uploads */
+  if (upload->display != NULL) {
+    free(xcb_get_input_focus_reply(upload->display,
+                                   xcb_get_input_focus(upload->display),
+                                   NULL));
+  }
+}
+
+static void
+uploadDirty(upload_t *upload,
+            const uint8_t *data,
+            int stride,
+            int width,
+            int height,
+            const dirty_map_t *map) {
+  for (int ty = 0; ty < map->rows; ty++) {
+    int y = ty * DIFF_TILE;
+    int h = height - y < DIFF_TILE ? height - y : DIFF_TILE;
+
+    for (int tx = 0; tx < map->cols; tx++) {
+      int run = dirtyRunLength(map, tx, ty);
+
+      if (run == 0) {
+        continue;
+      }
+
+      int x = tx * DIFF_TILE;
+      int w = (tx + run) * DIFF_TILE > width ? width - x : run * DIFF_TILE;
+
+      uploadRect(upload, data, stride, x, y, w, h);
+      tx += run;
+    }
+  }
+  uploadSync(upload);
+}
+
+static void
+changeTiles(uint8_t *data,
+            int stride,
+            int width,
+            int height,
+            const dirty_map_t *map,
+            int percent,
+            change_t change,
+            unsigned int frame) {
+  /* Changes one pixel in percent% of the tiles, where in the tile depends on change */
+  for (int ty = 0; ty < map->rows; ty++) {
+    for (int tx = 0; tx < map->cols; tx++) {
+      int i = ty * map->cols + tx;
+
+      if ((i * 37 + (int)frame) % 100 >= percent) {
+        continue;
+      }
+
+      int x0 = tx * DIFF_TILE;
+      int y0 = ty * DIFF_TILE;
+      int w = width - x0 < DIFF_TILE ? width - x0 : DIFF_TILE;
+      int h = height - y0 < DIFF_TILE ? height - y0 : DIFF_TILE;
+
+      /* Same tile and frame, same pixel, so runs can be repeated */
+      uint32_t hash = ((uint32_t)i * 2654435761u) ^ (frame * 40503u);
+
+      int x = change == CHANGE_LAST ? x0 + w - 1 : x0 + (int)(hash % (uint32_t)w);
+      int y = change == CHANGE_LAST ? y0 + h - 1
+            : change == CHANGE_FIRST ? y0
+            : y0 + (int)((hash >> 16) % (uint32_t)h);
+
+      uint32_t *pixel = (uint32_t *)(data + (size_t)y * stride + (size_t)x * 4);
+      *pixel += 1;
+    }
+  }
+}
+
+int
+main(int argc, char **argv) {
+  int width = argc > 2 ? atoi(argv[1]) : 1920;
+  int height = argc > 2 ? atoi(argv[2]) : 1080;
+  int stride = width * 4;
+
+  static const int percents[] = {0, 1, 2, 5, 10, 25, 50, 75, 100};
+  static const char *isa_names[] = {"scalar", "sse2", "avx2"};
+
+  uint8_t *cur = calloc((size_t)stride, height);
+  uint8_t *prev = calloc((size_t)stride, height);
+
+  /* Touch every page, untouched calloc memory all maps to the same zero page */
+  memset(cur, 0x40, (size_t)stride * height);
+  memset(prev, 0x40, (size_t)stride * height);
+
+  dirty_map_t map;
+  dirtyMapAlloc(&map, width, height);
+
+  upload_t upload = getUpload(width, height);
+
+  /* The cost of not diffing at all */
+  stat_t full = newStat("Full upload");
+
+  dirtyMapFill(&map);
+  for (int i = 0; i < ITERATIONS; i++) {
+    uint64_t start = getTimeNs();
+    uploadDirty(&upload, cur, stride, width, height, &map);
+    statAdd(&full, getTimeNs() - start);
+  }
+  statPrint(&full, 1000.0, "us");
+
+  /* What reading and writing a frame costs, for the compares to be held against */
+  stat_t copy = newStat("memcpy");
+
+  for (int i = 0; i < ITERATIONS; i++) {
+    uint64_t start = getTimeNs();
+    memcpy(upload.shadow, prev, (size_t)stride * height);
+    statAdd(&copy, getTimeNs() - start);
+  }
+
+  double frame_bytes = (double)stride * height;
+
+  printf("memcpy of a frame: %.1fus, %.2f GB/s read + written\n",
+         statAvg(&copy) / 1000.0,
+         2 * frame_bytes / statAvg(&copy));
+
+  /* Nothing changed, every row of both frames is read */
+  for (size_t isa = 0; isa < sizeof(isa_names) / sizeof(isa_names[0]); isa++) {
+    setenv("BLIT_DIFF_ISA", isa_names[isa], 1);
+    row_differs_fn differs = getRowDiffer();
+    stat_t diff = newStat("diff");
+
+    for (int i = 0; i < ITERATIONS; i++) {
+      uint64_t start = getTimeNs();
+      diffFrame(differs, cur, prev, stride, width, height, &map);
+      statAdd(&diff, getTimeNs() - start);
+    }
+
+    printf("%s compare of unchanged frames: %.1fus, %.2f GB/s read\n",
+           isa_names[isa],
+           statAvg(&diff) / 1000.0,
+           2 * frame_bytes / statAvg(&diff));
+  }
+
+  printf("%dx%d, %d tiles of %dx%d, break-even against %s\n",
+         width, height, map.cols * map.rows, DIFF_TILE, DIFF_TILE,
+         upload.display != NULL ? "xcb_put_image" : "memcpy (not a real upload)");
+  printf("%-7s %-7s %8s %10s %12s %12s %10s\n", "isa", "pixel", "changed", "diff us", "upload us", "total us", "vs full");
+
+  size_t isas = sizeof(isa_names) / sizeof(isa_names[0]);
+  size_t changes = sizeof(change_names) / sizeof(change_names[0]);
+
+  /* Every isa with every kind of change */
+  for (size_t run = 0; run < isas * changes; run++) {
+    size_t isa = run / changes;
+    size_t change = run % changes;
+
+    setenv("BLIT_DIFF_ISA", isa_names[isa], 1);
+    row_differs_fn differs = getRowDiffer();
+
+    /* Highest change rate where diffing still beats the full upload */
+    int break_even = -1;
+
+    for (size_t p = 0; p < sizeof(percents) / sizeof(percents[0]); p++) {
+      stat_t diff = newStat("diff");
+      stat_t partial = newStat("upload");
+
+      for (int i = 0; i < ITERATIONS; i++) {
+        changeTiles(cur, stride, width, height, &map, percents[p], (change_t)change, (unsigned int)i);
+
+        uint64_t start = getTimeNs();
+        diffFrame(differs, cur, prev, stride, width, height, &map);
+        uint64_t diffed = getTimeNs();
+        uploadDirty(&upload, cur, stride, width, height, &map);
+        uint64_t uploaded = getTimeNs();
+        diffCommit(cur, prev, stride, width, height, &map);
+
+        statAdd(&diff, diffed - start);
+        statAdd(&partial, uploaded - diffed);
+      }
+
+      double total = statAvg(&diff) + statAvg(&partial);
+
+      if (total < statAvg(&full)) {
+        break_even = percents[p];
+      }
+
+      printf("%-7s %-7s %7d%% %10.1f %12.1f %12.1f %9.2fx\n",
+             isa_names[isa],
+             change_names[change],
+             percents[p],
+             statAvg(&diff) / 1000.0,
+             statAvg(&partial) / 1000.0,
+             total / 1000.0,
+             total / statAvg(&full));
+    }
+
+    if (break_even < 0) {
+      printf("%s, %s pixel: diffing never beats the full upload here\n", isa_names[isa], change_names[change]);
+    }
+    else {
+      printf("%s, %s pixel: diffing pays off up to about %d%% changed tiles\n",
+             isa_names[isa],
+             change_names[change],
+             break_even);
+    }
+  }
+
+  if (upload.display != NULL) {
+    xcb_free_pixmap(upload.display, upload.pixmap);
+    xcb_disconnect(upload.display);
+  }
+
+  dirtyMapFree(&map);
+  free(upload.shadow);
+  free(cur);
+  free(prev);
+
+  return 0;
+}
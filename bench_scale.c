@@ -0,0 +1,73 @@
+/*
+ * Benchmark for blit_scale.h
+ * Usage: bench_scale [src width] [src height] [dst width] [dst height] [max threads]
+ * Defaults to presenting a 1280x720 backbuffer on a 4K window
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blit_scale.h"
+#include "blit_stats.h"
+
+#define FRAMES 30
+
+static surface_t
+allocSurface(int width,
+             int height) {
+  uint32_t *pixels = malloc((size_t)width * height * 4);
+  return surface(pixels, width, height, width * 4);
+}
+
+int
+main(int argc, char **argv) {
+  int src_width = argc > 4 ? atoi(argv[1]) : 1280;
+  int src_height = argc > 4 ? atoi(argv[2]) : 720;
+  int dst_width = argc > 4 ? atoi(argv[3]) : 3840;
+  int dst_height = argc > 4 ? atoi(argv[4]) : 2160;
+  int max_threads = argc > 5 ? atoi(argv[5]) : 4;
+
+  surface_t src = allocSurface(src_width, src_height);
+  surface_t dst = allocSurface(dst_width, dst_height);
+
+  for (int y = 0; y < src_height; y++) {
+    uint32_t *row = surfaceRow(&src, y);
+
+    for (int x = 0; x < src_width; x++) {
+      row[x] = (uint32_t)(x * 0x010203 + y * 0x030201);
+    }
+  }
+  memset(dst.pixels, 0, (size_t)dst.stride * dst_height);
+
+  static const char *filter_names[] = {"nearest", "bilinear"};
+
+  printf("%dx%d -> %dx%d\n", src_width, src_height, dst_width, dst_height);
+  printf("%-9s %8s %10s %12s\n", "filter", "threads", "ms/frame", "Mpixels/s");
+
+  for (int filter = SCALE_NEAREST; filter <= SCALE_BILINEAR; filter++) {
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+      scaler_t *scaler = allocScaler((scale_filter_t)filter, threads);
+      stat_t frame = newStat("frame");
+
+      for (int f = 0; f < FRAMES; f++) {
+        uint64_t start = getTimeNs();
+        scaleSurface(scaler, &src, &dst);
+        statAdd(&frame, getTimeNs() - start);
+      }
+
+      printf("%-9s %8d %10.2f %12.1f\n",
+             filter_names[filter],
+             threads,
+             statAvg(&frame) / 1e6,
+             (double)dst_width * dst_height / (statAvg(&frame) / 1e9) / 1e6);
+
+      freeScaler(scaler);
+    }
+  }
+
+  free(src.pixels);
+  free(dst.pixels);
+
+  return 0;
+}
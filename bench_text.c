@@ -0,0 +1,132 @@
+/*
+ * Benchmark for blit_text.h
+ * Draws a HUD of about 2000 glyphs (40 lines of about 50) into a 1920x1080 buffer, numbers changing every
+ * frame, once with cairo_show_text and once from the glyph atlas
+ * Then again from an atlas too small for the character set, to see what eviction costs
+ */
+
+#include <cairo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blit_stats.h"
+#include "blit_text.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define FRAMES 200
+#define LINES 40
+#define COLUMNS 50
+#define LINE_SIZE 64
+
+static void
+hudLine(char *line,
+        int frame,
+        int i,
+        int wide) {
+  /* wide uses a bigger character set, so a small atlas can't hold all of it */
+  if (!wide) {
+    snprintf(line, LINE_SIZE, "obj %4d pos %7.2f %7.2f vel %+6.3f hp %3d%%",
+             i,
+             (frame * 13 + i * 7) % 1920 + 0.25 * i,
+             (frame * 7 + i * 3) % 1080 + 0.5 * i,
+             ((frame + i) % 200 - 100) / 37.0,
+             (frame + i) % 101);
+    return;
+  }
+
+  for (int c = 0; c < COLUMNS; c++) {
+    line[c] = (char)(0x21 + (unsigned)(frame * 31 + i * 17 + c * 7) % 94);
+  }
+  line[COLUMNS] = 0;
+}
+
+static void
+benchCairo(cairo_t *cr,
+           int wide) {
+  stat_t frame_time = newStat(wide ? "cairo wide" : "cairo");
+  char line[LINE_SIZE];
+
+  cairo_select_font_face(cr, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+  cairo_set_font_size(cr, 14);
+  cairo_set_source_rgba(cr, 1, 1, 1, 1);
+
+  for (int frame = 0; frame < FRAMES; frame++) {
+    uint64_t start = getTimeNs();
+
+    for (int i = 0; i < LINES; i++) {
+      hudLine(line, frame, i, wide);
+      cairo_move_to(cr, 8 + (i / 20) * 480, 20 + (i % 20) * 18);
+      cairo_show_text(cr, line);
+    }
+    cairo_surface_flush(cairo_get_target(cr));
+
+    statAdd(&frame_time, getTimeNs() - start);
+  }
+
+  statPrint(&frame_time, 1e6, "ms");
+}
+
+static void
+benchAtlas(surface_t *dst,
+           int atlas_size,
+           int wide) {
+  stat_t frame_time = newStat(wide ? "atlas wide" : "atlas");
+  text_t *text = allocText("monospace", 14, atlas_size);
+  blit_batch_t batch;
+  char line[LINE_SIZE];
+
+  if (text == NULL) {
+    return;
+  }
+
+  memset(&batch, 0, sizeof(batch));
+
+  for (int frame = 0; frame < FRAMES; frame++) {
+    uint64_t start = getTimeNs();
+
+    textFrame(text);
+    blitBatchClear(&batch);
+
+    for (int i = 0; i < LINES; i++) {
+      hudLine(line, frame, i, wide);
+      textDraw(text, &batch, dst, 8 + (i / 20) * 480, 20 + (i % 20) * 18, line, 0xffffffff);
+    }
+    textFlush(text, &batch, dst);
+
+    statAdd(&frame_time, getTimeNs() - start);
+  }
+
+  statPrint(&frame_time, 1e6, "ms");
+  textReport(text);
+
+  blitBatchFree(&batch);
+  freeText(text);
+}
+
+int
+main(void) {
+  cairo_surface_t *target = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, WIDTH, HEIGHT);
+  cairo_t *cr = cairo_create(target);
+  surface_t dst = surface((uint32_t *)cairo_image_surface_get_data(target),
+                          WIDTH,
+                          HEIGHT,
+                          cairo_image_surface_get_stride(target));
+
+  printf("%d glyphs per frame, %d frames\n", LINES * COLUMNS, FRAMES);
+
+  benchCairo(cr, 0);
+  benchAtlas(&dst, 512, 0);
+
+  benchCairo(cr, 1);
+  benchAtlas(&dst, 512, 1);
+
+  /* Room for fewer glyphs than one frame uses, evicts and flushes early all the time */
+  benchAtlas(&dst, 96, 1);
+
+  cairo_destroy(cr);
+  cairo_surface_destroy(target);
+
+  return 0;
+}
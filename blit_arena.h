@@ -0,0 +1,225 @@
+#ifndef BLIT_ARENA_H
+#define BLIT_ARENA_H
+
+/*
+ * Bump allocator for data that only lives until the end of the frame
+ * arenaAlloc hands out aligned pieces of one mapping, arenaReset at the frame boundary takes
+ * them all back at once, so nothing is freed one by one and the pages stay faulted in
+ * The mapping is 2MiB huge pages when the system has some reserved (MAP_HUGETLB), otherwise
+ * normal pages with transparent huge pages asked for
+ * A frame that needs more than there is spills into memAlloc, and the next reset grows the
+ * mapping to what that frame used, so once frames stop growing nothing is allocated at all
+ * BLIT_ARENA_MB sets the starting size, 2 by default
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "blit_mem.h"
+#include "blit_stats.h"
+
+#define ARENA_HUGE_PAGE (2u << 20)
+#define ARENA_ALIGN 64 /* a cache line, and enough for any SIMD loads */
+
+typedef enum {
+  ARENA_PAGES, /* plain 4KiB pages */
+  ARENA_THP, /* transparent huge pages, if the kernel gives them to us */
+  ARENA_HUGETLB /* reserved huge pages */
+} arena_backing_t;
+
+typedef struct {
+  uint8_t *base;
+  size_t size;
+  size_t used;
+  arena_backing_t backing;
+
+  void *spills; /* memAlloc'd blocks that didn't fit, linked through their first word */
+  size_t spilled; /* bytes of them this frame */
+
+  size_t high_water; /* most a frame has needed, spills included */
+  uint64_t frames;
+  uint64_t overflows; /* allocations that spilled */
+  uint64_t grows;
+  stat_t per_frame; /* bytes used per frame */
+} arena_t;
+
+static inline const char*
+arenaBackingName(arena_backing_t backing) {
+  switch (backing) {
+    case ARENA_HUGETLB:
+      return "huge pages";
+    case ARENA_THP:
+      return "transparent huge pages";
+    default:
+      return "normal pages";
+  }
+}
+
+static inline int
+arenaMap(arena_t *arena,
+         size_t size) {
+  /* size is a multiple of ARENA_HUGE_PAGE, returns 0 if nothing could be mapped */
+  uint8_t *base = mmap(NULL,
+                       size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+                       -1,
+                       0);
+
+  if (base != MAP_FAILED) {
+    arena->base = base;
+    arena->size = size;
+    arena->backing = ARENA_HUGETLB;
+    return 1;
+  }
+
+  /* No reserved huge pages, map a huge page more than needed so the start can be aligned */
+  /* Transparent huge pages only back aligned 2MiB ranges */
+  uint8_t *map = mmap(NULL,
+                      size + ARENA_HUGE_PAGE,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1,
+                      0);
+
+  if (map == MAP_FAILED) {
+    return 0;
+  }
+
+  base = (uint8_t *)(((uintptr_t)map + ARENA_HUGE_PAGE - 1) & ~(uintptr_t)(ARENA_HUGE_PAGE - 1));
+
+  if (base > map) {
+    munmap(map, (size_t)(base - map));
+  }
+  munmap(base + size, (size_t)(map + ARENA_HUGE_PAGE - base));
+
+  arena->backing = madvise(base, size, MADV_HUGEPAGE) == 0 ? ARENA_THP : ARENA_PAGES;
+
+  /* Fault it all in now rather than in the middle of a frame */
+  memset(base, 0, size);
+
+  arena->base = base;
+  arena->size = size;
+  return 1;
+}
+
+static inline void
+arenaUnmap(arena_t *arena) {
+  if (arena->base != NULL) {
+    munmap(arena->base, arena->size);
+  }
+  arena->base = NULL;
+  arena->size = 0;
+}
+
+static inline arena_t*
+allocArena(void) {
+  size_t mb = getenv("BLIT_ARENA_MB") != NULL ? strtoull(getenv("BLIT_ARENA_MB"), NULL, 10) : 2;
+  size_t size = ((mb << 20) + ARENA_HUGE_PAGE - 1) & ~(size_t)(ARENA_HUGE_PAGE - 1);
+  arena_t *arena = memCalloc(1, sizeof(arena_t));
+
+  arena->per_frame = newStat("arena: bytes/frame");
+
+  /* Without a mapping everything spills, which still works, just without the point of it */
+  if (!arenaMap(arena, size > 0 ? size : ARENA_HUGE_PAGE)) {
+    fprintf(stderr, "Could not map the frame arena, using malloc\n");
+  }
+  else {
+    printf("arena: %zu KiB of %s\n", arena->size / 1024, arenaBackingName(arena->backing));
+  }
+
+  return arena;
+}
+
+static inline void*
+arenaAlloc(arena_t *arena,
+           size_t size) {
+  /* Aligned to ARENA_ALIGN, good until the next arenaReset */
+  size_t start = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  if (start + size <= arena->size) {
+    arena->used = start + size;
+    return arena->base + start;
+  }
+
+  /* Keeps the spill's alignment, the link goes in the first ARENA_ALIGN bytes */
+  uint8_t *block = memAlloc(size + 2 * ARENA_ALIGN);
+
+  if (block == NULL) {
+    return NULL;
+  }
+
+  *(void **)block = arena->spills;
+  arena->spills = block;
+  arena->spilled += size;
+  arena->overflows++;
+
+  return (uint8_t *)(((uintptr_t)block + 2 * ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1));
+}
+
+static inline void
+arenaReset(arena_t *arena) {
+  /* Call at the end of every frame, everything from arenaAlloc is gone after this */
+  size_t used = arena->used + arena->spilled;
+
+  while (arena->spills != NULL) {
+    void *next = *(void **)arena->spills;
+
+    memFree(arena->spills);
+    arena->spills = next;
+  }
+
+  /* Room for what this frame needed next time, nothing is live now so it can move */
+  if (arena->spilled > 0) {
+    size_t size = (used + used / 4 + ARENA_HUGE_PAGE - 1) & ~(size_t)(ARENA_HUGE_PAGE - 1);
+
+    arenaUnmap(arena);
+
+    if (arenaMap(arena, size)) {
+      arena->grows++;
+      printf("arena: grew to %zu KiB of %s\n", arena->size / 1024, arenaBackingName(arena->backing));
+    }
+  }
+
+  if (used > arena->high_water) {
+    arena->high_water = used;
+  }
+
+  statAdd(&arena->per_frame, used);
+
+  arena->used = 0;
+  arena->spilled = 0;
+
+  if (++arena->frames % 100 == 0) {
+    printf("arena: high water %zu of %zu KiB, %llu spills, grown %llu times\n",
+           arena->high_water / 1024,
+           arena->size / 1024,
+           (unsigned long long)arena->overflows,
+           (unsigned long long)arena->grows);
+    statPrint(&arena->per_frame, 1024.0, "KiB");
+    statReset(&arena->per_frame);
+  }
+}
+
+static inline void
+freeArena(arena_t *arena) {
+  if (arena == NULL) {
+    return;
+  }
+  arena->used = 0;
+
+  while (arena->spills != NULL) {
+    void *next = *(void **)arena->spills;
+
+    memFree(arena->spills);
+    arena->spills = next;
+  }
+  arenaUnmap(arena);
+  memFree(arena);
+}
+
+#endif
@@ -0,0 +1,426 @@
+#ifndef BLIT_ASSET_H
+#define BLIT_ASSET_H
+
+/*
+ * Image assets, mmapped and decoded straight into surfaces in the backbuffer's format
+ * (cairo ARGB32, premultiplied), there is no intermediate RGB copy
+ * Reads binary PPM (P6), PAM (P7, RGB or RGB_ALPHA) and QOI, 8 bits per channel only
+ * Any range of rows can be decoded on its own, so a big image can be streamed in through a
+ * band sized buffer instead of all at once
+ * PPM and PAM rows are at fixed offsets so any range is direct, QOI has to be decoded in order,
+ * asking for rows after the last range carries on where it stopped, going back starts over
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blit_mem.h"
+#include "blit_sprite.h"
+
+typedef enum {
+  ASSET_PPM,
+  ASSET_PAM,
+  ASSET_QOI
+} asset_format_t;
+
+typedef struct {
+  const uint8_t *map;
+  size_t size;
+  asset_format_t format;
+  int width;
+  int height;
+  int channels; /* 3 or 4 */
+  size_t data; /* offset of the first pixel */
+
+  /* Where QOI decoding stopped, the run can carry over from one row to the next */
+  size_t pos;
+  int row;
+  int run;
+  uint32_t px; /* r | g << 8 | b << 16 | a << 24 */
+  uint32_t index[64];
+} asset_t;
+
+static inline int
+assetNumber(const uint8_t *map,
+            size_t size,
+            size_t *pos) {
+  /* Next number in a PPM header, skipping whitespace and comments, -1 if there isn't one */
+  while (*pos < size) {
+    uint8_t c = map[*pos];
+
+    if (c == '#') {
+      while (*pos < size && map[*pos] != '\n') {
+        (*pos)++;
+      }
+    }
+    else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      (*pos)++;
+    }
+    else {
+      break;
+    }
+  }
+
+  int value = -1;
+
+  while (*pos < size && map[*pos] >= '0' && map[*pos] <= '9') {
+    value = (value < 0 ? 0 : value * 10) + (map[(*pos)++] - '0');
+
+    if (value > 1 << 24) {
+      return -1;
+    }
+  }
+  return value;
+}
+
+static inline int
+assetPPMHeader(asset_t *asset) {
+  size_t pos = 2;
+
+  asset->format = ASSET_PPM;
+  asset->channels = 3;
+  asset->width = assetNumber(asset->map, asset->size, &pos);
+  asset->height = assetNumber(asset->map, asset->size, &pos);
+
+  int maxval = assetNumber(asset->map, asset->size, &pos);
+
+  if (maxval != 255) {
+    return 0;
+  }
+
+  /* Exactly one whitespace byte before the pixels */
+  asset->data = pos + 1;
+  return 1;
+}
+
+static inline int
+assetPAMHeader(asset_t *asset) {
+  size_t pos = 2;
+  int maxval = 0;
+
+  asset->format = ASSET_PAM;
+
+  while (pos < asset->size) {
+    const char *line = (const char *)asset->map + pos;
+    const uint8_t *end = memchr(line, '\n', asset->size - pos);
+
+    if (end == NULL) {
+      return 0;
+    }
+
+    size_t next = (size_t)(end - asset->map) + 1;
+    size_t value = pos;
+
+    if (strncmp(line, "ENDHDR", 6) == 0) {
+      asset->data = next;
+      return maxval == 255 && (asset->channels == 3 || asset->channels == 4);
+    }
+
+    if (strncmp(line, "WIDTH ", 6) == 0) {
+      value += 6;
+      asset->width = assetNumber(asset->map, next, &value);
+    }
+    else if (strncmp(line, "HEIGHT ", 7) == 0) {
+      value += 7;
+      asset->height = assetNumber(asset->map, next, &value);
+    }
+    else if (strncmp(line, "DEPTH ", 6) == 0) {
+      value += 6;
+      asset->channels = assetNumber(asset->map, next, &value);
+    }
+    else if (strncmp(line, "MAXVAL ", 7) == 0) {
+      value += 7;
+      maxval = assetNumber(asset->map, next, &value);
+    }
+    /* TUPLTYPE and comments don't change anything, DEPTH says it all */
+
+    pos = next;
+  }
+  return 0;
+}
+
+static inline uint32_t
+assetBE32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void
+assetQOIReset(asset_t *asset) {
+  asset->pos = asset->data;
+  asset->row = 0;
+  asset->run = 0;
+  asset->px = 0xff000000;
+  memset(asset->index, 0, sizeof(asset->index));
+}
+
+static inline int
+assetQOIHeader(asset_t *asset) {
+  if (asset->size < 14 + 8) {
+    return 0;
+  }
+
+  uint32_t width = assetBE32(asset->map + 4);
+  uint32_t height = assetBE32(asset->map + 8);
+
+  /* Same limit as the PPM and PAM headers, anything bigger isn't masked down but refused */
+  if (width >= 1u << 24 || height >= 1u << 24) {
+    return 0;
+  }
+
+  asset->format = ASSET_QOI;
+  asset->width = (int)width;
+  asset->height = (int)height;
+  asset->channels = asset->map[12];
+  asset->data = 14;
+
+  assetQOIReset(asset);
+
+  return asset->channels == 3 || asset->channels == 4;
+}
+
+static inline void
+closeAsset(asset_t *asset) {
+  if (asset == NULL) {
+    return;
+  }
+  munmap((void *)asset->map, asset->size);
+  memFree(asset);
+}
+
+static inline asset_t*
+openAsset(const char *path) {
+  /* Only reads the header, the pixels are paged in as rows get decoded */
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+
+  if (fd < 0 || fstat(fd, &info) != 0 || info.st_size < 8) {
+    fprintf(stderr, "Could not open %s\n", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+
+  void *map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s\n", path);
+    return NULL;
+  }
+
+  asset_t *asset = memCalloc(1, sizeof(asset_t));
+
+  asset->map = map;
+  asset->size = (size_t)info.st_size;
+
+  int ok = 0;
+
+  if (memcmp(asset->map, "qoif", 4) == 0) {
+    ok = assetQOIHeader(asset);
+    /* Decoded front to back, let the kernel read ahead */
+    madvise(map, asset->size, MADV_SEQUENTIAL);
+  }
+  else if (memcmp(asset->map, "P6", 2) == 0) {
+    ok = assetPPMHeader(asset);
+  }
+  else if (memcmp(asset->map, "P7", 2) == 0) {
+    ok = assetPAMHeader(asset);
+  }
+
+  if (ok && asset->format != ASSET_QOI &&
+      asset->size < asset->data + (size_t)asset->width * asset->height * asset->channels) {
+    ok = 0;
+  }
+
+  if (!ok || asset->width <= 0 || asset->height <= 0) {
+    fprintf(stderr, "%s is not an 8 bit PPM, PAM or QOI file\n", path);
+    closeAsset(asset);
+    return NULL;
+  }
+
+  return asset;
+}
+
+static inline uint32_t
+assetPixel(uint32_t r,
+           uint32_t g,
+           uint32_t b,
+           uint32_t a) {
+  /* Straight alpha to premultiplied ARGB32 */
+  if (a == 255) {
+    return 0xff000000 | r << 16 | g << 8 | b;
+  }
+  return a << 24 | mulDiv255(r, a) << 16 | mulDiv255(g, a) << 8 | mulDiv255(b, a);
+}
+
+static inline void
+assetRowRaw(const asset_t *asset,
+            int y,
+            uint32_t *out) {
+  const uint8_t *in = asset->map + asset->data + (size_t)y * asset->width * asset->channels;
+
+  if (asset->channels == 3) {
+    for (int x = 0; x < asset->width; x++, in += 3) {
+      out[x] = 0xff000000 | (uint32_t)in[0] << 16 | (uint32_t)in[1] << 8 | in[2];
+    }
+    return;
+  }
+
+  for (int x = 0; x < asset->width; x++, in += 4) {
+    out[x] = assetPixel(in[0], in[1], in[2], in[3]);
+  }
+}
+
+static inline int
+assetRowQOI(asset_t *asset,
+            uint32_t *out) {
+  /* One row from where the last one stopped, 0 if the data runs out */
+  const uint8_t *map = asset->map;
+  size_t end = asset->size - 8; /* the end marker */
+  size_t pos = asset->pos;
+  uint32_t px = asset->px;
+  int run = asset->run;
+
+  for (int x = 0; x < asset->width; x++) {
+    if (run > 0) {
+      run--;
+    }
+    else {
+      if (pos >= end) {
+        return 0;
+      }
+
+      uint8_t op = map[pos++];
+
+      if (op == 0xfe) {
+        if (pos + 3 > end) {
+          return 0;
+        }
+        px = (px & 0xff000000) | map[pos] | (uint32_t)map[pos + 1] << 8 | (uint32_t)map[pos + 2] << 16;
+        pos += 3;
+      }
+      else if (op == 0xff) {
+        if (pos + 4 > end) {
+          return 0;
+        }
+        px = map[pos] | (uint32_t)map[pos + 1] << 8 | (uint32_t)map[pos + 2] << 16 | (uint32_t)map[pos + 3] << 24;
+        pos += 4;
+      }
+      else if ((op & 0xc0) == 0x00) {
+        px = asset->index[op];
+      }
+      else if ((op & 0xc0) == 0x40) {
+        uint32_t r = ((px & 0xff) + ((op >> 4) & 3) - 2) & 0xff;
+        uint32_t g = (((px >> 8) & 0xff) + ((op >> 2) & 3) - 2) & 0xff;
+        uint32_t b = (((px >> 16) & 0xff) + (op & 3) - 2) & 0xff;
+
+        px = (px & 0xff000000) | r | g << 8 | b << 16;
+      }
+      else if ((op & 0xc0) == 0x80) {
+        if (pos >= end) {
+          return 0;
+        }
+
+        int dg = (op & 0x3f) - 32;
+        int dr = dg + (map[pos] >> 4) - 8;
+        int db = dg + (map[pos] & 0x0f) - 8;
+        pos++;
+
+        uint32_t r = ((px & 0xff) + (uint32_t)dr) & 0xff;
+        uint32_t g = (((px >> 8) & 0xff) + (uint32_t)dg) & 0xff;
+        uint32_t b = (((px >> 16) & 0xff) + (uint32_t)db) & 0xff;
+
+        px = (px & 0xff000000) | r | g << 8 | b << 16;
+      }
+      else {
+        /* The current pixel is written below, the rest of the run comes after */
+        run = op & 0x3f;
+      }
+
+      uint32_t r = px & 0xff;
+      uint32_t g = (px >> 8) & 0xff;
+      uint32_t b = (px >> 16) & 0xff;
+      uint32_t a = px >> 24;
+
+      asset->index[(r * 3 + g * 5 + b * 7 + a * 11) & 63] = px;
+    }
+
+    out[x] = assetPixel(px & 0xff, (px >> 8) & 0xff, (px >> 16) & 0xff, px >> 24);
+  }
+
+  asset->pos = pos;
+  asset->px = px;
+  asset->run = run;
+  asset->row++;
+
+  return 1;
+}
+
+static inline int
+assetRows(asset_t *asset,
+          int first,
+          int count,
+          const surface_t *dst) {
+  /* Decodes rows [first, first + count) into dst starting at its top row */
+  /* dst has to be at least as wide as the image, returns how many rows were decoded */
+  if (first < 0 || dst->width < asset->width) {
+    return 0;
+  }
+
+  count = first + count > asset->height ? asset->height - first : count;
+  count = count > dst->height ? dst->height : count;
+
+  if (asset->format != ASSET_QOI) {
+    for (int y = 0; y < count; y++) {
+      assetRowRaw(asset, first + y, surfaceRow(dst, y));
+    }
+    return count < 0 ? 0 : count;
+  }
+
+  if (first < asset->row) {
+    assetQOIReset(asset);
+  }
+
+  /* Rows before the range still have to be decoded, into the first row of dst */
+  while (asset->row < first) {
+    if (!assetRowQOI(asset, surfaceRow(dst, 0))) {
+      return 0;
+    }
+  }
+
+  for (int y = 0; y < count; y++) {
+    if (!assetRowQOI(asset, surfaceRow(dst, y))) {
+      return y;
+    }
+  }
+  return count < 0 ? 0 : count;
+}
+
+static inline surface_t
+assetSurface(asset_t *asset) {
+  /* The whole image in a surface of its own, memFree the pixels when done */
+  /* pixels is NULL and the size 0 if there isn't memory for it */
+  surface_t s = surface(memAlloc((size_t)asset->width * asset->height * 4),
+                        asset->width,
+                        asset->height,
+                        asset->width * 4);
+
+  if (s.pixels == NULL) {
+    fprintf(stderr, "No memory for a %dx%d image\n", asset->width, asset->height);
+    return surface(NULL, 0, 0, 0);
+  }
+
+  if (assetRows(asset, 0, asset->height, &s) != asset->height) {
+    memset(s.pixels, 0, (size_t)s.stride * s.height);
+  }
+  return s;
+}
+
+#endif
@@ -0,0 +1,329 @@
+#ifndef BLIT_BANDS_H
+#define BLIT_BANDS_H
+
+/*
+ * Uploads a frame over several X connections at once, one horizontal band each
+ * One connection means one socket and one libxcb lock, so a big put_image goes out at whatever
+ * a single writer manages, with BLIT_CONNECTIONS=N the frame is cut into N bands and every band
+ * but the first is put by a thread of its own, on a connection of its own
+ * They all go into one pixmap on the server, the first band and the copy to the window go
+ * over the main connection
+ * The server doesn't order requests from different clients, so each worker ends its band with
+ * a round trip, once they're all back the bands are in the pixmap and the copy can go
+ * Needs a 32 bits per pixel format for the window's depth, the frame's rows are sent as is
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xcb/xcb.h>
+
+#include "blit_convert.h"
+#include "blit_mem.h"
+#include "blit_stats.h"
+
+#define BANDS_MAX 16
+
+typedef struct bands bands_t;
+
+typedef struct {
+  bands_t *bands;
+  pthread_t thread;
+  int index;
+  xcb_connection_t *display; /* band 0 uses the main connection */
+  xcb_gcontext_t gc;
+  size_t max_bytes; /* biggest put_image this connection takes */
+} band_worker_t;
+
+struct bands {
+  int connections; /* including the main one */
+  xcb_connection_t *display;
+  xcb_window_t window;
+  xcb_gcontext_t gc;
+  xcb_pixmap_t pixmap;
+  uint8_t depth;
+  int width;
+  int height;
+
+  /* The frame the workers are on */
+  const uint8_t *data;
+  int stride;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  uint64_t generation;
+  int pending;
+  int quit;
+
+  band_worker_t workers[BANDS_MAX];
+
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t busy; /* ns spent uploading, for the throughput */
+  stat_t upload_time; /* first put to the last band being on the server */
+  stat_t copy_time;
+};
+
+static inline void
+bandUpload(bands_t *bands,
+           int index) {
+  /* Puts this worker's rows into the pixmap, in pieces under its max request length */
+  band_worker_t *worker = &bands->workers[index];
+  int y0 = bands->height * index / bands->connections;
+  int y1 = bands->height * (index + 1) / bands->connections;
+  size_t row_bytes = (size_t)bands->width * 4;
+
+  /* Rows with padding past the width have to go one at a time */
+  int step = (size_t)bands->stride == row_bytes ? (int)(worker->max_bytes / row_bytes) : 1;
+
+  step = step < 1 ? 1 : step;
+
+  for (int top = y0; top < y1; top += step) {
+    int n = y1 - top < step ? y1 - top : step;
+
+    xcb_put_image(worker->display,
+                  XCB_IMAGE_FORMAT_Z_PIXMAP,
+                  bands->pixmap,
+                  worker->gc,
+                  (uint16_t)bands->width, (uint16_t)n,
+                  0, (int16_t)top,
+                  0,
+                  bands->depth,
+                  (uint32_t)(row_bytes * n),
+                  bands->data + (size_t)top * bands->stride);
+  }
+
+  /* The main connection's own band is ordered before the copy already */
+  if (index == 0) {
+    return;
+  }
+
+  /* Plain free, the mem counters aren't thread safe */
+  free(xcb_get_input_focus_reply(worker->display, xcb_get_input_focus(worker->display), NULL));
+
+  /* Nothing is read from these connections otherwise, errors would pile up */
+  xcb_generic_event_t *event;
+
+  while ((event = xcb_poll_for_event(worker->display)) != NULL) {
+    free(event);
+  }
+}
+
+static void*
+bandWorker(void *arg) {
+  band_worker_t *worker = arg;
+  bands_t *bands = worker->bands;
+  uint64_t seen = 0;
+
+  pthread_mutex_lock(&bands->lock);
+
+  while (1) {
+    while (bands->generation == seen && !bands->quit) {
+      pthread_cond_wait(&bands->start, &bands->lock);
+    }
+
+    if (bands->quit) {
+      break;
+    }
+    seen = bands->generation;
+
+    pthread_mutex_unlock(&bands->lock);
+    bandUpload(bands, worker->index);
+    pthread_mutex_lock(&bands->lock);
+
+    if (--bands->pending == 0) {
+      pthread_cond_signal(&bands->done);
+    }
+  }
+
+  pthread_mutex_unlock(&bands->lock);
+  return NULL;
+}
+
+static inline void
+bandsResize(bands_t *bands,
+            int width,
+            int height) {
+  /* Only between frames, the workers aren't touching the pixmap then */
+  if (bands->pixmap != XCB_NONE) {
+    xcb_free_pixmap(bands->display, bands->pixmap);
+  }
+
+  bands->pixmap = xcb_generate_id(bands->display);
+  bands->width = width;
+  bands->height = height;
+
+  xcb_create_pixmap(bands->display, bands->depth, bands->pixmap, bands->window, (uint16_t)width, (uint16_t)height);
+
+  /* The other connections can only use it once the server has made it */
+  memFreeReply(memReply(xcb_get_input_focus_reply(bands->display, xcb_get_input_focus(bands->display), NULL)));
+}
+
+static inline bands_t*
+allocBands(xcb_connection_t *display,
+           xcb_screen_t *screen,
+           xcb_window_t window,
+           int width,
+           int height) {
+  /* NULL unless BLIT_CONNECTIONS is set, or if the window's format can't take the rows as is */
+  if (getenv("BLIT_CONNECTIONS") == NULL) {
+    return NULL;
+  }
+
+  int connections = atoi(getenv("BLIT_CONNECTIONS"));
+  const xcb_setup_t *setup = xcb_get_setup(display);
+
+  connections = connections < 1 ? 1 : connections;
+  connections = connections > BANDS_MAX ? BANDS_MAX : connections;
+
+  if (formatBpp(setup, screen->root_depth) != 32 || setup->image_byte_order != XCB_IMAGE_ORDER_LSB_FIRST) {
+    fprintf(stderr, "BLIT_CONNECTIONS needs 32 bit LSB first pixels, uploading over one connection\n");
+    return NULL;
+  }
+
+  bands_t *bands = memCalloc(1, sizeof(bands_t));
+
+  bands->connections = connections;
+  bands->display = display;
+  bands->window = window;
+  bands->depth = screen->root_depth;
+  bands->upload_time = newStat("bands: upload");
+  bands->copy_time = newStat("bands: copy");
+
+  /* No NoExpose event for every copy */
+  uint32_t values[1] = {0};
+
+  bands->gc = xcb_generate_id(display);
+  xcb_create_gc(display, bands->gc, window, XCB_GC_GRAPHICS_EXPOSURES, values);
+
+  pthread_mutex_init(&bands->lock, NULL);
+  pthread_cond_init(&bands->start, NULL);
+  pthread_cond_init(&bands->done, NULL);
+
+  /* Worker 0 is the calling thread on the main connection */
+  for (int i = 0; i < connections; i++) {
+    band_worker_t *worker = &bands->workers[i];
+
+    worker->bands = bands;
+    worker->index = i;
+    worker->display = i == 0 ? display : xcb_connect(NULL, NULL);
+
+    if (xcb_connection_has_error(worker->display)) {
+      fprintf(stderr, "Could not open connection %d\n", i);
+      xcb_disconnect(worker->display);
+      bands->connections = i;
+      break;
+    }
+
+    worker->gc = i == 0 ? bands->gc : xcb_generate_id(worker->display);
+    worker->max_bytes = (size_t)xcb_get_maximum_request_length(worker->display) * 4 - 64;
+
+    /* A GC only needs a drawable of the right depth and screen, the window isn't ours on this one */
+    if (i > 0) {
+      xcb_create_gc(worker->display, worker->gc, window, 0, NULL);
+      xcb_flush(worker->display);
+    }
+
+    if (i > 0 && pthread_create(&worker->thread, NULL, bandWorker, worker) != 0) {
+      fprintf(stderr, "Could not start band thread %d\n", i);
+      xcb_disconnect(worker->display);
+      bands->connections = i;
+      break;
+    }
+  }
+
+  bandsResize(bands, width, height);
+
+  printf("bands: %d connections, %d rows each\n", bands->connections, height / bands->connections);
+
+  return bands;
+}
+
+static inline void
+bandsPresent(bands_t *bands,
+             const uint8_t *data,
+             int stride,
+             int width,
+             int height) {
+  /* Blocks until every band is on the server, then copies the whole frame to the window */
+  if (width != bands->width || height != bands->height) {
+    bandsResize(bands, width, height);
+  }
+
+  uint64_t start = getTimeNs();
+
+  pthread_mutex_lock(&bands->lock);
+  bands->data = data;
+  bands->stride = stride;
+  bands->pending = bands->connections - 1;
+  bands->generation++;
+  pthread_cond_broadcast(&bands->start);
+  pthread_mutex_unlock(&bands->lock);
+
+  bandUpload(bands, 0);
+
+  pthread_mutex_lock(&bands->lock);
+  while (bands->pending > 0) {
+    pthread_cond_wait(&bands->done, &bands->lock);
+  }
+  pthread_mutex_unlock(&bands->lock);
+
+  uint64_t uploaded = getTimeNs();
+
+  xcb_copy_area(bands->display,
+                bands->pixmap,
+                bands->window,
+                bands->gc,
+                0, 0,
+                0, 0,
+                (uint16_t)width, (uint16_t)height);
+
+  statAdd(&bands->upload_time, uploaded - start);
+  statAdd(&bands->copy_time, getTimeNs() - uploaded);
+
+  bands->bytes += (uint64_t)width * height * 4;
+  bands->busy += uploaded - start;
+
+  if (++bands->frames % 100 == 0) {
+    printf("bands: %d connections, %.1f MiB/s while uploading\n",
+           bands->connections,
+           bands->busy > 0 ? (double)bands->bytes / (1024.0 * 1024.0) / (bands->busy / 1e9) : 0.0);
+    statPrint(&bands->upload_time, 1e6, "ms");
+    statPrint(&bands->copy_time, 1e6, "ms");
+    statReset(&bands->upload_time);
+    statReset(&bands->copy_time);
+    bands->bytes = 0;
+    bands->busy = 0;
+  }
+}
+
+static inline void
+freeBands(bands_t *bands) {
+  if (bands == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&bands->lock);
+  bands->quit = 1;
+  pthread_cond_broadcast(&bands->start);
+  pthread_mutex_unlock(&bands->lock);
+
+  for (int i = 1; i < bands->connections; i++) {
+    pthread_join(bands->workers[i].thread, NULL);
+    xcb_free_gc(bands->workers[i].display, bands->workers[i].gc);
+    xcb_disconnect(bands->workers[i].display);
+  }
+
+  pthread_mutex_destroy(&bands->lock);
+  pthread_cond_destroy(&bands->start);
+  pthread_cond_destroy(&bands->done);
+
+  xcb_free_pixmap(bands->display, bands->pixmap);
+  xcb_free_gc(bands->display, bands->gc);
+  memFree(bands);
+}
+
+#endif
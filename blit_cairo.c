@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <cairo-xcb.h>
 #include <cairo.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +9,24 @@
 #include <unistd.h>
 #include <xcb/xcb.h>
 
+#include "blit_asset.h"
+#include "blit_bands.h"
+#include "blit_cmd.h"
+#include "blit_convert.h"
+#include "blit_diff.h"
+#include "blit_events.h"
+#include "blit_framesync.h"
+#include "blit_latency.h"
+#include "blit_mem.h"
+#include "blit_queue.h"
+#include "blit_randr.h"
+#include "blit_scale.h"
+#include "blit_sched.h"
+#include "blit_sprite.h"
+#include "blit_stats.h"
+#include "blit_stream.h"
+#include "blit_text.h"
+
 /* Macro definition to parse X server events
  * The ~0x80 is needed to get the lower 7 bits
  */
@@ -83,21 +102,641 @@ allocScreen(xcb_connection_t *display) {
   return screen;
 }
 
+/* What draw puts in the backbuffer, picked with BLIT_CONTENT */
+typedef enum {
+  CONTENT_FILL, /* the whole buffer set to one value that changes every frame */
+  CONTENT_STATIC, /* the same picture every frame */
+  CONTENT_SCROLL, /* stripes moving down one row per frame */
+  CONTENT_MOTION, /* every pixel changes every frame */
+  CONTENT_SPRITES, /* lots of alpha blended sprites from an atlas, BLIT_SPRITES sets how many */
+  CONTENT_COMMANDS, /* the command buffer demo scene, BLIT_RECORD=file saves every frame */
+  CONTENT_IMAGE, /* BLIT_IMAGE (a PPM, PAM or QOI file) tiled over the window and panning */
+  CONTENT_VECTOR /* fills, curves and text drawn with cairo instead of into the pixels */
+} content_t;
+
+/* Where frames are drawn before the present, picked with BLIT_BACKBUF */
+typedef enum {
+  BACKBUF_IMAGE, /* client side image, every present sends all of its pixels to the server */
+  BACKBUF_PIXMAP /* server side pixmap, cairo drawing turns into render requests and the present is a copy on the server */
+} backbuf_mode_t;
+
+/* Sprite atlas drawn once with cairo, then blitted from every frame */
+typedef struct {
+  cairo_surface_t *atlas_surface;
+  surface_t atlas;
+  blit_batch_t batch;
+  int size;
+  int count;
+} sprites_t;
+
+/* Recorded every frame, replayed only if it differs from the last one */
+typedef struct {
+  cmd_buffer_t cur;
+  cmd_buffer_t last;
+  surface_t atlases[CMD_ATLASES];
+  const void *target; /* pixels the last replay went into */
+  FILE *record;
+  uint64_t reused;
+} commands_t;
+
+/* Decoded once from BLIT_IMAGE, already in the backbuffer's format */
+typedef struct {
+  surface_t pixels;
+} image_t;
+
+/* Frame stats drawn over the picture with BLIT_HUD=1, glyphs come from an atlas */
+typedef struct {
+  text_t *text;
+  blit_batch_t batch;
+  uint64_t render_time; /* last frame's, this one isn't done yet */
+} hud_t;
+
+content_t
+getContent() {
+  const char *content = getenv("BLIT_CONTENT");
+
+  if (content == NULL || strcmp(content, "fill") == 0) {
+    return CONTENT_FILL;
+  }
+  if (strcmp(content, "static") == 0) {
+    return CONTENT_STATIC;
+  }
+  if (strcmp(content, "scroll") == 0) {
+    return CONTENT_SCROLL;
+  }
+  if (strcmp(content, "motion") == 0) {
+    return CONTENT_MOTION;
+  }
+  if (strcmp(content, "sprites") == 0) {
+    return CONTENT_SPRITES;
+  }
+  if (strcmp(content, "commands") == 0) {
+    return CONTENT_COMMANDS;
+  }
+  if (strcmp(content, "image") == 0) {
+    return CONTENT_IMAGE;
+  }
+  if (strcmp(content, "vector") == 0) {
+    return CONTENT_VECTOR;
+  }
+
+  fprintf(stderr, "Unknown BLIT_CONTENT %s, using fill\n", content);
+  return CONTENT_FILL;
+}
+
+backbuf_mode_t
+getBackBufMode() {
+  const char *mode = getenv("BLIT_BACKBUF");
+
+  if (mode == NULL || strcmp(mode, "image") == 0) {
+    return BACKBUF_IMAGE;
+  }
+  if (strcmp(mode, "pixmap") == 0) {
+    return BACKBUF_PIXMAP;
+  }
+
+  fprintf(stderr, "Unknown BLIT_BACKBUF %s, using image\n", mode);
+  return BACKBUF_IMAGE;
+}
+
+sprites_t*
+allocSprites(void) {
+  /* 64 translucent circles of 32x32 in a 256x256 atlas */
+  sprites_t *sprites = memCalloc(1, sizeof(sprites_t));
+
+  sprites->size = 32;
+  sprites->count = getenv("BLIT_SPRITES") != NULL ? atoi(getenv("BLIT_SPRITES")) : 10000;
+  sprites->atlas_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 256, 256);
+
+  cairo_t *cr = cairo_create(sprites->atlas_surface);
+
+  for (int i = 0; i < 64; i++) {
+    int x = (i % 8) * sprites->size;
+    int y = (i / 8) * sprites->size;
+
+    cairo_set_source_rgba(cr,
+                          (i % 4) / 3.0,
+                          ((i / 4) % 4) / 3.0,
+                          (i / 16) / 3.0,
+                          0.75);
+    cairo_arc(cr, x + 16, y + 16, 15, 0, 2 * 3.14159265);
+    cairo_fill(cr);
+  }
+
+  cairo_destroy(cr);
+  cairo_surface_flush(sprites->atlas_surface);
+
+  sprites->atlas = surface((uint32_t *)cairo_image_surface_get_data(sprites->atlas_surface),
+                           256,
+                           256,
+                           cairo_image_surface_get_stride(sprites->atlas_surface));
+
+  return sprites;
+}
+
+void
+freeSprites(sprites_t *sprites) {
+  if (sprites == NULL) {
+    return;
+  }
+  blitBatchFree(&sprites->batch);
+  cairo_surface_destroy(sprites->atlas_surface);
+  memFree(sprites);
+}
+
+image_t*
+allocImage(void) {
+  const char *path = getenv("BLIT_IMAGE");
+  asset_t *asset = path != NULL ? openAsset(path) : NULL;
+
+  if (asset == NULL) {
+    fprintf(stderr, "BLIT_CONTENT=image needs BLIT_IMAGE set to a PPM, PAM or QOI file\n");
+    return NULL;
+  }
+
+  image_t *image = memCalloc(1, sizeof(image_t));
+  uint64_t start = getTimeNs();
+
+  image->pixels = assetSurface(asset);
+
+  if (image->pixels.pixels == NULL) {
+    closeAsset(asset);
+    memFree(image);
+    return NULL;
+  }
+
+  printf("Loaded %s, %dx%d in %.2fms\n",
+         path,
+         asset->width,
+         asset->height,
+         (getTimeNs() - start) / 1e6);
+
+  closeAsset(asset);
+  return image;
+}
+
+void
+freeImage(image_t *image) {
+  if (image == NULL) {
+    return;
+  }
+  memFree(image->pixels.pixels);
+  memFree(image);
+}
+
+static void
+drawImage(surface_t *dst,
+          image_t *image,
+          int v) {
+  /* Tiled, so any size of image covers the window, and panning diagonally */
+  int w = image->pixels.width;
+  int h = image->pixels.height;
+  int off_x = v % w;
+  int off_y = (v / 2) % h;
+
+  for (int y = -off_y; y < dst->height; y += h) {
+    for (int x = -off_x; x < dst->width; x += w) {
+      blitRect(dst, blit(&image->pixels, 0, 0, w, h, x, y));
+    }
+  }
+}
+
+commands_t*
+allocCommands(void) {
+  commands_t *commands = memCalloc(1, sizeof(commands_t));
+
+  commands->atlases[0] = genAtlas(32);
+
+  if (getenv("BLIT_RECORD") != NULL) {
+    commands->record = fopen(getenv("BLIT_RECORD"), "wb");
+
+    if (commands->record == NULL || !cmdWriteHeader(commands->record, commands->atlases, 1)) {
+      fprintf(stderr, "Could not record to %s\n", getenv("BLIT_RECORD"));
+    }
+  }
+  return commands;
+}
+
+void
+freeCommands(commands_t *commands) {
+  if (commands == NULL) {
+    return;
+  }
+  if (commands->record != NULL) {
+    fclose(commands->record);
+  }
+  printf("Reused %llu command buffers\n", (unsigned long long)commands->reused);
+
+  cmdFree(&commands->cur);
+  cmdFree(&commands->last);
+  memFree(commands->atlases[0].pixels);
+  memFree(commands);
+}
+
+static void
+drawCommands(surface_t *dst,
+             commands_t *commands,
+             int v) {
+  int count = getenv("BLIT_SPRITES") != NULL ? atoi(getenv("BLIT_SPRITES")) : 2000;
+
+  cmdRecordDemo(&commands->cur, 32, count, v, (uint16_t)dst->width, (uint16_t)dst->height);
+
+  if (commands->record != NULL) {
+    cmdWriteFrame(commands->record, &commands->cur);
+  }
+
+  /* Same commands into the same buffer, what's there is already right */
+  if (commands->target == dst->pixels && cmdEqual(&commands->cur, &commands->last)) {
+    commands->reused++;
+    return;
+  }
+
+  cmdExecSurface(&commands->cur, dst, commands->atlases);
+  cmdSwap(&commands->cur, &commands->last);
+  commands->target = dst->pixels;
+}
+
+static void
+drawSprites(surface_t *dst,
+            sprites_t *sprites,
+            int v) {
+  blitBatchClear(&sprites->batch);
+
+  for (int i = 0; i < sprites->count; i++) {
+    int sprite = i % 64;
+    int span_x = dst->width + sprites->size;
+    int span_y = dst->height + sprites->size;
+
+    blit_t b = blit(&sprites->atlas,
+                    (sprite % 8) * sprites->size,
+                    (sprite / 8) * sprites->size,
+                    sprites->size,
+                    sprites->size,
+                    (int)(((unsigned)i * 7919u + (unsigned)v * (1 + i % 7)) % span_x) - sprites->size,
+                    (int)(((unsigned)i * 104729u + (unsigned)v * (1 + i % 5)) % span_y) - sprites->size);
+
+    b.flags = BLIT_ALPHA;
+    blitBatchAdd(&sprites->batch, b);
+  }
+
+  /* It's a swarm, the order they overlap in doesn't matter so sort for locality */
+  blitBatchRun(dst, &sprites->batch, 1);
+}
+
+static hud_t*
+allocHud(void) {
+  if (getenv("BLIT_HUD") == NULL || strcmp(getenv("BLIT_HUD"), "1") != 0) {
+    return NULL;
+  }
+
+  hud_t *hud = memCalloc(1, sizeof(hud_t));
+  hud->text = allocText("monospace", 14, 256);
+
+  if (hud->text == NULL) {
+    memFree(hud);
+    return NULL;
+  }
+
+  return hud;
+}
+
+static void
+freeHud(hud_t *hud) {
+  if (hud == NULL) {
+    return;
+  }
+  textReport(hud->text);
+  freeText(hud->text);
+  blitBatchFree(&hud->batch);
+  memFree(hud);
+}
+
+static void
+drawHud(cairo_surface_t *backbuffer_surface,
+        hud_t *hud,
+        const sched_t *sched,
+        int v) {
+  surface_t dst = surface((uint32_t *)cairo_image_surface_get_data(backbuffer_surface),
+                          cairo_image_surface_get_width(backbuffer_surface),
+                          cairo_image_surface_get_height(backbuffer_surface),
+                          cairo_image_surface_get_stride(backbuffer_surface));
+  char line[128];
+  int y = 8 + hud->text->line_height;
+
+  cairo_surface_flush(backbuffer_surface);
+  textFrame(hud->text);
+  blitBatchClear(&hud->batch);
+
+  snprintf(line, sizeof(line), "frame %d  %.2fms / %.2fms", v, hud->render_time / 1e6, sched->budget / 1e6);
+  textDraw(hud->text, &hud->batch, &dst, 9, y + 1, line, 0xff000000);
+  textDraw(hud->text, &hud->batch, &dst, 8, y, line, 0xffffffff);
+  y += hud->text->line_height;
+
+  snprintf(line, sizeof(line), "level %d (%d%%)  %llu dropped",
+           sched->level,
+           levelScale(sched->level),
+           (unsigned long long)sched->dropped);
+  textDraw(hud->text, &hud->batch, &dst, 9, y + 1, line, 0xff000000);
+  textDraw(hud->text, &hud->batch, &dst, 8, y, line, 0xffffff00);
+
+  textFlush(hud->text, &hud->batch, &dst);
+  cairo_surface_mark_dirty(backbuffer_surface);
+}
+
+void
+drawVector(cairo_t *cr,
+           int v,
+           uint16_t width,
+           uint16_t height) {
+  /* Only cairo calls, so with a pixmap backbuffer none of it touches client side pixels */
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_rgb(cr, 0.12, 0.13, 0.16);
+  cairo_paint(cr);
+  cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+
+  /* Translucent circles drifting across */
+  for (int i = 0; i < 64; i++) {
+    double x = (double)((i * 7919 + v * (1 + i % 4)) % (width + 80)) - 40;
+    double y = (double)((i * 104729 + v * (1 + i % 3)) % (height + 80)) - 40;
+
+    cairo_set_source_rgba(cr, (i % 5) / 4.0, (i % 7) / 6.0, (i % 3) / 2.0, 0.6);
+    cairo_arc(cr, x, y, 12 + i % 28, 0, 2 * M_PI);
+    cairo_fill(cr);
+  }
+
+  /* Curves from one side to the other, moving with v */
+  cairo_set_line_width(cr, 3);
+
+  for (int i = 0; i < 16; i++) {
+    double y = height * (i + 0.5) / 16;
+    double swing = height / 8.0 * sin((v + i * 20) / 30.0);
+
+    cairo_set_source_rgba(cr, 0.9, 0.6 + i / 40.0, 0.2, 0.8);
+    cairo_move_to(cr, 0, y);
+    cairo_curve_to(cr, width / 3.0, y - swing, width * 2 / 3.0, y + swing, width, y);
+    cairo_stroke(cr);
+  }
+
+  /* A block of text, cairo rasterizes the glyphs every time */
+  char line[64];
+
+  cairo_select_font_face(cr, "sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+  cairo_set_font_size(cr, 16);
+  cairo_set_source_rgb(cr, 0.95, 0.95, 0.95);
+
+  for (int i = 0; i < 24 && 40 + i * 20 < height; i++) {
+    snprintf(line, sizeof(line), "frame %d, line %d: the quick brown fox", v, i);
+    cairo_move_to(cr, 16, 40 + i * 20);
+    cairo_show_text(cr, line);
+  }
+}
+
 void
 draw(cairo_surface_t *backbuffer_surface,
+     content_t content,
+     sprites_t *sprites,
+     commands_t *commands,
+     image_t *image,
      int v,
      uint16_t width,
      uint16_t height) {
   int stride = cairo_image_surface_get_stride(backbuffer_surface);
   unsigned char *data = cairo_image_surface_get_data(backbuffer_surface);
 
-  /* Manpiulate the actual pixel data here */
-  memset(data, v, stride*height);
+  /* The window can be bigger than the backbuffer */
+  int buf_width = cairo_image_surface_get_width(backbuffer_surface);
+  int buf_height = cairo_image_surface_get_height(backbuffer_surface);
+
+  if (content == CONTENT_FILL) {
+    /* Manpiulate the actual pixel data here */
+    memset(data, v, stride*(height < buf_height ? height : buf_height));
+    return;
+  }
+
+  if (content == CONTENT_SPRITES) {
+    surface_t dst = surface((uint32_t *)data, buf_width, buf_height, stride);
+
+    memset(data, 0x20, (size_t)stride * buf_height);
+    drawSprites(&dst, sprites, v);
+    return;
+  }
+
+  if (content == CONTENT_COMMANDS) {
+    surface_t dst = surface((uint32_t *)data, buf_width, buf_height, stride);
+
+    drawCommands(&dst, commands, v);
+    return;
+  }
+
+  if (content == CONTENT_IMAGE) {
+    surface_t dst = surface((uint32_t *)data, buf_width, buf_height, stride);
+
+    if (image != NULL) {
+      drawImage(&dst, image, v);
+    }
+    return;
+  }
+
+  for (int y = 0; y < buf_height; y++) {
+    uint32_t *row = (uint32_t *)(data + (size_t)y * stride);
+
+    for (int x = 0; x < buf_width; x++) {
+      switch (content) {
+        case CONTENT_STATIC:
+          row[x] = ((x / 32 + y / 32) & 1) ? 0x00303030 : 0x00c0c0c0;
+          break;
+        case CONTENT_SCROLL:
+          row[x] = (((y - v) / 16) & 1) ? 0x00204080 : 0x00e0e0e0;
+          break;
+        default:
+          /* Cheap hash, so there is nothing for the RLE to find either */
+          row[x] = ((uint32_t)(x * 73856093) ^ (uint32_t)(y * 19349663) ^ (uint32_t)(v * 83492791)) & 0x00ffffff;
+          break;
+      }
+    }
+  }
+}
+
+/* Remembers the last presented frame so swapBuffers only paints the tiles that changed */
+/* Turned off with BLIT_DIFF=0, then every frame is painted in full */
+typedef struct {
+  uint8_t *prev;
+  dirty_map_t dirty;
+  dirty_map_t damage; /* exposed since the last frame, painted even if unchanged */
+  row_differs_fn differs;
+  int full; /* paint everything next time, the window contents are gone */
+  uint64_t frames;
+  stat_t diff_time;
+  stat_t paint_time;
+  stat_t dirty_tiles;
+} present_t;
+
+present_t*
+allocPresent(cairo_surface_t *backbuffer_surface) {
+  const char *diff = getenv("BLIT_DIFF");
+
+  if (diff != NULL && strcmp(diff, "0") == 0) {
+    return NULL;
+  }
+
+  int stride = cairo_image_surface_get_stride(backbuffer_surface);
+  int height = cairo_image_surface_get_height(backbuffer_surface);
+
+  present_t *present = memCalloc(1, sizeof(present_t));
+
+  present->prev = memCalloc((size_t)stride * height, 1);
+  dirtyMapAlloc(&present->dirty,
+                cairo_image_surface_get_width(backbuffer_surface),
+                height);
+  dirtyMapAlloc(&present->damage,
+                cairo_image_surface_get_width(backbuffer_surface),
+                height);
+
+  if (present->prev == NULL ||
+      present->dirty.bits == NULL ||
+      present->damage.bits == NULL) {
+    fprintf(stderr, "Could not allocate the present buffers\n");
+    exit(1);
+  }
+
+  present->differs = getRowDiffer();
+  present->full = 1;
+  present->diff_time = newStat("Diff");
+  present->paint_time = newStat("Paint");
+  present->dirty_tiles = newStat("Dirty tiles");
+
+  return present;
+}
+
+void
+freePresent(present_t *present) {
+  if (present == NULL) {
+    return;
+  }
+  memFree(present->prev);
+  dirtyMapFree(&present->dirty);
+  dirtyMapFree(&present->damage);
+  memFree(present);
+}
+
+void
+presentDamage(present_t *present,
+              const event_batch_t *batch) {
+  /* Exposed parts of the window have to be painted again even if the frame didn't change there */
+  if (present != NULL && batch->exposes > 0) {
+    dirtyMapSetRect(&present->damage, batch->x1, batch->y1, batch->x2, batch->y2);
+  }
+}
+
+/* Skips cairo for the upload, the frame is converted to the visual's own format and put in the window */
+/* Used for depth 16 and 8 visuals (dithered), or anything else with BLIT_CONVERT=1 */
+typedef struct {
+  converter_t *conv;
+  xcb_connection_t *display;
+  xcb_window_t window;
+  xcb_gcontext_t gc;
+} direct_t;
+
+direct_t*
+allocDirect(xcb_connection_t *display,
+            xcb_screen_t *screen,
+            xcb_window_t window) {
+  const char *convert = getenv("BLIT_CONVERT");
+
+  if (screen->root_depth >= 24 && (convert == NULL || strcmp(convert, "1") != 0)) {
+    return NULL;
+  }
+
+  converter_t *conv = allocConverter(display,
+                                     screen,
+                                     findVisual(display, screen->root_visual));
+
+  if (conv == NULL) {
+    return NULL;
+  }
+
+  direct_t *direct = memCalloc(1, sizeof(direct_t));
+
+  direct->conv = conv;
+  direct->display = display;
+  direct->window = window;
+  direct->gc = xcb_generate_id(display);
+
+  xcb_create_gc(display, direct->gc, window, 0, NULL);
+
+  return direct;
+}
+
+void
+freeDirect(direct_t *direct) {
+  if (direct == NULL) {
+    return;
+  }
+  xcb_free_gc(direct->display, direct->gc);
+  freeConverter(direct->conv);
+  memFree(direct);
+}
+
+static void
+paintRect(cairo_t *front_cr,
+          direct_t *direct,
+          cairo_surface_t *backbuffer_surface,
+          int x,
+          int y,
+          int w,
+          int h) {
+  if (direct != NULL) {
+    convertPut(direct->conv,
+               direct->display,
+               direct->window,
+               direct->gc,
+               cairo_image_surface_get_data(backbuffer_surface),
+               cairo_image_surface_get_stride(backbuffer_surface),
+               x, y, w, h);
+    return;
+  }
+
+  cairo_rectangle(front_cr, x, y, w, h);
+  cairo_fill(front_cr);
+}
+
+static void
+paintDirtyTiles(cairo_t *front_cr,
+                direct_t *direct,
+                cairo_surface_t *backbuffer_surface,
+                present_t *present,
+                int width,
+                int height) {
+  /* One fill per run of dirty tiles in a tile row */
+  /* Separate fills so cairo uploads each run on its own instead of their bounding box */
+  for (int ty = 0; ty < present->dirty.rows; ty++) {
+    int y = ty * DIFF_TILE;
+    int h = height - y < DIFF_TILE ? height - y : DIFF_TILE;
+
+    for (int tx = 0; tx < present->dirty.cols; tx++) {
+      int run = dirtyRunLength(&present->dirty, tx, ty);
+
+      if (run == 0) {
+        continue;
+      }
+
+      int x = tx * DIFF_TILE;
+      int w = (tx + run) * DIFF_TILE > width ? width - x : run * DIFF_TILE;
+
+      paintRect(front_cr, direct, backbuffer_surface, x, y, w, h);
+
+      tx += run;
+    }
+  }
 }
 
 void
 swapBuffers(cairo_t *front_cr,
-            cairo_surface_t *backbuffer_surface) {
+            cairo_surface_t *backbuffer_surface,
+            present_t *present,
+            direct_t *direct,
+            bands_t *bands,
+            stream_server_t *stream) {
 
   /* Needed to ensure all pending draw operations are done */
   cairo_surface_flush(backbuffer_surface);
@@ -111,8 +750,79 @@ swapBuffers(cairo_t *front_cr,
                            0,
                            0);
 
-  cairo_paint(front_cr);
+  if (bands != NULL) {
+    bandsPresent(bands,
+                 cairo_image_surface_get_data(backbuffer_surface),
+                 cairo_image_surface_get_stride(backbuffer_surface),
+                 cairo_image_surface_get_width(backbuffer_surface),
+                 cairo_image_surface_get_height(backbuffer_surface));
+  }
+  else if (present == NULL && direct != NULL) {
+    paintRect(front_cr,
+              direct,
+              backbuffer_surface,
+              0,
+              0,
+              cairo_image_surface_get_width(backbuffer_surface),
+              cairo_image_surface_get_height(backbuffer_surface));
+  }
+  else if (present == NULL) {
+    cairo_paint(front_cr);
+  }
+  else {
+    unsigned char *data = cairo_image_surface_get_data(backbuffer_surface);
+    int stride = cairo_image_surface_get_stride(backbuffer_surface);
+    int width = cairo_image_surface_get_width(backbuffer_surface);
+    int height = cairo_image_surface_get_height(backbuffer_surface);
+
+    uint64_t start = getTimeNs();
+
+    if (present->full) {
+      dirtyMapFill(&present->dirty);
+      present->full = 0;
+    }
+    else {
+      diffFrame(present->differs,
+                data,
+                present->prev,
+                stride,
+                width,
+                height,
+                &present->dirty);
+      dirtyMapMerge(&present->dirty, &present->damage);
+    }
+    dirtyMapClear(&present->damage);
+
+    uint64_t diffed = getTimeNs();
+
+    paintDirtyTiles(front_cr, direct, backbuffer_surface, present, width, height);
+    diffCommit(data, present->prev, stride, width, height, &present->dirty);
+
+    statAdd(&present->diff_time, diffed - start);
+    statAdd(&present->paint_time, getTimeNs() - diffed);
+    statAdd(&present->dirty_tiles, (uint64_t)present->dirty.dirty);
+
+    if (++present->frames % 100 == 0) {
+      printf("Present: %d tiles per frame\n", present->dirty.cols * present->dirty.rows);
+      statPrint(&present->diff_time, 1000.0, "us");
+      statPrint(&present->paint_time, 1000.0, "us");
+      statPrint(&present->dirty_tiles, 1.0, "");
+      statReset(&present->diff_time);
+      statReset(&present->paint_time);
+      statReset(&present->dirty_tiles);
+    }
+  }
+
   cairo_surface_flush(backbuffer_surface);
+
+  /* Mirror the frame to the stream viewer, if there is one */
+  if (stream != NULL) {
+    streamPresent(stream,
+                  cairo_image_surface_get_data(backbuffer_surface),
+                  cairo_image_surface_get_width(backbuffer_surface),
+                  cairo_image_surface_get_height(backbuffer_surface),
+                  cairo_image_surface_get_stride(backbuffer_surface));
+  }
 }
 
 cairo_surface_t*
@@ -133,6 +843,45 @@ allocFrontBuf(xcb_connection_t *display,
   return surface;
 }
 
+cairo_surface_t*
+allocBackBufPixmap(xcb_connection_t *display,
+                   xcb_drawable_t drawable,
+                   xcb_screen_t *screen,
+                   xcb_pixmap_t *pixmap,
+                   int width,
+                   int height) {
+  /* Same depth and visual as the window, so the present is a plain copy on the server */
+  *pixmap = xcb_generate_id(display);
+
+  xcb_create_pixmap(display,
+                    screen->root_depth,
+                    *pixmap,
+                    drawable,
+                    width,
+                    height);
+
+  cairo_surface_t *surface = cairo_xcb_surface_create(display,
+                                                      *pixmap,
+                                                      findVisual(display, screen->root_visual),
+                                                      width,
+                                                      height);
+
+  printf("Backbuffer is a %dx%d pixmap on the server\n", width, height);
+
+  return surface;
+}
+
+void
+uploadBackBuf(cairo_t *back_cr,
+              cairo_surface_t *staging_surface) {
+  /* Pixel content is still drawn on the client, into staging, and sent over here */
+  cairo_surface_mark_dirty(staging_surface);
+  cairo_set_operator(back_cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface(back_cr, staging_surface, 0, 0);
+  cairo_paint(back_cr);
+  cairo_set_operator(back_cr, CAIRO_OPERATOR_OVER);
+}
+
 cairo_surface_t*
 allocBackBuf(int width,
              int height) {
@@ -170,6 +919,8 @@ allocDisplay() {
 xcb_window_t
 allocWindow(xcb_connection_t *display,
             xcb_screen_t *screen,
+            int16_t x,
+            int16_t y,
             uint16_t width,
             uint16_t height) {
   /* Create the window */
@@ -191,8 +942,8 @@ allocWindow(xcb_connection_t *display,
                     XCB_COPY_FROM_PARENT,  /* depth (same as root) */
                     window,
                     screen->root, /* parent window */
-                    0, /* x */
-                    0, /* y */
+                    x, /* x */
+                    y, /* y */
                     width,/* width */
                     height,/* height */
                     10, /* border_width  */
@@ -204,94 +955,338 @@ allocWindow(xcb_connection_t *display,
   return window;
 }
 
-static struct timespec
-genSleep(time_t sec,
-         long nanosec) {
-  struct timespec t;
-  t.tv_sec = sec;
-  t.tv_nsec = nanosec;
-  return t;
+scaler_t*
+allocScalerFromEnv(void) {
+  /* BLIT_SCALE=nearest|bilinear turns on rendering at a fixed resolution, see allocBackBuf */
+  const char *filter = getenv("BLIT_SCALE");
+
+  if (filter == NULL) {
+    return NULL;
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = getenv("BLIT_SCALE_THREADS") != NULL ? atoi(getenv("BLIT_SCALE_THREADS")) : (int)cpus;
+
+  printf("Scaling with %s, %d threads\n", filter, threads);
+
+  return allocScaler(strcmp(filter, "bilinear") == 0 ? SCALE_BILINEAR : SCALE_NEAREST,
+                     threads);
+}
+
+static surface_t
+imageSurface(cairo_surface_t *image) {
+  return surface((uint32_t *)cairo_image_surface_get_data(image),
+                 cairo_image_surface_get_width(image),
+                 cairo_image_surface_get_height(image),
+                 cairo_image_surface_get_stride(image));
 }
 
 void
+scaleBackBuf(scaler_t *scaler,
+             cairo_surface_t *backbuffer_surface,
+             cairo_surface_t *output_surface) {
+  /* Stretches the fixed size backbuffer over the window sized output */
+  surface_t src = imageSurface(backbuffer_surface);
+  surface_t dst = imageSurface(output_surface);
+
+  cairo_surface_flush(output_surface);
+  scaleSurface(scaler, &src, &dst);
+  cairo_surface_mark_dirty(output_surface);
+}
+
+static cairo_surface_t*
+reducedBackBuf(cairo_surface_t **reduced,
+               cairo_surface_t *backbuffer_surface,
+               int scale) {
+  /* The backbuffer itself at full quality, otherwise a smaller one that is kept between frames */
+  if (scale >= 100) {
+    if (*reduced != NULL) {
+      cairo_surface_destroy(*reduced);
+      *reduced = NULL;
+    }
+    return backbuffer_surface;
+  }
+
+  int width = cairo_image_surface_get_width(backbuffer_surface) * scale / 100;
+  int height = cairo_image_surface_get_height(backbuffer_surface) * scale / 100;
+
+  if (*reduced != NULL &&
+      (cairo_image_surface_get_width(*reduced) != width ||
+       cairo_image_surface_get_height(*reduced) != height)) {
+    cairo_surface_destroy(*reduced);
+    *reduced = NULL;
+  }
+
+  if (*reduced == NULL) {
+    *reduced = allocBackBuf(width, height);
+  }
+  return *reduced;
+}
+
+int
 message_loop(xcb_connection_t *display,
              xcb_screen_t *screen,
+             uint16_t window_width,
+             uint16_t window_height,
              cairo_surface_t *frontbuffer_surface,
              cairo_surface_t *backbuffer_surface,
-             cairo_t *front_cr) {
-
-  struct timespec req = genSleep(0, 20000000);
-  struct timespec rem = genSleep(0, 0);
+             cairo_t *front_cr,
+             cairo_t *back_cr,
+             backbuf_mode_t mode,
+             scaler_t *scaler,
+             direct_t *direct,
+             bands_t *bands,
+             stream_server_t *stream,
+             latency_t *latency,
+             framesync_t *framesync,
+             randr_t *randr,
+             event_source_t *events) {
 
-  xcb_configure_notify_event_t *configure_notify;
   xcb_key_press_event_t *key_event;
 
   int exposed = 0;
   int running = 1;
-  uint16_t window_height = screen->height_in_pixels;
-  uint16_t window_width = screen->width_in_pixels;
 
   int v = 0;
 
+  content_t content = getContent();
+  sprites_t *sprites = content == CONTENT_SPRITES ? allocSprites() : NULL;
+  commands_t *commands = content == CONTENT_COMMANDS ? allocCommands() : NULL;
+  image_t *image = content == CONTENT_IMAGE ? allocImage() : NULL;
+  hud_t *hud = allocHud();
+
+  event_batch_t batch;
+  event_stats_t event_stats = eventStats();
+  mem_stats_t mem_stats = memStats();
+
+  /* Paces frames and trades quality for time when they run over budget */
+  sched_t sched = frameSched();
+  cairo_surface_t *reduced_surface = NULL;
+
+  /* One frame per refresh of the monitor the window is on */
+  schedRefresh(&sched, randrRefresh(randr));
+  scaler_t *sched_scaler = NULL;
+
+  /* When scaling, the backbuffer stays at its size and a window sized copy gets presented */
+  cairo_surface_t *output_surface = backbuffer_surface;
+
+  if (scaler != NULL) {
+    output_surface = allocBackBuf(window_width, window_height);
+  }
+
+  /* Diffing needs the pixels on the client, a pixmap backbuffer always presents all of it */
+  /* So do bands, they're there to see how fast whole frames get across */
+  present_t *present = mode == BACKBUF_IMAGE && bands == NULL ? allocPresent(output_surface) : NULL;
+
+  /* With a pixmap, content that writes pixels draws into this and gets sent over every frame */
+  cairo_surface_t *staging_surface = NULL;
+
+  if (mode == BACKBUF_PIXMAP && content != CONTENT_VECTOR) {
+    staging_surface = allocBackBuf(window_width, window_height);
+  }
+
+  /* BLIT_SYNC=1 waits for the server to finish each frame, so render times include its work */
+  int sync = getenv("BLIT_SYNC") != NULL && strcmp(getenv("BLIT_SYNC"), "1") == 0;
+
   while (running) {
-      /* Poll for events */
+      /* Drain everything that is queued, not just one event per frame */
+      batchBegin(&batch);
 
-      xcb_generic_event_t *event = xcb_poll_for_event(display);
+      xcb_generic_event_t *event;
 
-      if (event != NULL) {
+      while ((event = eventNext(events, &batch)) != NULL) {
         switch (RECEIVE_EVENT(event)) {
           case XCB_KEY_PRESS:
               /* Quit on key press */
               key_event = (xcb_key_press_event_t *)event;
               printf("%u\n", key_event->detail);
+              latencyInput(latency, key_event);
               if (key_event->detail == 24) {
                 running = 0;
               }
               break;
           case XCB_EXPOSE:
-              printf("Got expose event\n");
+              batchExpose(&batch, (xcb_expose_event_t *)event);
               exposed = 1;
               break;
 
           case XCB_CONFIGURE_NOTIFY:
-              configure_notify = (xcb_configure_notify_event_t *)event;
+              batchConfigure(&batch, (xcb_configure_notify_event_t *)event);
+              break;
+          case XCB_CLIENT_MESSAGE:
+              frameSyncMessage(framesync, (xcb_client_message_event_t *)event);
+              break;
+          default:
+              /* RandR's event codes are only known at runtime */
+              if (randrEvent(randr, event)) {
+                schedRefresh(&sched, randrRefresh(randr));
+              }
+              break;
+        }
+      }
 
-              cairo_surface_flush(frontbuffer_surface);
-              cairo_surface_flush(backbuffer_surface);
-              cairo_xcb_surface_set_size(frontbuffer_surface,
-                                         configure_notify->width,
-                                         configure_notify->height);
+      if (batch.exposes > 0) {
+        printf("Got %d expose events\n", batch.exposes);
+        presentDamage(present, &batch);
+      }
 
-              window_height = configure_notify->height;
-              window_width = configure_notify->width;
+      /* The window may have moved to another monitor */
+      if (batch.configures > 0 && randrMoved(randr)) {
+        schedRefresh(&sched, randrRefresh(randr));
+      }
 
-              printf("Got configure_notify event, w = %u, h = %u\n",
-                     window_width,
-                     window_height);
+      /* One resize for however many configure notifies came in */
+      if (batch.configures > 0 &&
+          (batch.width != window_width || batch.height != window_height)) {
+        cairo_surface_flush(frontbuffer_surface);
+        cairo_surface_flush(backbuffer_surface);
+        cairo_xcb_surface_set_size(frontbuffer_surface,
+                                   batch.width,
+                                   batch.height);
 
-              break;
-          default:
-              break;
+        window_height = batch.height;
+        window_width = batch.width;
+
+        if (scaler != NULL) {
+          freePresent(present);
+          cairo_surface_destroy(output_surface);
+
+          output_surface = allocBackBuf(window_width, window_height);
+          present = mode == BACKBUF_IMAGE && bands == NULL ? allocPresent(output_surface) : NULL;
         }
 
-        free(event);
+        /* Whatever was in the window before is gone */
+        if (present != NULL) {
+          present->full = 1;
+        }
+
+        printf("Got %d configure_notify events, w = %u, h = %u\n",
+               batch.configures,
+               window_width,
+               window_height);
+      }
+
+      /* With a compositor driving, wait for it to draw the last frame before starting one */
+      if (exposed && !frameSyncReady(framesync)) {
+        frameSyncSleep(framesync);
       }
+      else if (exposed) {
+        /* Frames whose slot already went by are skipped, but the animation still moves on */
+        v += schedBegin(&sched);
 
-      if (exposed) {
-        draw(backbuffer_surface,
-             v,
-             window_width,
-             window_height);
+        uint64_t start = getTimeNs();
+
+        frameSyncBegin(framesync);
+
+        /* Input read so far shows up in this frame */
+        latencyFrame(latency);
+
+        cairo_surface_t *render_surface = backbuffer_surface;
+
+        if (content == CONTENT_VECTOR) {
+          /* Drawn through back_cr at full size, whichever backbuffer it is */
+          drawVector(back_cr, v, window_width, window_height);
+        }
+        else {
+          /* Over budget the scheduler has us render smaller and scale up */
+          render_surface = staging_surface != NULL ? staging_surface
+                                                   : reducedBackBuf(&reduced_surface,
+                                                                    backbuffer_surface,
+                                                                    schedScale(&sched));
+
+          draw(render_surface,
+               content,
+               sprites,
+               commands,
+               image,
+               v,
+               window_width,
+               window_height);
+        }
+
+        /* The HUD writes pixels, so only where there are some on this side */
+        if (hud != NULL && (mode == BACKBUF_IMAGE || render_surface == staging_surface)) {
+          drawHud(render_surface, hud, &sched, v);
+        }
+
+        if (render_surface == staging_surface) {
+          uploadBackBuf(back_cr, staging_surface);
+        }
+        else if (render_surface != backbuffer_surface) {
+          if (scaler == NULL && sched_scaler == NULL) {
+            sched_scaler = allocScaler(SCALE_NEAREST, (int)sysconf(_SC_NPROCESSORS_ONLN));
+          }
+          scaleBackBuf(scaler != NULL ? scaler : sched_scaler, render_surface, output_surface);
+        }
+        else if (scaler != NULL) {
+          scaleBackBuf(scaler, backbuffer_surface, output_surface);
+        }
 
         /* This is where the magic happens */
+        /* Mirroring to the viewer is optional, only every 4th frame when over budget */
         swapBuffers(front_cr,
-                    backbuffer_surface);
+                    output_surface,
+                    present,
+                    direct,
+                    bands,
+                    schedPasses(&sched) || v % 4 == 0 ? stream : NULL);
+
+        /* The counter has to come after everything cairo has queued for the frame */
+        if (framesync != NULL) {
+          cairo_surface_flush(frontbuffer_surface);
+          frameSyncEnd(framesync, (uint64_t)sched.estimate);
+        }
         xcb_flush(display);
 
-        nanosleep(&req, &rem);
+        if (sync) {
+          memFreeReply(memReply(xcb_get_input_focus_reply(display, xcb_get_input_focus(display), NULL)));
+        }
+
+        schedEnd(&sched, getTimeNs() - start);
+
+        if (hud != NULL) {
+          hud->render_time = getTimeNs() - start;
+        }
+
+        /* Round trip to the server, only on frames that carry input */
+        latencyPresent(latency);
+
+        eventStatsFrame(&event_stats, &batch);
+
+        if (memFrame(&mem_stats) || latencyTest(latency)) {
+          running = 0;
+        }
+
+        if (frameSyncPaced(framesync)) {
+          schedFollow(&sched);
+        }
+        else {
+          schedWait(&sched);
+        }
         v++;
       }
   }
+
+  freeSprites(sprites);
+  freeCommands(commands);
+  freeImage(image);
+  freeHud(hud);
+  freePresent(present);
+  freeScaler(sched_scaler);
+
+  if (reduced_surface != NULL) {
+    cairo_surface_destroy(reduced_surface);
+  }
+
+  if (staging_surface != NULL) {
+    cairo_surface_destroy(staging_surface);
+  }
+
+  if (output_surface != backbuffer_surface) {
+    cairo_surface_destroy(output_surface);
+  }
+
+  return memSoakResult(&mem_stats);
 }
 
 int
@@ -302,16 +1297,24 @@ main (void) {
   /* Get a handle to the screen */
   xcb_screen_t *screen = allocScreen(display);
 
-  int window_height = screen->height_in_pixels;
-  int window_width = screen->width_in_pixels;
+  /* Open on the primary monitor, at its size */
+  monitor_t monitor = randrDefaultMonitor(display, screen);
+
+  int window_height = monitor.height;
+  int window_width = monitor.width;
 
   /* Create a window */
   xcb_window_t window =
     allocWindow(display,
                 screen,
+                monitor.x,
+                monitor.y,
                 window_width,
                 window_height);
 
+  /* BLIT_FRAMESYNC=1 lets a compositor pace the frames, the counters have to be there before mapping */
+  framesync_t *framesync = allocFrameSync(display, window);
+
   /* Map the window to the display */
   xcb_map_window(display, window);
 
@@ -325,23 +1328,110 @@ main (void) {
 
   cairo_t *front_cr = cairo_create(frontbuffer_surface);
 
-  /* Allocate backbuffer (raw pixel buffer) */
+  /* BLIT_BACKBUF=image|pixmap, whether frames are put together on the client or the server */
+  backbuf_mode_t mode = getBackBufMode();
+
+  /* Render at a fixed resolution and scale it to the window, if asked to */
+  scaler_t *scaler = mode == BACKBUF_IMAGE ? allocScalerFromEnv() : NULL;
+
+  int buffer_width = window_width;
+  int buffer_height = window_height;
+
+  if (scaler != NULL) {
+    /* BLIT_RES=WxH, half the screen size if it isn't set */
+    buffer_width = window_width / 2;
+    buffer_height = window_height / 2;
+
+    if (getenv("BLIT_RES") != NULL) {
+      sscanf(getenv("BLIT_RES"), "%dx%d", &buffer_width, &buffer_height);
+    }
+  }
+
+  /* Allocate backbuffer (raw pixel buffer, or a pixmap) */
+  xcb_pixmap_t backbuffer_pixmap = XCB_NONE;
   cairo_surface_t *backbuffer_surface =
-    allocBackBuf(window_width, window_height);
+    mode == BACKBUF_PIXMAP ? allocBackBufPixmap(display,
+                                                window,
+                                                screen,
+                                                &backbuffer_pixmap,
+                                                buffer_width,
+                                                buffer_height)
+                           : allocBackBuf(buffer_width, buffer_height);
 
   cairo_t *back_cr = cairo_create(backbuffer_surface);
 
-  message_loop(display,
+  /* Optionally mirror every frame to blit_viewer over a unix socket */
+  stream_server_t *stream = NULL;
+
+  if (getenv("BLIT_STREAM") != NULL && mode == BACKBUF_IMAGE) {
+    stream = streamServerOpen(getenv("BLIT_STREAM"));
+  }
+
+  /* Low depth visuals get a dithered conversion instead of cairo's */
+  direct_t *direct = mode == BACKBUF_IMAGE ? allocDirect(display, screen, window) : NULL;
+
+  if (mode == BACKBUF_PIXMAP && (getenv("BLIT_SCALE") != NULL || getenv("BLIT_STREAM") != NULL)) {
+    fprintf(stderr, "BLIT_SCALE and BLIT_STREAM need the pixels on the client, ignored with a pixmap\n");
+  }
+
+  /* BLIT_CONNECTIONS=N uploads each frame in N bands over N connections */
+  bands_t *bands = mode == BACKBUF_IMAGE && direct == NULL ? allocBands(display,
+                                                                       screen,
+                                                                       window,
+                                                                       window_width,
+                                                                       window_height)
+                                                           : NULL;
+
+  if (bands == NULL && getenv("BLIT_CONNECTIONS") != NULL && (mode == BACKBUF_PIXMAP || direct != NULL)) {
+    fprintf(stderr, "BLIT_CONNECTIONS needs an image backbuffer put as is, ignored\n");
+  }
+
+  /* BLIT_LATENCY=1 measures input to present, BLIT_LATENCY_TEST=N injects keys to do it */
+  latency_t *latency = allocLatency(display, window);
+
+  /* Which monitor the window is on and how fast it refreshes, NULL without RandR */
+  randr_t *randr = allocRandr(display, screen, window);
+
+  /* Polled once per frame, or read on a thread of its own with BLIT_EVENT_THREAD=1 */
+  event_source_t *events = allocEventSource(display, window);
+
+  /* The size it was made at, which monitor RandR reports by now may not be the one it was sized for */
+  int retval = message_loop(display,
                screen,
+               (uint16_t)window_width,
+               (uint16_t)window_height,
                frontbuffer_surface,
                backbuffer_surface,
-               front_cr);
+               front_cr,
+               back_cr,
+               mode,
+               scaler,
+               direct,
+               bands,
+               stream,
+               latency,
+               framesync,
+               randr,
+               events);
+
+  freeEventSource(events);
+  freeFrameSync(framesync);
+  freeRandr(randr);
+  freeLatency(latency);
+  freeDirect(direct);
+  freeBands(bands);
+  freeScaler(scaler);
+  streamServerClose(stream);
 
   cairo_destroy(back_cr);
   cairo_surface_destroy(backbuffer_surface);
 
+  if (backbuffer_pixmap != XCB_NONE) {
+    xcb_free_pixmap(display, backbuffer_pixmap);
+  }
+
   cairo_destroy(front_cr);
   cairo_surface_destroy(frontbuffer_surface);
 
-  return 0;
+  return retval;
 }
@@ -0,0 +1,594 @@
+#ifndef BLIT_CMD_H
+#define BLIT_CMD_H
+
+/*
+ * Draw command buffers
+ * A frame is recorded once as a flat list of commands (an opcode header followed by its
+ * operands, all in one growable arena) and then replayed by whichever backend is running
+ * The software executor here draws into a surface_t, blit_opengl.c and blit_xcb.c have their own
+ * A frame that records to exactly the same bytes as the last one doesn't need to be replayed
+ * Buffers can be written to a file and read back, so recorded workloads replay the same way
+ * every time, see bench_cmd.c
+ * Colors are premultiplied ARGB like everywhere else, alpha 255 is opaque
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blit_mem.h"
+#include "blit_sprite.h"
+
+#define CMD_MAGIC 0x434c4258 /* "XBLC" */
+#define CMD_VERSION 1
+#define CMD_ATLASES 4 /* atlas ids go from 0 to CMD_ATLASES - 1 */
+
+typedef enum {
+  CMD_FILL = 1,
+  CMD_GRADIENT,
+  CMD_CLIP, /* scissor rectangle for everything after it, an empty one turns it off */
+  CMD_BLIT
+} cmd_op_t;
+
+/* Every command starts with this, size includes it and keeps the next one 4 byte aligned */
+typedef struct {
+  uint16_t op;
+  uint16_t size;
+} cmd_t;
+
+typedef struct {
+  cmd_t cmd;
+  int16_t x;
+  int16_t y;
+  uint16_t width;
+  uint16_t height;
+  uint32_t color;
+} cmd_fill_t;
+
+typedef struct {
+  cmd_t cmd;
+  int16_t x;
+  int16_t y;
+  uint16_t width;
+  uint16_t height;
+  uint32_t from; /* color at the top or left edge */
+  uint32_t to; /* color at the bottom or right edge */
+  uint8_t vertical;
+  uint8_t pad[3];
+} cmd_gradient_t;
+
+typedef struct {
+  cmd_t cmd;
+  int16_t x;
+  int16_t y;
+  uint16_t width;
+  uint16_t height;
+} cmd_clip_t;
+
+typedef struct {
+  cmd_t cmd;
+  uint8_t atlas;
+  uint8_t flags; /* BLIT_ALPHA, BLIT_COLORKEY */
+  uint8_t opacity;
+  uint8_t pad;
+  int16_t src_x;
+  int16_t src_y;
+  uint16_t width;
+  uint16_t height;
+  int16_t dst_x;
+  int16_t dst_y;
+  uint32_t colorkey;
+} cmd_blit_t;
+
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t cap;
+  uint32_t count;
+  uint16_t width; /* size of the frame it was recorded for */
+  uint16_t height;
+} cmd_buffer_t;
+
+/* What goes in front of every frame in a file */
+typedef struct {
+  uint32_t len;
+  uint32_t count;
+  uint16_t width;
+  uint16_t height;
+} cmd_frame_t;
+
+static inline void
+cmdBegin(cmd_buffer_t *buf,
+         uint16_t width,
+         uint16_t height) {
+  /* Keeps the arena, so recording doesn't allocate once it has grown to a frame's size */
+  buf->len = 0;
+  buf->count = 0;
+  buf->width = width;
+  buf->height = height;
+}
+
+static inline void
+cmdFree(cmd_buffer_t *buf) {
+  memFree(buf->data);
+  memset(buf, 0, sizeof(cmd_buffer_t));
+}
+
+static inline void*
+cmdPush(cmd_buffer_t *buf,
+        cmd_op_t op,
+        size_t size) {
+  if (buf->len + size > buf->cap) {
+    buf->cap = buf->cap ? buf->cap * 2 : 4096;
+
+    while (buf->cap < buf->len + size) {
+      buf->cap *= 2;
+    }
+    buf->data = memRealloc(buf->data, buf->cap);
+  }
+
+  cmd_t *cmd = (cmd_t *)(buf->data + buf->len);
+
+  memset(cmd, 0, size);
+  cmd->op = (uint16_t)op;
+  cmd->size = (uint16_t)size;
+
+  buf->len += size;
+  buf->count++;
+
+  return cmd;
+}
+
+static inline void
+cmdFill(cmd_buffer_t *buf,
+        int x,
+        int y,
+        int width,
+        int height,
+        uint32_t color) {
+  cmd_fill_t *c = cmdPush(buf, CMD_FILL, sizeof(cmd_fill_t));
+
+  c->x = (int16_t)x;
+  c->y = (int16_t)y;
+  c->width = (uint16_t)width;
+  c->height = (uint16_t)height;
+  c->color = color;
+}
+
+static inline void
+cmdGradient(cmd_buffer_t *buf,
+            int x,
+            int y,
+            int width,
+            int height,
+            uint32_t from,
+            uint32_t to,
+            int vertical) {
+  cmd_gradient_t *c = cmdPush(buf, CMD_GRADIENT, sizeof(cmd_gradient_t));
+
+  c->x = (int16_t)x;
+  c->y = (int16_t)y;
+  c->width = (uint16_t)width;
+  c->height = (uint16_t)height;
+  c->from = from;
+  c->to = to;
+  c->vertical = (uint8_t)vertical;
+}
+
+static inline void
+cmdClip(cmd_buffer_t *buf,
+        int x,
+        int y,
+        int width,
+        int height) {
+  cmd_clip_t *c = cmdPush(buf, CMD_CLIP, sizeof(cmd_clip_t));
+
+  c->x = (int16_t)x;
+  c->y = (int16_t)y;
+  c->width = (uint16_t)width;
+  c->height = (uint16_t)height;
+}
+
+static inline void
+cmdBlit(cmd_buffer_t *buf,
+        int atlas,
+        int src_x,
+        int src_y,
+        int width,
+        int height,
+        int dst_x,
+        int dst_y,
+        uint8_t flags,
+        uint8_t opacity) {
+  cmd_blit_t *c = cmdPush(buf, CMD_BLIT, sizeof(cmd_blit_t));
+
+  c->atlas = (uint8_t)atlas;
+  c->flags = flags;
+  c->opacity = opacity;
+  c->src_x = (int16_t)src_x;
+  c->src_y = (int16_t)src_y;
+  c->width = (uint16_t)width;
+  c->height = (uint16_t)height;
+  c->dst_x = (int16_t)dst_x;
+  c->dst_y = (int16_t)dst_y;
+}
+
+static inline int
+cmdEqual(const cmd_buffer_t *a,
+         const cmd_buffer_t *b) {
+  /* Same bytes means the same picture, so the last replay can be reused as it is */
+  return a->len == b->len &&
+         a->width == b->width &&
+         a->height == b->height &&
+         memcmp(a->data, b->data, a->len) == 0;
+}
+
+static inline void
+cmdSwap(cmd_buffer_t *a,
+        cmd_buffer_t *b) {
+  cmd_buffer_t tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+static inline size_t
+cmdOpSize(uint16_t op) {
+  /* Size of the command struct for op, 0 for ops this version doesn't know */
+  switch (op) {
+    case CMD_FILL:
+      return sizeof(cmd_fill_t);
+    case CMD_GRADIENT:
+      return sizeof(cmd_gradient_t);
+    case CMD_CLIP:
+      return sizeof(cmd_clip_t);
+    case CMD_BLIT:
+      return sizeof(cmd_blit_t);
+    default:
+      return 0;
+  }
+}
+
+static inline int
+cmdNext(const cmd_buffer_t *buf,
+        size_t *offset,
+        const cmd_t **cmd) {
+  /* Walks the buffer, returns 0 at the end or on a command that doesn't fit */
+  /* Executors read a known op's whole struct, so its size has to be exactly that */
+  if (*offset + sizeof(cmd_t) > buf->len) {
+    return 0;
+  }
+
+  const cmd_t *c = (const cmd_t *)(buf->data + *offset);
+
+  if (c->size < sizeof(cmd_t) || *offset + c->size > buf->len) {
+    return 0;
+  }
+
+  size_t op_size = cmdOpSize(c->op);
+
+  if (op_size != 0 && c->size != op_size) {
+    return 0;
+  }
+
+  *cmd = c;
+  *offset += c->size;
+
+  return 1;
+}
+
+static inline int
+cmdWriteHeader(FILE *file,
+               const surface_t *atlases,
+               int count) {
+  /* Magic, version and the atlases, which commands only refer to by id */
+  uint32_t header[3] = {CMD_MAGIC, CMD_VERSION, (uint32_t)count};
+
+  if (fwrite(header, sizeof(header), 1, file) != 1) {
+    return 0;
+  }
+
+  for (int i = 0; i < count; i++) {
+    uint32_t size[2] = {(uint32_t)atlases[i].width, (uint32_t)atlases[i].height};
+
+    if (fwrite(size, sizeof(size), 1, file) != 1) {
+      return 0;
+    }
+
+    for (int y = 0; y < atlases[i].height; y++) {
+      if (fwrite(surfaceRow(&atlases[i], y), 4, atlases[i].width, file) != (size_t)atlases[i].width) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+static inline void
+cmdFreeAtlases(surface_t *atlases,
+               int count) {
+  for (int i = 0; i < count; i++) {
+    memFree(atlases[i].pixels);
+    atlases[i].pixels = NULL;
+  }
+}
+
+static inline int
+cmdReadHeader(FILE *file,
+              surface_t *atlases) {
+  /* Returns how many atlases were read into atlases (free them with cmdFreeAtlases), -1 if it isn't a command file */
+  uint32_t header[3];
+
+  if (fread(header, sizeof(header), 1, file) != 1 ||
+      header[0] != CMD_MAGIC ||
+      header[1] != CMD_VERSION ||
+      header[2] > CMD_ATLASES) {
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < header[2]; i++) {
+    uint32_t size[2];
+
+    /* The atlases read so far are freed on the way out, the caller gets none of them */
+    if (fread(size, sizeof(size), 1, file) != 1 || size[0] > 8192 || size[1] > 8192) {
+      cmdFreeAtlases(atlases, (int)i);
+      return -1;
+    }
+
+    atlases[i] = surface(memAlloc((size_t)size[0] * size[1] * 4), (int)size[0], (int)size[1], (int)size[0] * 4);
+
+    if (atlases[i].pixels == NULL ||
+        fread(atlases[i].pixels, 4, (size_t)size[0] * size[1], file) != (size_t)size[0] * size[1]) {
+      cmdFreeAtlases(atlases, (int)i + 1);
+      return -1;
+    }
+  }
+  return (int)header[2];
+}
+
+static inline int
+cmdWriteFrame(FILE *file,
+              const cmd_buffer_t *buf) {
+  cmd_frame_t frame = {(uint32_t)buf->len, buf->count, buf->width, buf->height};
+
+  return fwrite(&frame, sizeof(frame), 1, file) == 1 &&
+         fwrite(buf->data, 1, buf->len, file) == buf->len;
+}
+
+static inline int
+cmdReadFrame(FILE *file,
+             cmd_buffer_t *buf) {
+  /* Returns 0 at the end of the file */
+  cmd_frame_t frame;
+
+  if (fread(&frame, sizeof(frame), 1, file) != 1) {
+    return 0;
+  }
+
+  cmdBegin(buf, frame.width, frame.height);
+
+  if (frame.len > buf->cap) {
+    buf->cap = frame.len;
+    buf->data = memRealloc(buf->data, buf->cap);
+  }
+
+  if (fread(buf->data, 1, frame.len, file) != frame.len) {
+    return 0;
+  }
+
+  buf->len = frame.len;
+  buf->count = frame.count;
+
+  return 1;
+}
+
+static inline uint32_t
+lerpColor(uint32_t from,
+          uint32_t to,
+          uint32_t t) {
+  /* t goes from 0 to 256 */
+  uint32_t rb = (((from & 0x00ff00ff) * (256 - t) + (to & 0x00ff00ff) * t) >> 8) & 0x00ff00ff;
+  uint32_t ag = ((((from >> 8) & 0x00ff00ff) * (256 - t) + ((to >> 8) & 0x00ff00ff) * t) >> 8) & 0x00ff00ff;
+
+  return ag << 8 | rb;
+}
+
+static inline void
+spanColor(uint32_t *d,
+          int n,
+          uint32_t color) {
+  if (color >> 24 == 255) {
+    for (int i = 0; i < n; i++) {
+      d[i] = color;
+    }
+    return;
+  }
+
+  for (int i = 0; i < n; i++) {
+    d[i] = overPixel(color, d[i], 255);
+  }
+}
+
+static inline int
+clipRect(const surface_t *dst,
+         int *x,
+         int *y,
+         int *width,
+         int *height) {
+  if (*x < 0) {
+    *width += *x;
+    *x = 0;
+  }
+  if (*y < 0) {
+    *height += *y;
+    *y = 0;
+  }
+  if (*x + *width > dst->width) {
+    *width = dst->width - *x;
+  }
+  if (*y + *height > dst->height) {
+    *height = dst->height - *y;
+  }
+  return *width > 0 && *height > 0;
+}
+
+static inline void
+cmdExecSurface(const cmd_buffer_t *buf,
+               const surface_t *target,
+               const surface_t *atlases) {
+  /* Software executor, clipping is done by drawing into a view of just the clip rectangle */
+  surface_t dst = *target;
+  int clip_x = 0;
+  int clip_y = 0;
+
+  size_t offset = 0;
+  const cmd_t *cmd;
+
+  while (cmdNext(buf, &offset, &cmd)) {
+    switch (cmd->op) {
+      case CMD_FILL: {
+        const cmd_fill_t *c = (const cmd_fill_t *)cmd;
+        int x = c->x - clip_x;
+        int y = c->y - clip_y;
+        int width = c->width;
+        int height = c->height;
+
+        if (!clipRect(&dst, &x, &y, &width, &height)) {
+          break;
+        }
+
+        for (int row = 0; row < height; row++) {
+          spanColor(surfaceRow(&dst, y + row) + x, width, c->color);
+        }
+        break;
+      }
+
+      case CMD_GRADIENT: {
+        const cmd_gradient_t *c = (const cmd_gradient_t *)cmd;
+        int x = c->x - clip_x;
+        int y = c->y - clip_y;
+        int width = c->width;
+        int height = c->height;
+        int span = c->vertical ? c->height : c->width;
+
+        if (!clipRect(&dst, &x, &y, &width, &height) || span < 2) {
+          break;
+        }
+
+        for (int row = 0; row < height; row++) {
+          uint32_t *d = surfaceRow(&dst, y + row) + x;
+
+          if (c->vertical) {
+            int pos = y + row + clip_y - c->y;
+            spanColor(d, width, lerpColor(c->from, c->to, (uint32_t)(pos * 256 / (span - 1))));
+            continue;
+          }
+
+          for (int col = 0; col < width; col++) {
+            int pos = x + col + clip_x - c->x;
+            spanColor(d + col, 1, lerpColor(c->from, c->to, (uint32_t)(pos * 256 / (span - 1))));
+          }
+        }
+        break;
+      }
+
+      case CMD_CLIP: {
+        const cmd_clip_t *c = (const cmd_clip_t *)cmd;
+        int x = c->x;
+        int y = c->y;
+        int width = c->width;
+        int height = c->height;
+
+        dst = *target;
+        clip_x = 0;
+        clip_y = 0;
+
+        if (width == 0 || height == 0) {
+          break;
+        }
+
+        if (!clipRect(&dst, &x, &y, &width, &height)) {
+          x = 0;
+          y = 0;
+          width = 0;
+          height = 0;
+        }
+
+        dst = surface(surfaceRow(target, y) + x, width, height, target->stride);
+        clip_x = x;
+        clip_y = y;
+        break;
+      }
+
+      case CMD_BLIT: {
+        const cmd_blit_t *c = (const cmd_blit_t *)cmd;
+
+        if (c->atlas >= CMD_ATLASES || atlases[c->atlas].pixels == NULL) {
+          break;
+        }
+
+        blit_t b = blit(&atlases[c->atlas],
+                        c->src_x,
+                        c->src_y,
+                        c->width,
+                        c->height,
+                        c->dst_x - clip_x,
+                        c->dst_y - clip_y);
+
+        b.flags = c->flags;
+        b.opacity = c->opacity;
+        b.colorkey = c->colorkey;
+
+        blitRect(&dst, b);
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+}
+
+static inline void
+cmdRecordDemo(cmd_buffer_t *buf,
+              int sprite_size,
+              int sprites,
+              int v,
+              uint16_t width,
+              uint16_t height) {
+  /* The test scene every backend can draw, atlas 0 has to come from genAtlas(sprite_size) */
+  cmdBegin(buf, width, height);
+
+  cmdClip(buf, 0, 0, 0, 0);
+  cmdGradient(buf, 0, 0, width, height, 0xff203040, 0xff80a0c0, 1);
+
+  for (int i = 0; i < 8; i++) {
+    int bar = width / 16;
+    int x = (int)(((unsigned)i * width / 8 + (unsigned)v * (i + 1)) % (unsigned)(width + bar)) - bar;
+
+    cmdFill(buf, x, 0, bar, height, 0x80000000 | (uint32_t)(i * 16) << 16 | 0x40 << 8);
+  }
+
+  /* Sprites only inside the middle of the window */
+  cmdClip(buf, width / 8, height / 8, width * 3 / 4, height * 3 / 4);
+
+  for (int i = 0; i < sprites; i++) {
+    int sprite = i % 64;
+
+    cmdBlit(buf,
+            0,
+            (sprite % 8) * sprite_size,
+            (sprite / 8) * sprite_size,
+            sprite_size,
+            sprite_size,
+            (int)(((unsigned)i * 7919u + (unsigned)v * (1 + i % 7)) % (unsigned)(width + sprite_size)) - sprite_size,
+            (int)(((unsigned)i * 104729u + (unsigned)v * (1 + i % 5)) % (unsigned)(height + sprite_size)) - sprite_size,
+            BLIT_ALPHA,
+            255);
+  }
+
+  cmdClip(buf, 0, 0, 0, 0);
+  cmdGradient(buf, 0, height - 24, width, 24, 0xff404040, 0xff101010, 0);
+}
+
+#endif
@@ -0,0 +1,314 @@
+/*
+ * Stand-in compositor for the frame sync protocol in blit_framesync.h
+ * Usage: blit_compositor [seconds]
+ * Doesn't draw anything, it only keeps the protocol's side of the bargain: it finds top level
+ * windows with _NET_WM_SYNC_REQUEST_COUNTER, and on every simulated repaint (BLIT_REFRESH Hz,
+ * 60 by default) sends _NET_WM_FRAME_DRAWN and _NET_WM_FRAME_TIMINGS for each window whose
+ * extended counter shows a finished frame it hasn't seen yet
+ * Every BLIT_SYNC_REQUESTS repaints (120 by default, 0 never) it also sends each window a
+ * _NET_WM_SYNC_REQUEST and checks the counter reaches the value it asked for
+ * Runs until killed, or for the given number of seconds
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <xcb/sync.h>
+#include <xcb/xcb.h>
+
+#include "blit_stats.h"
+
+#define MAX_CLIENTS 256
+#define RESCAN 30 /* repaints between looking for new windows */
+#define REQUEST_STEP 240 /* how far ahead of the counter a sync request asks for */
+
+typedef struct {
+  xcb_window_t window;
+  xcb_sync_counter_t extended;
+  uint64_t seen; /* last finished frame that was drawn */
+  uint64_t frames;
+  uint64_t requested; /* value a sync request is waiting for, 0 if none */
+  uint64_t request_sent;
+  int alive;
+} client_t;
+
+typedef struct {
+  xcb_connection_t *display;
+  xcb_screen_t *screen;
+  xcb_atom_t protocols;
+  xcb_atom_t sync_request;
+  xcb_atom_t request_counter;
+  xcb_atom_t frame_drawn;
+  xcb_atom_t frame_timings;
+
+  client_t clients[MAX_CLIENTS];
+  int count;
+
+  uint64_t refresh; /* ns */
+  uint64_t requests;
+  uint64_t honored;
+  stat_t request_time; /* sync request sent to the counter reaching it */
+} compositor_t;
+
+static xcb_atom_t
+internAtom(xcb_connection_t *display,
+           const char *name) {
+  xcb_intern_atom_reply_t *reply =
+    xcb_intern_atom_reply(display, xcb_intern_atom(display, 0, (uint16_t)strlen(name), name), NULL);
+  xcb_atom_t atom = reply != NULL ? reply->atom : XCB_ATOM_NONE;
+
+  free(reply);
+  return atom;
+}
+
+static void
+sendMessage(compositor_t *compositor,
+            xcb_window_t window,
+            xcb_atom_t type,
+            const uint32_t data[5]) {
+  /* No event mask sends it to whoever created the window */
+  xcb_client_message_event_t message;
+  memset(&message, 0, sizeof(message));
+
+  message.response_type = XCB_CLIENT_MESSAGE;
+  message.format = 32;
+  message.window = window;
+  message.type = type;
+  memcpy(message.data.data32, data, 5 * sizeof(uint32_t));
+
+  xcb_send_event(compositor->display, 0, window, XCB_EVENT_MASK_NO_EVENT, (const char *)&message);
+}
+
+static void
+findClients(compositor_t *compositor) {
+  /* Every top level window with the counters, windows already known keep their state */
+  xcb_query_tree_reply_t *tree =
+    xcb_query_tree_reply(compositor->display, xcb_query_tree(compositor->display, compositor->screen->root), NULL);
+
+  if (tree == NULL) {
+    return;
+  }
+
+  xcb_window_t *children = xcb_query_tree_children(tree);
+  int count = xcb_query_tree_children_length(tree);
+
+  for (int i = 0; i < count; i++) {
+    int known = 0;
+
+    for (int j = 0; j < compositor->count; j++) {
+      known |= compositor->clients[j].window == children[i];
+    }
+
+    if (known || compositor->count == MAX_CLIENTS) {
+      continue;
+    }
+
+    xcb_get_property_reply_t *property =
+      xcb_get_property_reply(compositor->display,
+                             xcb_get_property(compositor->display,
+                                              0,
+                                              children[i],
+                                              compositor->request_counter,
+                                              XCB_ATOM_CARDINAL,
+                                              0,
+                                              2),
+                             NULL);
+
+    if (property != NULL && xcb_get_property_value_length(property) == 8) {
+      const uint32_t *counters = xcb_get_property_value(property);
+      client_t *client = &compositor->clients[compositor->count++];
+
+      memset(client, 0, sizeof(client_t));
+      client->window = children[i];
+      client->extended = counters[1];
+      client->alive = 1;
+
+      printf("compositor: window 0x%x, extended counter 0x%x\n", client->window, client->extended);
+    }
+    free(property);
+  }
+  free(tree);
+}
+
+static void
+repaint(compositor_t *compositor,
+        uint64_t tick) {
+  /* Looks at every counter, then answers the windows that finished a frame since last time */
+  xcb_sync_query_counter_cookie_t cookies[MAX_CLIENTS];
+  uint64_t now = getTimeNs();
+
+  for (int i = 0; i < compositor->count; i++) {
+    cookies[i] = xcb_sync_query_counter(compositor->display, compositor->clients[i].extended);
+  }
+
+  for (int i = 0; i < compositor->count; i++) {
+    client_t *client = &compositor->clients[i];
+    xcb_sync_query_counter_reply_t *reply =
+      xcb_sync_query_counter_reply(compositor->display, cookies[i], NULL);
+
+    /* The counter is gone, so is the window */
+    if (reply == NULL) {
+      client->alive = 0;
+      continue;
+    }
+
+    uint64_t value = (uint64_t)(uint32_t)reply->counter_value.hi << 32 | reply->counter_value.lo;
+    free(reply);
+
+    if (client->requested != 0 && value >= client->requested && value % 2 == 0) {
+      compositor->honored++;
+      statAdd(&compositor->request_time, now - client->request_sent);
+      client->requested = 0;
+    }
+
+    /* Odd means a frame is being drawn, don't show it half done */
+    if (value % 2 == 1 || value <= client->seen) {
+      continue;
+    }
+
+    client->seen = value;
+    client->frames++;
+
+    /* Drawn now, and on screen at the next refresh */
+    uint64_t us = now / 1000;
+    uint32_t drawn[5] = {(uint32_t)value, (uint32_t)(value >> 32), (uint32_t)us, (uint32_t)(us >> 32), 0};
+    uint32_t timings[5] = {(uint32_t)value,
+                           (uint32_t)(value >> 32),
+                           (uint32_t)(compositor->refresh / 1000),
+                           (uint32_t)(compositor->refresh / 1000),
+                           0};
+
+    sendMessage(compositor, client->window, compositor->frame_drawn, drawn);
+    sendMessage(compositor, client->window, compositor->frame_timings, timings);
+  }
+
+  /* Drop the windows that went away */
+  int kept = 0;
+
+  for (int i = 0; i < compositor->count; i++) {
+    if (compositor->clients[i].alive) {
+      compositor->clients[kept++] = compositor->clients[i];
+    }
+    else {
+      printf("compositor: window 0x%x went away after %llu frames\n",
+             compositor->clients[i].window,
+             (unsigned long long)compositor->clients[i].frames);
+    }
+  }
+  compositor->count = kept;
+
+  int every = getenv("BLIT_SYNC_REQUESTS") != NULL ? atoi(getenv("BLIT_SYNC_REQUESTS")) : 120;
+
+  if (every <= 0 || tick % (uint64_t)every != 0) {
+    return;
+  }
+
+  for (int i = 0; i < compositor->count; i++) {
+    client_t *client = &compositor->clients[i];
+
+    if (client->requested != 0) {
+      continue;
+    }
+
+    /* Even, since it's for the extended counter */
+    uint64_t value = (client->seen + REQUEST_STEP) & ~1ull;
+    uint32_t request[5] = {compositor->sync_request, XCB_CURRENT_TIME, (uint32_t)value, (uint32_t)(value >> 32), 1};
+
+    sendMessage(compositor, client->window, compositor->protocols, request);
+    client->requested = value;
+    client->request_sent = now;
+    compositor->requests++;
+  }
+}
+
+int
+main(int argc,
+     char **argv) {
+  compositor_t compositor;
+  memset(&compositor, 0, sizeof(compositor));
+
+  compositor.display = xcb_connect(NULL, NULL);
+
+  if (xcb_connection_has_error(compositor.display)) {
+    fprintf(stderr, "Could not open the display! :(\n");
+    return 1;
+  }
+
+  compositor.screen = xcb_setup_roots_iterator(xcb_get_setup(compositor.display)).data;
+
+  xcb_sync_initialize_reply_t *version =
+    xcb_sync_initialize_reply(compositor.display, xcb_sync_initialize(compositor.display, 3, 1), NULL);
+
+  if (version == NULL) {
+    fprintf(stderr, "No SYNC extension on this display\n");
+    return 1;
+  }
+  free(version);
+
+  compositor.protocols = internAtom(compositor.display, "WM_PROTOCOLS");
+  compositor.sync_request = internAtom(compositor.display, "_NET_WM_SYNC_REQUEST");
+  compositor.request_counter = internAtom(compositor.display, "_NET_WM_SYNC_REQUEST_COUNTER");
+  compositor.frame_drawn = internAtom(compositor.display, "_NET_WM_FRAME_DRAWN");
+  compositor.frame_timings = internAtom(compositor.display, "_NET_WM_FRAME_TIMINGS");
+  compositor.request_time = newStat("compositor: sync request answered in");
+
+  double hz = getenv("BLIT_REFRESH") != NULL ? atof(getenv("BLIT_REFRESH")) : 60.0;
+
+  compositor.refresh = (uint64_t)(1e9 / (hz > 0 ? hz : 60.0));
+
+  uint64_t seconds = argc > 1 ? strtoull(argv[1], NULL, 10) : 0;
+  uint64_t start = getTimeNs();
+  uint64_t vblank = start;
+
+  printf("compositor: repainting every %.2fms\n", compositor.refresh / 1e6);
+
+  for (uint64_t tick = 0; seconds == 0 || getTimeNs() - start < seconds * 1000000000ull; tick++) {
+    if (tick % RESCAN == 0) {
+      findClients(&compositor);
+    }
+
+    repaint(&compositor, tick);
+    xcb_flush(compositor.display);
+
+    /* Nothing is read from the connection, but errors still pile up there */
+    xcb_generic_event_t *event;
+
+    while ((event = xcb_poll_for_event(compositor.display)) != NULL) {
+      free(event);
+    }
+
+    if (xcb_connection_has_error(compositor.display)) {
+      fprintf(stderr, "compositor: lost the display\n");
+      return 1;
+    }
+
+    if (tick % 600 == 0 && tick > 0) {
+      for (int i = 0; i < compositor.count; i++) {
+        printf("compositor: window 0x%x, %llu frames\n",
+               compositor.clients[i].window,
+               (unsigned long long)compositor.clients[i].frames);
+      }
+      printf("compositor: %llu of %llu sync requests answered\n",
+             (unsigned long long)compositor.honored,
+             (unsigned long long)compositor.requests);
+      statPrint(&compositor.request_time, 1e6, "ms");
+    }
+
+    /* Absolute, so repaints stay on their grid */
+    struct timespec t;
+
+    vblank += compositor.refresh;
+    t.tv_sec = (time_t)(vblank / 1000000000ull);
+    t.tv_nsec = (long)(vblank % 1000000000ull);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+  }
+
+  printf("compositor: %llu of %llu sync requests answered\n",
+         (unsigned long long)compositor.honored,
+         (unsigned long long)compositor.requests);
+  statPrint(&compositor.request_time, 1e6, "ms");
+
+  xcb_disconnect(compositor.display);
+  return 0;
+}
@@ -0,0 +1,381 @@
+#ifndef BLIT_CONVERT_H
+#define BLIT_CONVERT_H
+
+/*
+ * Converts 32 bit xRGB frames into whatever a visual actually stores, in one pass before upload
+ * Every channel goes through a lookup table that already has the 4x4 Bayer dither baked in,
+ * so depth 16 and 8 bit visuals get dithered output instead of banding
+ * 565/555 visuals have an SSE2 path that does 8 pixels at a time with the same result
+ * 8 bit PseudoColor visuals get a 6x6x6 color cube allocated once, instead of an alloc per color
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xcb/xcb.h>
+
+#include "blit_mem.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define CONVERT_SSE2 1
+#endif
+
+static const uint8_t bayer4[4][4] = {
+  { 0,  8,  2, 10},
+  {12,  4, 14,  6},
+  { 3, 11,  1,  9},
+  {15,  7, 13,  5}
+};
+
+typedef enum {
+  CONVERT_TRUECOLOR,
+  CONVERT_PALETTE
+} convert_kind_t;
+
+typedef struct {
+  convert_kind_t kind;
+  uint8_t depth;
+  uint8_t bpp; /* bits per pixel in a ZPixmap image, 8, 16, 24 or 32 */
+  int bits[3]; /* red, green, blue */
+  int shifts[3];
+  int fast16; /* 565 = 1, 555 = 2, no SSE2 path = 0 */
+
+  /* Channel value -> pixel bits, per dither threshold */
+  uint32_t lut[3][16][256];
+
+  /* Color cube index -> allocated pixel, only for CONVERT_PALETTE */
+  uint32_t palette[216];
+
+  uint8_t *scratch;
+  size_t scratch_size;
+} converter_t;
+
+static inline void
+maskBits(uint32_t mask,
+         int *shift,
+         int *bits) {
+  *shift = 0;
+  *bits = 0;
+
+  if (mask == 0) {
+    return;
+  }
+  while (!(mask & 1)) {
+    mask >>= 1;
+    (*shift)++;
+  }
+  while (mask & 1) {
+    mask >>= 1;
+    (*bits)++;
+  }
+}
+
+static inline uint32_t
+ditherLevel(uint32_t v,
+            int bits,
+            int threshold) {
+  /* Adds a fraction of one output step before truncating, same as the SSE2 path */
+  if (bits >= 8) {
+    /* Widen by repeating the top bits, e.g. 8 -> 10 bits for depth 30 */
+    return (v << (bits - 8)) | (v >> (16 - bits));
+  }
+
+  uint32_t step = 1u << (8 - bits);
+  uint32_t dithered = v + (threshold * step) / 16;
+
+  return (dithered > 255 ? 255 : dithered) >> (8 - bits);
+}
+
+static inline void
+buildLuts(converter_t *conv) {
+  for (int t = 0; t < 16; t++) {
+    for (int v = 0; v < 256; v++) {
+      if (conv->kind == CONVERT_PALETTE) {
+        /* 6 levels per channel, red * 36 + green * 6 + blue indexes the cube */
+        int level = (v * 5 * 16 + t * 255) / (255 * 16);
+        conv->lut[0][t][v] = (uint32_t)level * 36;
+        conv->lut[1][t][v] = (uint32_t)level * 6;
+        conv->lut[2][t][v] = (uint32_t)level;
+        continue;
+      }
+
+      for (int c = 0; c < 3; c++) {
+        conv->lut[c][t][v] = ditherLevel((uint32_t)v, conv->bits[c], t) << conv->shifts[c];
+      }
+    }
+  }
+}
+
+static inline uint8_t
+formatBpp(const xcb_setup_t *setup,
+          uint8_t depth) {
+  xcb_format_iterator_t iter = xcb_setup_pixmap_formats_iterator(setup);
+
+  for (; iter.rem; xcb_format_next(&iter)) {
+    if (iter.data->depth == depth) {
+      return iter.data->bits_per_pixel;
+    }
+  }
+  return 0;
+}
+
+static inline converter_t*
+allocConverter(xcb_connection_t *display,
+               xcb_screen_t *screen,
+               const xcb_visualtype_t *visual) {
+  /* Returns NULL for anything it can't handle, callers then keep their old path */
+  const xcb_setup_t *setup = xcb_get_setup(display);
+
+  if (setup->image_byte_order != XCB_IMAGE_ORDER_LSB_FIRST) {
+    fprintf(stderr, "Only LSB first images are converted\n");
+    return NULL;
+  }
+
+  converter_t *conv = memCalloc(1, sizeof(converter_t));
+
+  conv->depth = screen->root_depth;
+  conv->bpp = formatBpp(setup, conv->depth);
+
+  if (conv->bpp != 8 && conv->bpp != 16 && conv->bpp != 24 && conv->bpp != 32) {
+    memFree(conv);
+    return NULL;
+  }
+
+  if (visual->_class == XCB_VISUAL_CLASS_TRUE_COLOR ||
+      visual->_class == XCB_VISUAL_CLASS_DIRECT_COLOR) {
+    conv->kind = CONVERT_TRUECOLOR;
+    maskBits(visual->red_mask, &conv->shifts[0], &conv->bits[0]);
+    maskBits(visual->green_mask, &conv->shifts[1], &conv->bits[1]);
+    maskBits(visual->blue_mask, &conv->shifts[2], &conv->bits[2]);
+
+    if (conv->bpp == 16 && visual->red_mask == 0xf800 &&
+        visual->green_mask == 0x07e0 && visual->blue_mask == 0x001f) {
+      conv->fast16 = 1;
+    }
+    if (conv->bpp == 16 && visual->red_mask == 0x7c00 &&
+        visual->green_mask == 0x03e0 && visual->blue_mask == 0x001f) {
+      conv->fast16 = 2;
+    }
+  }
+  else if (visual->_class == XCB_VISUAL_CLASS_PSEUDO_COLOR && conv->bpp == 8) {
+    /* Allocate the whole cube up front, all the requests first and then all the replies */
+    xcb_alloc_color_cookie_t cookies[216];
+
+    conv->kind = CONVERT_PALETTE;
+
+    for (int i = 0; i < 216; i++) {
+      cookies[i] = xcb_alloc_color(display,
+                                   screen->default_colormap,
+                                   (uint16_t)((i / 36) * 65535 / 5),
+                                   (uint16_t)(((i / 6) % 6) * 65535 / 5),
+                                   (uint16_t)((i % 6) * 65535 / 5));
+    }
+
+    for (int i = 0; i < 216; i++) {
+      xcb_alloc_color_reply_t *reply = xcb_alloc_color_reply(display, cookies[i], NULL);
+
+      conv->palette[i] = reply != NULL ? reply->pixel : screen->black_pixel;
+      free(reply);
+    }
+  }
+  else {
+    memFree(conv);
+    return NULL;
+  }
+
+  buildLuts(conv);
+
+  printf("Converting to depth %u, %u bits per pixel%s\n",
+         conv->depth,
+         conv->bpp,
+         conv->fast16 ? " (SSE2)" : "");
+
+  return conv;
+}
+
+static inline void
+freeConverter(converter_t *conv) {
+  if (conv == NULL) {
+    return;
+  }
+  memFree(conv->scratch);
+  memFree(conv);
+}
+
+static inline uint32_t
+convertPixel(const converter_t *conv,
+             uint32_t p,
+             int t) {
+  uint32_t pixel = conv->lut[0][t][(p >> 16) & 0xff] |
+                   conv->lut[1][t][(p >> 8) & 0xff] |
+                   conv->lut[2][t][p & 0xff];
+
+  return conv->kind == CONVERT_PALETTE ? conv->palette[pixel] : pixel;
+}
+
+static inline void
+convertRowScalar(const converter_t *conv,
+                 const uint32_t *src,
+                 uint8_t *dst,
+                 int n,
+                 int x,
+                 int y) {
+  /* x and y are where the row is in the frame, so the dither pattern lines up */
+  const uint8_t *thresholds = bayer4[y & 3];
+
+  for (int i = 0; i < n; i++) {
+    uint32_t pixel = convertPixel(conv, src[i], thresholds[(x + i) & 3]);
+
+    switch (conv->bpp) {
+      case 8:
+        dst[i] = (uint8_t)pixel;
+        break;
+      case 16:
+        ((uint16_t *)dst)[i] = (uint16_t)pixel;
+        break;
+      case 24:
+        dst[i * 3] = (uint8_t)pixel;
+        dst[i * 3 + 1] = (uint8_t)(pixel >> 8);
+        dst[i * 3 + 2] = (uint8_t)(pixel >> 16);
+        break;
+      default:
+        ((uint32_t *)dst)[i] = pixel;
+        break;
+    }
+  }
+}
+
+#ifdef CONVERT_SSE2
+static inline __m128i
+pack565(__m128i p,
+        int fast16) {
+  /* Turns 4 xRGB pixels into 4 16 bit pixels in the low half of each 32 bit lane */
+  __m128i r, g, b;
+
+  if (fast16 == 1) {
+    r = _mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xf800));
+    g = _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x07e0));
+  }
+  else {
+    r = _mm_and_si128(_mm_srli_epi32(p, 9), _mm_set1_epi32(0x7c00));
+    g = _mm_and_si128(_mm_srli_epi32(p, 6), _mm_set1_epi32(0x03e0));
+  }
+  b = _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x001f));
+
+  /* Sign extend so packs_epi32 keeps all 16 bits */
+  p = _mm_or_si128(_mm_or_si128(r, g), b);
+  return _mm_srai_epi32(_mm_slli_epi32(p, 16), 16);
+}
+
+static inline void
+convertRow16SSE2(const converter_t *conv,
+                 const uint32_t *src,
+                 uint8_t *dst,
+                 int n,
+                 int x,
+                 int y) {
+  /* The 4 wide Bayer row fits exactly in one register, as per channel byte offsets */
+  uint8_t offsets[16];
+  int rbits = conv->bits[0];
+  int gbits = conv->bits[1];
+  int bbits = conv->bits[2];
+
+  for (int i = 0; i < 4; i++) {
+    int t = bayer4[y & 3][(x + i) & 3];
+    offsets[i * 4] = (uint8_t)((t << (8 - bbits)) / 16);
+    offsets[i * 4 + 1] = (uint8_t)((t << (8 - gbits)) / 16);
+    offsets[i * 4 + 2] = (uint8_t)((t << (8 - rbits)) / 16);
+    offsets[i * 4 + 3] = 0;
+  }
+
+  __m128i dither = _mm_loadu_si128((const __m128i *)offsets);
+  uint16_t *d = (uint16_t *)dst;
+  int i = 0;
+
+  /* 8 pixels per iteration, 8 keeps the dither phase the same */
+  for (; i + 8 <= n; i += 8) {
+    __m128i lo = _mm_adds_epu8(_mm_loadu_si128((const __m128i *)(src + i)), dither);
+    __m128i hi = _mm_adds_epu8(_mm_loadu_si128((const __m128i *)(src + i + 4)), dither);
+
+    _mm_storeu_si128((__m128i *)(d + i),
+                     _mm_packs_epi32(pack565(lo, conv->fast16), pack565(hi, conv->fast16)));
+  }
+
+  convertRowScalar(conv, src + i, (uint8_t *)(d + i), n - i, x + i, y);
+}
+#endif
+
+static inline void
+convertRow(const converter_t *conv,
+           const uint32_t *src,
+           uint8_t *dst,
+           int n,
+           int x,
+           int y) {
+#ifdef CONVERT_SSE2
+  if (conv->fast16) {
+    convertRow16SSE2(conv, src, dst, n, x, y);
+    return;
+  }
+#endif
+  convertRowScalar(conv, src, dst, n, x, y);
+}
+
+static inline size_t
+convertStride(const converter_t *conv,
+              int width) {
+  /* ZPixmap rows are padded to 32 bits */
+  return (((size_t)width * conv->bpp + 31) / 32) * 4;
+}
+
+static inline void
+convertPut(converter_t *conv,
+           xcb_connection_t *display,
+           xcb_drawable_t drawable,
+           xcb_gcontext_t gc,
+           const uint8_t *data,
+           int stride,
+           int x,
+           int y,
+           int w,
+           int h) {
+  /* Converts a rectangle of the frame and uploads it, in bands under the max request length */
+  size_t row_bytes = convertStride(conv, w);
+  size_t max_bytes = (size_t)xcb_get_maximum_request_length(display) * 4 - 64;
+  int band = (int)(max_bytes / row_bytes);
+
+  band = band > h ? h : band;
+
+  if (row_bytes * band > conv->scratch_size) {
+    conv->scratch_size = row_bytes * band;
+    conv->scratch = memRealloc(conv->scratch, conv->scratch_size);
+  }
+
+  for (int top = y; top < y + h; top += band) {
+    int n = y + h - top < band ? y + h - top : band;
+
+    for (int row = 0; row < n; row++) {
+      convertRow(conv,
+                 (const uint32_t *)(data + (size_t)(top + row) * stride) + x,
+                 conv->scratch + row_bytes * row,
+                 w,
+                 x,
+                 top + row);
+    }
+
+    xcb_put_image(display,
+                  XCB_IMAGE_FORMAT_Z_PIXMAP,
+                  drawable,
+                  gc,
+                  (uint16_t)w, (uint16_t)n,
+                  (int16_t)x, (int16_t)top,
+                  0,
+                  conv->depth,
+                  (uint32_t)(row_bytes * n),
+                  conv->scratch);
+  }
+}
+
+#endif
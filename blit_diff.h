@@ -0,0 +1,305 @@
+#ifndef BLIT_DIFF_H
+#define BLIT_DIFF_H
+
+/*
+ * Finds which 64x64 tiles changed between two 32 bit frames
+ * The result is a bitmap with one bit per tile, the present step only uploads tiles that are set
+ * A tile stops being compared at the first row that differs, so changed tiles are cheap
+ * and the full cost is only paid for tiles that really are the same
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blit_mem.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIFF_X86 1
+#endif
+
+#define DIFF_TILE 64
+
+typedef struct {
+  uint64_t *bits;
+  int cols;
+  int rows;
+  int dirty; /* number of bits set */
+} dirty_map_t;
+
+typedef int (*row_differs_fn)(const uint8_t*,
+                              const uint8_t*,
+                              size_t);
+
+static inline int
+rowDiffersScalar(const uint8_t *a,
+                 const uint8_t *b,
+                 size_t length) {
+  return memcmp(a, b, length) != 0;
+}
+
+#ifdef DIFF_X86
+static inline int
+rowDiffersSSE2(const uint8_t *a,
+               const uint8_t *b,
+               size_t length) {
+  size_t i = 0;
+
+  /* 64 bytes per iteration, or'ing the xors together so there is only one branch */
+  for (; i + 64 <= length; i += 64) {
+    __m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)),
+                               _mm_loadu_si128((const __m128i *)(b + i)));
+    __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + 16)),
+                               _mm_loadu_si128((const __m128i *)(b + i + 16)));
+    __m128i x2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + 32)),
+                               _mm_loadu_si128((const __m128i *)(b + i + 32)));
+    __m128i x3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i + 48)),
+                               _mm_loadu_si128((const __m128i *)(b + i + 48)));
+    __m128i x = _mm_or_si128(_mm_or_si128(x0, x1), _mm_or_si128(x2, x3));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xffff) {
+      return 1;
+    }
+  }
+
+  for (; i + 16 <= length; i += 16) {
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                _mm_loadu_si128((const __m128i *)(b + i)));
+
+    if (_mm_movemask_epi8(eq) != 0xffff) {
+      return 1;
+    }
+  }
+
+  return memcmp(a + i, b + i, length - i) != 0;
+}
+
+__attribute__((target("avx2")))
+static inline int
+rowDiffersAVX2(const uint8_t *a,
+               const uint8_t *b,
+               size_t length) {
+  size_t i = 0;
+
+  for (; i + 128 <= length; i += 128) {
+    __m256i x0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                  _mm256_loadu_si256((const __m256i *)(b + i)));
+    __m256i x1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i + 32)),
+                                  _mm256_loadu_si256((const __m256i *)(b + i + 32)));
+    __m256i x2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i + 64)),
+                                  _mm256_loadu_si256((const __m256i *)(b + i + 64)));
+    __m256i x3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i + 96)),
+                                  _mm256_loadu_si256((const __m256i *)(b + i + 96)));
+    __m256i x = _mm256_or_si256(_mm256_or_si256(x0, x1), _mm256_or_si256(x2, x3));
+
+    if (!_mm256_testz_si256(x, x)) {
+      return 1;
+    }
+  }
+
+  for (; i + 32 <= length; i += 32) {
+    __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                 _mm256_loadu_si256((const __m256i *)(b + i)));
+
+    if (!_mm256_testz_si256(x, x)) {
+      return 1;
+    }
+  }
+
+  return memcmp(a + i, b + i, length - i) != 0;
+}
+#endif
+
+static inline row_differs_fn
+getRowDiffer(void) {
+  /* Picks the widest compare the cpu has, BLIT_DIFF_ISA=scalar|sse2|avx2 overrides it */
+  const char *isa = getenv("BLIT_DIFF_ISA");
+
+  if (isa != NULL && strcmp(isa, "scalar") == 0) {
+    return rowDiffersScalar;
+  }
+
+#ifdef DIFF_X86
+  if (isa != NULL && strcmp(isa, "sse2") == 0) {
+    return rowDiffersSSE2;
+  }
+
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    return rowDiffersAVX2;
+  }
+  return rowDiffersSSE2;
+#else
+  return rowDiffersScalar;
+#endif
+}
+
+static inline void
+dirtyMapAlloc(dirty_map_t *map,
+              int width,
+              int height) {
+  map->cols = (width + DIFF_TILE - 1) / DIFF_TILE;
+  map->rows = (height + DIFF_TILE - 1) / DIFF_TILE;
+  map->dirty = 0;
+  map->bits = memCalloc(((size_t)map->cols * map->rows + 63) / 64, sizeof(uint64_t));
+}
+
+static inline void
+dirtyMapFree(dirty_map_t *map) {
+  memFree(map->bits);
+  map->bits = NULL;
+}
+
+static inline int
+dirtyMapTest(const dirty_map_t *map,
+             int tx,
+             int ty) {
+  size_t i = (size_t)ty * map->cols + tx;
+  return (map->bits[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void
+dirtyMapSet(dirty_map_t *map,
+            int tx,
+            int ty) {
+  size_t i = (size_t)ty * map->cols + tx;
+
+  if (!((map->bits[i / 64] >> (i % 64)) & 1)) {
+    map->bits[i / 64] |= 1ull << (i % 64);
+    map->dirty++;
+  }
+}
+
+static inline void
+dirtyMapClear(dirty_map_t *map) {
+  memset(map->bits, 0, ((size_t)map->cols * map->rows + 63) / 64 * sizeof(uint64_t));
+  map->dirty = 0;
+}
+
+static inline void
+dirtyMapFill(dirty_map_t *map) {
+  /* Everything is dirty, e.g. after an expose or for a new stream viewer */
+  for (int ty = 0; ty < map->rows; ty++) {
+    for (int tx = 0; tx < map->cols; tx++) {
+      dirtyMapSet(map, tx, ty);
+    }
+  }
+}
+
+static inline void
+dirtyMapSetRect(dirty_map_t *map,
+                int x1,
+                int y1,
+                int x2,
+                int y2) {
+  /* Marks every tile touching [x1, x2) x [y1, y2), clipped to the map */
+  int tx2 = (x2 + DIFF_TILE - 1) / DIFF_TILE;
+  int ty2 = (y2 + DIFF_TILE - 1) / DIFF_TILE;
+
+  tx2 = tx2 < map->cols ? tx2 : map->cols;
+  ty2 = ty2 < map->rows ? ty2 : map->rows;
+
+  for (int ty = y1 > 0 ? y1 / DIFF_TILE : 0; ty < ty2; ty++) {
+    for (int tx = x1 > 0 ? x1 / DIFF_TILE : 0; tx < tx2; tx++) {
+      dirtyMapSet(map, tx, ty);
+    }
+  }
+}
+
+static inline void
+dirtyMapMerge(dirty_map_t *map,
+              const dirty_map_t *other) {
+  /* Adds the tiles set in other, both maps have to be the same size */
+  for (int ty = 0; ty < map->rows; ty++) {
+    for (int tx = 0; tx < map->cols; tx++) {
+      if (dirtyMapTest(other, tx, ty)) {
+        dirtyMapSet(map, tx, ty);
+      }
+    }
+  }
+}
+
+static inline int
+diffFrame(row_differs_fn differs,
+          const uint8_t *cur,
+          const uint8_t *prev,
+          int stride,
+          int width,
+          int height,
+          dirty_map_t *map) {
+  /* Sets the bits for every tile of cur that isn't the same in prev, returns how many there are */
+  /* Walks a whole tile row one pixel row at a time so memory is read front to back */
+  /* Tiles that are already known to be dirty get skipped for the rest of their rows */
+  dirtyMapClear(map);
+
+  for (int ty = 0; ty < map->rows; ty++) {
+    int y = ty * DIFF_TILE;
+    int h = height - y < DIFF_TILE ? height - y : DIFF_TILE;
+    int clean = map->cols;
+
+    for (int row = y; row < y + h && clean > 0; row++) {
+      size_t offset = (size_t)row * stride;
+
+      for (int tx = 0; tx < map->cols; tx++) {
+        if (dirtyMapTest(map, tx, ty)) {
+          continue;
+        }
+
+        int x = tx * DIFF_TILE;
+        size_t length = (size_t)(width - x < DIFF_TILE ? width - x : DIFF_TILE) * 4;
+
+        if (differs(cur + offset + (size_t)x * 4, prev + offset + (size_t)x * 4, length)) {
+          dirtyMapSet(map, tx, ty);
+          clean--;
+        }
+      }
+    }
+  }
+
+  return map->dirty;
+}
+
+static inline void
+diffCommit(const uint8_t *cur,
+           uint8_t *prev,
+           int stride,
+           int width,
+           int height,
+           const dirty_map_t *map) {
+  /* Copies the dirty tiles over so prev matches what was just presented */
+  for (int ty = 0; ty < map->rows; ty++) {
+    int y = ty * DIFF_TILE;
+    int h = height - y < DIFF_TILE ? height - y : DIFF_TILE;
+
+    for (int tx = 0; tx < map->cols; tx++) {
+      if (!dirtyMapTest(map, tx, ty)) {
+        continue;
+      }
+
+      int x = tx * DIFF_TILE;
+      size_t length = (size_t)(width - x < DIFF_TILE ? width - x : DIFF_TILE) * 4;
+
+      for (int row = y; row < y + h; row++) {
+        size_t offset = (size_t)row * stride + (size_t)x * 4;
+        memcpy(prev + offset, cur + offset, length);
+      }
+    }
+  }
+}
+
+static inline int
+dirtyRunLength(const dirty_map_t *map,
+               int tx,
+               int ty) {
+  /* How many dirty tiles in a row start at (tx, ty), used to merge them into one upload */
+  int n = 0;
+
+  while (tx + n < map->cols && dirtyMapTest(map, tx + n, ty)) {
+    n++;
+  }
+  return n;
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef BLIT_EVENTS_H
+#define BLIT_EVENTS_H
+
+/*
+ * Helpers for draining the whole event queue once per frame
+ * Configure notifies collapse into the last size seen and exposes into one damaged rectangle,
+ * so a resize drag costs one resize per frame instead of one per event
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <xcb/xcb.h>
+
+#include "blit_stats.h"
+
+typedef struct {
+  int events; /* how many were drained this frame */
+  uint64_t arrived; /* when the first one was read */
+
+  int configures;
+  uint16_t width;
+  uint16_t height;
+
+  int exposes;
+  int x1; /* bounding box of all the exposed rectangles */
+  int y1;
+  int x2;
+  int y2;
+} event_batch_t;
+
+typedef struct {
+  uint64_t frames;
+  stat_t depth;
+  stat_t latency;
+  stat_t configures;
+  stat_t exposes;
+} event_stats_t;
+
+static inline void
+batchBegin(event_batch_t *batch) {
+  memset(batch, 0, sizeof(event_batch_t));
+}
+
+static inline void
+batchEvent(event_batch_t *batch) {
+  if (batch->events++ == 0) {
+    batch->arrived = getTimeNs();
+  }
+}
+
+static inline void
+batchEventAt(event_batch_t *batch,
+             uint64_t arrived) {
+  /* Same, for events read earlier on another thread */
+  if (batch->events++ == 0 || arrived < batch->arrived) {
+    batch->arrived = arrived;
+  }
+}
+
+static inline void
+batchConfigure(event_batch_t *batch,
+               const xcb_configure_notify_event_t *configure_notify) {
+  /* Only the last size matters */
+  batch->configures++;
+  batch->width = configure_notify->width;
+  batch->height = configure_notify->height;
+}
+
+static inline void
+batchExpose(event_batch_t *batch,
+            const xcb_expose_event_t *expose) {
+  int x2 = expose->x + expose->width;
+  int y2 = expose->y + expose->height;
+
+  if (batch->exposes++ == 0) {
+    batch->x1 = expose->x;
+    batch->y1 = expose->y;
+    batch->x2 = x2;
+    batch->y2 = y2;
+    return;
+  }
+
+  batch->x1 = expose->x < batch->x1 ? expose->x : batch->x1;
+  batch->y1 = expose->y < batch->y1 ? expose->y : batch->y1;
+  batch->x2 = x2 > batch->x2 ? x2 : batch->x2;
+  batch->y2 = y2 > batch->y2 ? y2 : batch->y2;
+}
+
+static inline event_stats_t
+eventStats(void) {
+  event_stats_t stats;
+  stats.frames = 0;
+  stats.depth = newStat("Events per frame");
+  stats.latency = newStat("Event to present");
+  stats.configures = newStat("Configures per frame");
+  stats.exposes = newStat("Exposes per frame");
+  return stats;
+}
+
+static inline void
+eventStatsFrame(event_stats_t *stats,
+                const event_batch_t *batch) {
+  /* Call right after the frame that handled the batch was presented */
+  statAdd(&stats->depth, (uint64_t)batch->events);
+  statAdd(&stats->configures, (uint64_t)batch->configures);
+  statAdd(&stats->exposes, (uint64_t)batch->exposes);
+
+  if (batch->events > 0) {
+    statAdd(&stats->latency, getTimeNs() - batch->arrived);
+  }
+
+  if (++stats->frames % 100 == 0) {
+    statPrint(&stats->depth, 1.0, "");
+    statPrint(&stats->configures, 1.0, "");
+    statPrint(&stats->exposes, 1.0, "");
+    statPrint(&stats->latency, 1000.0, "us");
+
+    statReset(&stats->depth);
+    statReset(&stats->configures);
+    statReset(&stats->exposes);
+    statReset(&stats->latency);
+  }
+}
+
+#endif
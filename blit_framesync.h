@@ -0,0 +1,374 @@
+#ifndef BLIT_FRAMESYNC_H
+#define BLIT_FRAMESYNC_H
+
+/*
+ * Frames paced by the compositor instead of a fixed timer, BLIT_FRAMESYNC=1 turns it on
+ * This is the extended _NET_WM_SYNC_REQUEST protocol, the window gets two XSync counters
+ * listed in _NET_WM_SYNC_REQUEST_COUNTER (it has to be set before the window is mapped)
+ *   the extended counter goes odd when a frame starts and even when it's done, so the
+ *   compositor knows not to show half drawn frames
+ *   the compositor answers every finished frame with _NET_WM_FRAME_DRAWN when it has drawn
+ *   it and _NET_WM_FRAME_TIMINGS once it's on screen, with the refresh interval
+ *   the next frame starts when the last one was drawn, late enough to finish just before the
+ *   compositor's next repaint
+ *   _NET_WM_SYNC_REQUEST asks for a given counter value at the end of the next frame, the
+ *   window manager uses it to wait for resizes
+ * Without a compositor no _NET_WM_FRAME_DRAWN ever comes, and the loops keep pacing themselves
+ * See blit_compositor.c for a stand-in compositor to run it against
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <xcb/sync.h>
+#include <xcb/xcb.h>
+
+#include "blit_mem.h"
+#include "blit_stats.h"
+
+#define FRAMESYNC_TIMEOUT 100000000ull /* ns without _NET_WM_FRAME_DRAWN before pacing ourselves again */
+#define FRAMESYNC_POLL 500000ull /* ns between looking for events while waiting */
+#define FRAMESYNC_MARGIN 1000000ull /* ns a frame should be done before the compositor's next repaint */
+
+#define FRAMESYNC_ATOMS 5
+
+typedef struct {
+  xcb_connection_t *display;
+  xcb_window_t window;
+
+  xcb_sync_counter_t basic; /* only moves for _NET_WM_SYNC_REQUEST */
+  xcb_sync_counter_t extended; /* odd while a frame is being drawn */
+  uint64_t value; /* the extended counter's */
+
+  xcb_atom_t protocols;
+  xcb_atom_t sync_request;
+  xcb_atom_t request_counter;
+  xcb_atom_t frame_drawn;
+  xcb_atom_t frame_timings;
+
+  /* _NET_WM_SYNC_REQUEST, answered when the next frame ends */
+  int requested;
+  int request_extended;
+  uint64_t request_value;
+
+  int paced; /* the compositor answers, so it says when frames start */
+  int waiting; /* the last frame hasn't been drawn yet */
+  uint64_t ended; /* when it was done */
+  uint64_t ended_value;
+  uint64_t drawn_at; /* when the compositor drew it, by its clock */
+  uint64_t next; /* earliest the next frame may start */
+  uint64_t refresh; /* ns, 0 until _NET_WM_FRAME_TIMINGS says */
+  uint64_t estimate; /* how long a frame takes here, ns */
+
+  uint64_t frames;
+  uint64_t drawn;
+  uint64_t timeouts;
+  uint64_t requests;
+  stat_t to_drawn; /* frame done to the compositor drawing it */
+  stat_t to_presented; /* frame done to on screen, from the timings */
+  stat_t delay; /* how late the compositor was, from the timings */
+} framesync_t;
+
+static inline xcb_sync_int64_t
+frameSyncInt64(uint64_t value) {
+  xcb_sync_int64_t v = {(int32_t)(value >> 32), (uint32_t)value};
+  return v;
+}
+
+static inline uint64_t
+frameSyncData64(const uint32_t *data) {
+  /* Client messages split 64 bit values into a low then a high 32 bit half */
+  return (uint64_t)data[0] | (uint64_t)data[1] << 32;
+}
+
+static inline framesync_t*
+allocFrameSync(xcb_connection_t *display,
+               xcb_window_t window) {
+  /* Call before the window is mapped, the compositor only looks for the counters then */
+  if (getenv("BLIT_FRAMESYNC") == NULL || strcmp(getenv("BLIT_FRAMESYNC"), "1") != 0) {
+    return NULL;
+  }
+
+  xcb_sync_initialize_reply_t *version =
+    memReply(xcb_sync_initialize_reply(display, xcb_sync_initialize(display, 3, 1), NULL));
+
+  if (version == NULL) {
+    fprintf(stderr, "No SYNC extension on this display, frames won't be paced by the compositor\n");
+    return NULL;
+  }
+  memFreeReply(version);
+
+  framesync_t *framesync = memCalloc(1, sizeof(framesync_t));
+
+  framesync->display = display;
+  framesync->window = window;
+  framesync->to_drawn = newStat("framesync: done to drawn");
+  framesync->to_presented = newStat("framesync: done to presented");
+  framesync->delay = newStat("framesync: compositor delay");
+
+  /* All the atoms in one round trip */
+  static const char *names[FRAMESYNC_ATOMS] = {"WM_PROTOCOLS",
+                                               "_NET_WM_SYNC_REQUEST",
+                                               "_NET_WM_SYNC_REQUEST_COUNTER",
+                                               "_NET_WM_FRAME_DRAWN",
+                                               "_NET_WM_FRAME_TIMINGS"};
+  xcb_atom_t *atoms[FRAMESYNC_ATOMS] = {&framesync->protocols,
+                                        &framesync->sync_request,
+                                        &framesync->request_counter,
+                                        &framesync->frame_drawn,
+                                        &framesync->frame_timings};
+  xcb_intern_atom_cookie_t cookies[FRAMESYNC_ATOMS];
+
+  for (int i = 0; i < FRAMESYNC_ATOMS; i++) {
+    cookies[i] = xcb_intern_atom(display, 0, (uint16_t)strlen(names[i]), names[i]);
+  }
+
+  for (int i = 0; i < FRAMESYNC_ATOMS; i++) {
+    xcb_intern_atom_reply_t *atom = memReply(xcb_intern_atom_reply(display, cookies[i], NULL));
+
+    *atoms[i] = atom != NULL ? atom->atom : XCB_ATOM_NONE;
+    memFreeReply(atom);
+  }
+
+  framesync->basic = xcb_generate_id(display);
+  framesync->extended = xcb_generate_id(display);
+
+  xcb_sync_create_counter(display, framesync->basic, frameSyncInt64(0));
+  xcb_sync_create_counter(display, framesync->extended, frameSyncInt64(0));
+
+  uint32_t counters[2] = {framesync->basic, framesync->extended};
+
+  xcb_change_property(display,
+                      XCB_PROP_MODE_APPEND,
+                      window,
+                      framesync->protocols,
+                      XCB_ATOM_ATOM,
+                      32,
+                      1,
+                      &framesync->sync_request);
+
+  xcb_change_property(display,
+                      XCB_PROP_MODE_REPLACE,
+                      window,
+                      framesync->request_counter,
+                      XCB_ATOM_CARDINAL,
+                      32,
+                      2,
+                      counters);
+
+  printf("Frame sync counters 0x%x and 0x%x on window 0x%x\n", counters[0], counters[1], window);
+
+  return framesync;
+}
+
+static inline void
+frameSyncReport(framesync_t *framesync) {
+  printf("framesync: %llu frames, %llu drawn, %llu timeouts, %llu sync requests, %s, refresh %.2fms\n",
+         (unsigned long long)framesync->frames,
+         (unsigned long long)framesync->drawn,
+         (unsigned long long)framesync->timeouts,
+         (unsigned long long)framesync->requests,
+         framesync->paced ? "paced by the compositor" : "self paced",
+         framesync->refresh / 1e6);
+  statPrint(&framesync->to_drawn, 1e6, "ms");
+  statPrint(&framesync->to_presented, 1e6, "ms");
+  statPrint(&framesync->delay, 1e6, "ms");
+  statReset(&framesync->to_drawn);
+  statReset(&framesync->to_presented);
+  statReset(&framesync->delay);
+}
+
+static inline void
+freeFrameSync(framesync_t *framesync) {
+  if (framesync == NULL) {
+    return;
+  }
+  frameSyncReport(framesync);
+  xcb_sync_destroy_counter(framesync->display, framesync->basic);
+  xcb_sync_destroy_counter(framesync->display, framesync->extended);
+  memFree(framesync);
+}
+
+static inline int
+frameSyncMessage(framesync_t *framesync,
+                 const xcb_client_message_event_t *message) {
+  /* Call for every client message, returns 1 if it was one of ours */
+  if (framesync == NULL || message->window != framesync->window || message->format != 32) {
+    return 0;
+  }
+
+  const uint32_t *data = message->data.data32;
+  uint64_t now = getTimeNs();
+
+  if (message->type == framesync->protocols && data[0] == framesync->sync_request) {
+    /* The extended counter is asked for if the fifth value is set */
+    framesync->requested = 1;
+    framesync->request_value = frameSyncData64(data + 2);
+    framesync->request_extended = data[4] != 0;
+    return 1;
+  }
+
+  if (message->type == framesync->frame_drawn) {
+    if (!framesync->waiting || frameSyncData64(data) < framesync->ended_value) {
+      return 1;
+    }
+
+    /* Timestamps are CLOCK_MONOTONIC in microseconds, the same clock as getTimeNs */
+    uint64_t drawn = frameSyncData64(data + 2) * 1000;
+
+    if (drawn < framesync->ended || drawn > now) {
+      drawn = now;
+    }
+
+    framesync->waiting = 0;
+    framesync->paced = 1;
+    framesync->drawn++;
+    framesync->drawn_at = drawn;
+    statAdd(&framesync->to_drawn, drawn - framesync->ended);
+
+    /* Start late enough to be done just before the repaint after this one */
+    uint64_t lead = framesync->estimate + FRAMESYNC_MARGIN;
+
+    framesync->next = framesync->refresh > lead ? drawn + framesync->refresh - lead : drawn;
+    return 1;
+  }
+
+  if (message->type == framesync->frame_timings) {
+    int32_t offset = (int32_t)data[2]; /* us from drawn to presented, INT32_MIN if unknown */
+    uint32_t refresh = data[3]; /* us, 0 if unknown */
+    uint32_t delay = data[4]; /* us, 0xffffffff if unknown */
+
+    if (refresh > 0) {
+      framesync->refresh = (uint64_t)refresh * 1000;
+    }
+
+    if (offset != INT32_MIN && frameSyncData64(data) == framesync->ended_value) {
+      int64_t presented = (int64_t)framesync->drawn_at + (int64_t)offset * 1000;
+
+      if (presented > (int64_t)framesync->ended) {
+        statAdd(&framesync->to_presented, (uint64_t)(presented - (int64_t)framesync->ended));
+      }
+    }
+
+    if (delay != 0xffffffff) {
+      statAdd(&framesync->delay, (uint64_t)delay * 1000);
+    }
+    return 1;
+  }
+
+  return 0;
+}
+
+static inline void
+frameSyncBegin(framesync_t *framesync) {
+  /* Call when a frame starts drawing */
+  if (framesync == NULL) {
+    return;
+  }
+
+  if (framesync->value % 2 == 0) {
+    framesync->value++;
+  }
+  xcb_sync_set_counter(framesync->display, framesync->extended, frameSyncInt64(framesync->value));
+}
+
+static inline void
+frameSyncEnd(framesync_t *framesync,
+             uint64_t estimate) {
+  /* Call once everything for the frame has been sent, before the flush */
+  /* The counter is a request like any other, so the server sees it after the frame */
+  if (framesync == NULL) {
+    return;
+  }
+
+  framesync->value++;
+
+  if (framesync->requested) {
+    if (framesync->request_extended) {
+      /* Always even, and never backwards */
+      uint64_t value = framesync->request_value + framesync->request_value % 2;
+
+      framesync->value = value > framesync->value ? value : framesync->value;
+    }
+    else {
+      xcb_sync_set_counter(framesync->display, framesync->basic, frameSyncInt64(framesync->request_value));
+    }
+    framesync->requested = 0;
+    framesync->requests++;
+  }
+
+  xcb_sync_set_counter(framesync->display, framesync->extended, frameSyncInt64(framesync->value));
+
+  framesync->waiting = 1;
+  framesync->ended = getTimeNs();
+  framesync->ended_value = framesync->value;
+  framesync->estimate = estimate;
+
+  if (++framesync->frames % 100 == 0) {
+    frameSyncReport(framesync);
+  }
+}
+
+static inline int
+frameSyncPaced(const framesync_t *framesync) {
+  /* 1 if the compositor decides when frames start, the loop shouldn't pace them too */
+  return framesync != NULL && framesync->paced;
+}
+
+static inline int
+frameSyncReady(framesync_t *framesync) {
+  /* 1 if the next frame can start */
+  if (!frameSyncPaced(framesync)) {
+    return 1;
+  }
+
+  uint64_t now = getTimeNs();
+
+  if (framesync->waiting) {
+    /* The compositor went away, or stopped drawing us, e.g. the window is hidden */
+    if (now - framesync->ended < FRAMESYNC_TIMEOUT) {
+      return 0;
+    }
+    framesync->waiting = 0;
+    framesync->paced = 0;
+    framesync->timeouts++;
+    return 1;
+  }
+
+  return now >= framesync->next;
+}
+
+static inline uint64_t
+frameSyncWake(const framesync_t *framesync,
+              uint64_t wake) {
+  /* The earlier of wake and when the loop should look again */
+  if (!frameSyncPaced(framesync)) {
+    return wake;
+  }
+
+  uint64_t at = framesync->next;
+
+  if (framesync->waiting) {
+    /* Keep reading events, that's where _NET_WM_FRAME_DRAWN comes from */
+    uint64_t poll = getTimeNs() + FRAMESYNC_POLL;
+    uint64_t timeout = framesync->ended + FRAMESYNC_TIMEOUT;
+
+    at = poll < timeout ? poll : timeout;
+  }
+  return at < wake ? at : wake;
+}
+
+static inline void
+frameSyncSleep(const framesync_t *framesync) {
+  /* Call when frameSyncReady said no */
+  uint64_t wake = frameSyncWake(framesync, getTimeNs() + FRAMESYNC_POLL);
+  struct timespec t;
+
+  t.tv_sec = (time_t)(wake / 1000000000ull);
+  t.tv_nsec = (long)(wake % 1000000000ull);
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+}
+
+#endif
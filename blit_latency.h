@@ -0,0 +1,327 @@
+#ifndef BLIT_LATENCY_H
+#define BLIT_LATENCY_H
+
+/*
+ * Input to present latency
+ * Key presses are stamped with the server's timestamp and when the loop read them, the next
+ * frame drawn after that is the first one that can show them, so they get tagged with it
+ * When that frame has been handed to the server a round trip makes sure it was processed,
+ * and that's the present time the latency is measured to
+ * The round trip only happens on frames that have input tagged, the rest don't pay for it
+ *
+ * BLIT_LATENCY=1 turns the probe on for real input
+ * BLIT_LATENCY_TEST=N injects N key presses through XTEST (on Xvfb, see latency.sh) and exits
+ * with the distribution, those are also timed from the moment they were injected
+ * BLIT_LATENCY_KEY picks the keycode, 65 (space) by default, 24 would quit
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xcb/xcb.h>
+#include <xcb/xtest.h>
+
+#include "blit_mem.h"
+#include "blit_stats.h"
+
+#define LATENCY_PENDING 64 /* inputs waiting for their frame to be presented */
+#define LATENCY_SAMPLES 4096 /* kept for the percentiles, oldest are overwritten */
+#define LATENCY_INTERVAL 50000000ull /* ns between injected keys, plus up to a frame of jitter */
+
+typedef struct {
+  uint64_t injected; /* when the self-test sent it, 0 for real input */
+  uint64_t arrived; /* when the loop read it */
+  uint32_t server_time; /* ms, from the event */
+  uint64_t frame; /* first frame that reflects it, 0 until one is drawn */
+} latency_input_t;
+
+typedef struct {
+  xcb_connection_t *display;
+  xcb_window_t window;
+
+  latency_input_t pending[LATENCY_PENDING];
+  int head;
+  int count;
+  uint64_t frame;
+  uint64_t overflow; /* inputs dropped because too many were pending */
+
+  /* Smallest (arrival - server timestamp) seen, the rest are measured against it */
+  /* The two clocks aren't related, but the difference shows how long events sat queued */
+  int64_t offset;
+  int have_offset;
+
+  stat_t queued; /* server timestamp to arrival, relative to the best case */
+  stat_t to_frame; /* arrival to the frame that reflects it starting */
+  stat_t to_present; /* arrival to present */
+  stat_t end_to_end; /* injection to present, self-test only */
+
+  uint64_t *samples; /* the numbers the percentiles come from */
+  uint64_t sample_count;
+
+  /* Self-test */
+  int test;
+  int sent;
+  int done;
+  xcb_keycode_t keycode;
+  uint64_t next_inject;
+  uint64_t sent_at[LATENCY_PENDING]; /* injection times not matched to an event yet */
+  int sent_head;
+  int sent_count;
+} latency_t;
+
+static inline latency_t*
+allocLatency(xcb_connection_t *display,
+             xcb_window_t window) {
+  int probe = getenv("BLIT_LATENCY") != NULL && strcmp(getenv("BLIT_LATENCY"), "1") == 0;
+  int test = getenv("BLIT_LATENCY_TEST") != NULL ? atoi(getenv("BLIT_LATENCY_TEST")) : 0;
+
+  if (!probe && test <= 0) {
+    return NULL;
+  }
+
+  latency_t *latency = memCalloc(1, sizeof(latency_t));
+
+  latency->display = display;
+  latency->window = window;
+  latency->queued = newStat("input queued");
+  latency->to_frame = newStat("input to frame");
+  latency->to_present = newStat("input to present");
+  latency->end_to_end = newStat("injected to present");
+  latency->samples = memCalloc(LATENCY_SAMPLES, sizeof(uint64_t));
+  latency->keycode = getenv("BLIT_LATENCY_KEY") != NULL ? (xcb_keycode_t)atoi(getenv("BLIT_LATENCY_KEY")) : 65;
+
+  if (test > 0) {
+    xcb_test_get_version_reply_t *version =
+      memReply(xcb_test_get_version_reply(display, xcb_test_get_version(display, 2, 2), NULL));
+
+    if (version == NULL) {
+      fprintf(stderr, "No XTEST on this display, can't inject keys\n");
+    }
+    else {
+      latency->test = test;
+      printf("Latency self-test, injecting %d presses of keycode %u\n", test, latency->keycode);
+
+      /* Without a window manager keys go to whatever has the focus */
+      xcb_set_input_focus(display, XCB_INPUT_FOCUS_POINTER_ROOT, window, XCB_CURRENT_TIME);
+      xcb_flush(display);
+    }
+    memFreeReply(version);
+  }
+
+  return latency;
+}
+
+static inline void
+latencyReport(const latency_t *latency) {
+  uint64_t n = latency->sample_count < LATENCY_SAMPLES ? latency->sample_count : LATENCY_SAMPLES;
+
+  statPrint(&latency->queued, 1e6, "ms");
+  statPrint(&latency->to_frame, 1e6, "ms");
+  statPrint(&latency->to_present, 1e6, "ms");
+
+  if (latency->test > 0) {
+    statPrint(&latency->end_to_end, 1e6, "ms");
+  }
+
+  if (n == 0) {
+    return;
+  }
+
+  /* Insertion sort of a copy, this runs once at the end */
+  uint64_t *sorted = memAlloc(n * sizeof(uint64_t));
+  memcpy(sorted, latency->samples, n * sizeof(uint64_t));
+
+  for (uint64_t i = 1; i < n; i++) {
+    uint64_t value = sorted[i];
+    uint64_t j = i;
+
+    for (; j > 0 && sorted[j - 1] > value; j--) {
+      sorted[j] = sorted[j - 1];
+    }
+    sorted[j] = value;
+  }
+
+  printf("latency: p50 = %.2fms, p90 = %.2fms, p99 = %.2fms, max = %.2fms (n = %llu, %llu dropped)\n",
+         sorted[n / 2] / 1e6,
+         sorted[n * 9 / 10] / 1e6,
+         sorted[n * 99 / 100] / 1e6,
+         sorted[n - 1] / 1e6,
+         (unsigned long long)n,
+         (unsigned long long)latency->overflow);
+
+  /* Rough shape of the distribution, 2ms buckets */
+  uint64_t buckets[16];
+  memset(buckets, 0, sizeof(buckets));
+
+  for (uint64_t i = 0; i < n; i++) {
+    uint64_t bucket = sorted[i] / 2000000;
+    buckets[bucket < 15 ? bucket : 15]++;
+  }
+
+  for (int i = 0; i < 16; i++) {
+    if (buckets[i] == 0) {
+      continue;
+    }
+    printf("  %s%2d ms: %5llu ",
+           i < 15 ? " <" : ">=",
+           i < 15 ? (i + 1) * 2 : 30,
+           (unsigned long long)buckets[i]);
+
+    for (uint64_t j = 0; j < buckets[i] * 60 / n; j++) {
+      putchar('#');
+    }
+    putchar('\n');
+  }
+
+  memFree(sorted);
+}
+
+static inline void
+freeLatency(latency_t *latency) {
+  if (latency == NULL) {
+    return;
+  }
+  latencyReport(latency);
+  memFree(latency->samples);
+  memFree(latency);
+}
+
+static inline void
+latencyInput(latency_t *latency,
+             const xcb_key_press_event_t *key) {
+  /* Call for every key press as it's read */
+  if (latency == NULL) {
+    return;
+  }
+
+  if (latency->count == LATENCY_PENDING) {
+    latency->overflow++;
+    return;
+  }
+
+  latency_input_t *input = &latency->pending[(latency->head + latency->count++) % LATENCY_PENDING];
+
+  input->arrived = getTimeNs();
+  input->server_time = key->time;
+  input->frame = 0;
+  input->injected = 0;
+
+  /* XTEST events come back in the order they were sent */
+  if (latency->sent_count > 0 && key->detail == latency->keycode) {
+    input->injected = latency->sent_at[latency->sent_head];
+    latency->sent_head = (latency->sent_head + 1) % LATENCY_PENDING;
+    latency->sent_count--;
+  }
+
+  int64_t delta = (int64_t)(input->arrived / 1000000) - (int64_t)input->server_time;
+
+  if (!latency->have_offset || delta < latency->offset) {
+    latency->offset = delta;
+    latency->have_offset = 1;
+  }
+  statAdd(&latency->queued, (uint64_t)(delta - latency->offset) * 1000000);
+}
+
+static inline void
+latencyFrame(latency_t *latency) {
+  /* Call when a frame starts rendering, it's the first to reflect anything read before it */
+  if (latency == NULL) {
+    return;
+  }
+
+  uint64_t now = getTimeNs();
+
+  latency->frame++;
+
+  for (int i = 0; i < latency->count; i++) {
+    latency_input_t *input = &latency->pending[(latency->head + i) % LATENCY_PENDING];
+
+    if (input->frame == 0) {
+      input->frame = latency->frame;
+      statAdd(&latency->to_frame, now - input->arrived);
+    }
+  }
+}
+
+static inline int
+latencyWaiting(const latency_t *latency) {
+  /* 1 if the frame being presented has input tagged, i.e. latencyPresent will measure */
+  return latency != NULL && latency->count > 0 && latency->pending[latency->head].frame != 0;
+}
+
+static inline void
+latencyPresent(latency_t *latency) {
+  /* Call after the frame has been sent to the server and flushed */
+  if (!latencyWaiting(latency)) {
+    return;
+  }
+
+  /* Any reply means everything sent before it was processed, so the frame is on screen */
+  memFreeReply(memReply(xcb_get_input_focus_reply(latency->display,
+                                                  xcb_get_input_focus(latency->display),
+                                                  NULL)));
+
+  uint64_t now = getTimeNs();
+
+  while (latency->count > 0 && latency->pending[latency->head].frame != 0) {
+    latency_input_t *input = &latency->pending[latency->head];
+    uint64_t total = input->injected ? now - input->injected : now - input->arrived;
+
+    statAdd(&latency->to_present, now - input->arrived);
+
+    if (input->injected) {
+      statAdd(&latency->end_to_end, total);
+      latency->done++;
+    }
+
+    /* Self-test runs only keep the injected ones, they're timed from the real start */
+    if (latency->test == 0 || input->injected) {
+      latency->samples[latency->sample_count++ % LATENCY_SAMPLES] = total;
+    }
+
+    latency->head = (latency->head + 1) % LATENCY_PENDING;
+    latency->count--;
+  }
+}
+
+static inline int
+latencyTest(latency_t *latency) {
+  /* Call once per frame, injects the next key when it's due */
+  /* Returns 1 once every injected key has been presented */
+  if (latency == NULL || latency->test == 0) {
+    return 0;
+  }
+
+  if (latency->done >= latency->test) {
+    return 1;
+  }
+
+  uint64_t now = getTimeNs();
+
+  /* Keys that never show up (focus went elsewhere) shouldn't hang the run */
+  if (latency->sent == latency->test && now > latency->next_inject + 2000000000ull) {
+    fprintf(stderr, "latency: %d of %d injected keys never arrived\n",
+            latency->test - latency->done,
+            latency->test);
+    return 1;
+  }
+
+  if (latency->sent < latency->test &&
+      latency->sent_count < LATENCY_PENDING &&
+      now >= latency->next_inject) {
+    xcb_test_fake_input(latency->display, XCB_KEY_PRESS, latency->keycode, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+    xcb_test_fake_input(latency->display, XCB_KEY_RELEASE, latency->keycode, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+    xcb_flush(latency->display);
+
+    latency->sent_at[(latency->sent_head + latency->sent_count++) % LATENCY_PENDING] = getTimeNs();
+    latency->sent++;
+
+    /* Jitter, so presses don't always land at the same point in the frame */
+    latency->next_inject = now + LATENCY_INTERVAL + (uint64_t)(rand() % 17) * 1000000;
+  }
+
+  return 0;
+}
+
+#endif
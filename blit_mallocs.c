@@ -0,0 +1,190 @@
+/*
+ * Counts every heap allocation in a process, for soak runs
+ * Build: $CC -shared -fPIC -O2 -o blit_mallocs.so blit_mallocs.c -ldl
+ * Usage: LD_PRELOAD=./blit_mallocs.so ./program, soak.sh does both
+ * Every allocation function forwards to the next one in line (libc's) and bumps one counter,
+ * blit_mem.h looks for blitMallocs at runtime and reports mallocs/frame when it's there
+ * That covers xcb's replies and events, cairo and the GL driver too, not just our own code
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static atomic_ullong mallocs;
+
+static void *(*next_malloc)(size_t);
+static void *(*next_calloc)(size_t, size_t);
+static void *(*next_realloc)(void *, size_t);
+static void *(*next_reallocarray)(void *, size_t, size_t);
+static int (*next_posix_memalign)(void **, size_t, size_t);
+static void *(*next_aligned_alloc)(size_t, size_t);
+static void *(*next_memalign)(size_t, size_t);
+static void *(*next_valloc)(size_t);
+static void *(*next_pvalloc)(size_t);
+static void (*next_free)(void *);
+
+/* dlsym may allocate while we're still looking everything up, that comes from here */
+static uint8_t bootstrap[16384] __attribute__((aligned(64)));
+static size_t bootstrap_used;
+static int resolving;
+
+static void*
+bootstrapAlloc(size_t size) {
+  size = (size + 63) & ~(size_t)63;
+
+  if (bootstrap_used + size > sizeof(bootstrap)) {
+    return NULL;
+  }
+
+  void *p = bootstrap + bootstrap_used;
+
+  bootstrap_used += size;
+  return p;
+}
+
+static int
+isBootstrap(const void *p) {
+  return (const uint8_t *)p >= bootstrap && (const uint8_t *)p < bootstrap + sizeof(bootstrap);
+}
+
+/* Through a void *, ISO C has no cast from dlsym's object pointer to a function pointer */
+#define NEXT(fn) (*(void **)&next_##fn = dlsym(RTLD_NEXT, #fn))
+
+static void
+resolve(void) {
+  if (next_malloc != NULL) {
+    return;
+  }
+  resolving = 1;
+
+  NEXT(calloc);
+  NEXT(realloc);
+  NEXT(reallocarray);
+  NEXT(posix_memalign);
+  NEXT(aligned_alloc);
+  NEXT(memalign);
+  NEXT(valloc);
+  NEXT(pvalloc);
+  NEXT(free);
+
+  /* Last, it's what says the rest are there */
+  NEXT(malloc);
+
+  resolving = 0;
+}
+
+static inline void
+count(void) {
+  atomic_fetch_add_explicit(&mallocs, 1, memory_order_relaxed);
+}
+
+uint64_t
+blitMallocs(void) {
+  return atomic_load_explicit(&mallocs, memory_order_relaxed);
+}
+
+void*
+malloc(size_t size) {
+  count();
+
+  if (resolving) {
+    return bootstrapAlloc(size);
+  }
+  resolve();
+  return next_malloc(size);
+}
+
+void*
+calloc(size_t n,
+       size_t size) {
+  count();
+
+  /* bootstrap starts out zeroed and is never reused */
+  if (resolving) {
+    return size != 0 && n > SIZE_MAX / size ? NULL : bootstrapAlloc(n * size);
+  }
+  resolve();
+  return next_calloc(n, size);
+}
+
+void*
+realloc(void *p,
+        size_t size) {
+  count();
+  resolve();
+
+  /* Moved out of bootstrap, how much of it was the old block isn't known, so copy what's left */
+  if (p != NULL && isBootstrap(p)) {
+    void *moved = next_malloc(size);
+    size_t left = (size_t)(bootstrap + sizeof(bootstrap) - (uint8_t *)p);
+
+    if (moved != NULL) {
+      memcpy(moved, p, size < left ? size : left);
+    }
+    return moved;
+  }
+  return next_realloc(p, size);
+}
+
+void*
+reallocarray(void *p,
+             size_t n,
+             size_t size) {
+  count();
+  resolve();
+  return next_reallocarray(p, n, size);
+}
+
+int
+posix_memalign(void **p,
+               size_t alignment,
+               size_t size) {
+  count();
+  resolve();
+  return next_posix_memalign(p, alignment, size);
+}
+
+void*
+aligned_alloc(size_t alignment,
+              size_t size) {
+  count();
+  resolve();
+  return next_aligned_alloc(alignment, size);
+}
+
+void*
+memalign(size_t alignment,
+         size_t size) {
+  count();
+  resolve();
+  return next_memalign(alignment, size);
+}
+
+void*
+valloc(size_t size) {
+  count();
+  resolve();
+  return next_valloc(size);
+}
+
+void*
+pvalloc(size_t size) {
+  count();
+  resolve();
+  return next_pvalloc(size);
+}
+
+void
+free(void *p) {
+  if (p == NULL || isBootstrap(p)) {
+    return;
+  }
+  resolve();
+  next_free(p);
+}
@@ -0,0 +1,343 @@
+#ifndef BLIT_MEM_H
+#define BLIT_MEM_H
+
+/*
+ * Allocation accounting, to catch per frame leaks
+ * memAlloc/memCalloc/memRealloc/memFree count every allocation made through them, all of our own
+ * buffers go through these, and memReply/memFreeReply do the same for the replies and events
+ * xcb hands back, which it mallocs for us
+ * memFrame reports live bytes, allocations per frame and RSS every 100 frames
+ * Run under LD_PRELOAD=./blit_mallocs.so and every allocation in the process is counted too,
+ * xcb's, cairo's and the GL driver's included, reported as mallocs/frame
+ * With BLIT_SOAK=N the loop stops after N frames and fails if anything grew after warm-up,
+ * or if our own code still allocated per frame after it (memAlloc, buffers growing through
+ * memRealloc and arena spills included)
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <xcb/xcb.h>
+
+#include "blit_stats.h"
+
+/* Room for the size in front of every block, keeps malloc's alignment */
+#define MEM_HEADER 16
+
+typedef struct {
+  uint64_t allocs; /* totals since start */
+  uint64_t frees;
+  int64_t live_allocs;
+  int64_t live_bytes;
+  int64_t peak_bytes;
+
+  uint64_t replies;
+  int64_t live_replies;
+  int64_t reply_bytes;
+} mem_counters_t;
+
+/* Every program is a single translation unit, so this is the one set of counters */
+static mem_counters_t mem_counters;
+
+/* From blit_mallocs.so when it's preloaded, NULL otherwise */
+extern uint64_t blitMallocs(void) __attribute__((weak));
+
+static inline uint64_t
+memMallocs(void) {
+  return blitMallocs != NULL ? blitMallocs() : 0;
+}
+
+typedef struct {
+  uint64_t frames;
+  uint64_t last_allocs;
+  uint64_t last_replies;
+  uint64_t last_mallocs;
+  stat_t allocs; /* per frame */
+  stat_t replies;
+  stat_t mallocs;
+
+  /* Soak test, soak = 0 means run forever */
+  uint64_t soak;
+  uint64_t warmup;
+  int64_t base_bytes;
+  int64_t base_allocs;
+  int64_t base_replies;
+  uint64_t base_total_allocs;
+  uint64_t base_mallocs;
+  long base_rss;
+  long slack; /* how much RSS may move after warm-up, in bytes */
+} mem_stats_t;
+
+static inline void
+memCount(size_t size) {
+  mem_counters.allocs++;
+  mem_counters.live_allocs++;
+  mem_counters.live_bytes += (int64_t)size;
+
+  if (mem_counters.live_bytes > mem_counters.peak_bytes) {
+    mem_counters.peak_bytes = mem_counters.live_bytes;
+  }
+}
+
+static inline void*
+memAlloc(size_t size) {
+  if (size > SIZE_MAX - MEM_HEADER) {
+    return NULL;
+  }
+
+  uint8_t *block = malloc(size + MEM_HEADER);
+
+  if (block == NULL) {
+    return NULL;
+  }
+  *(size_t *)block = size;
+  memCount(size);
+
+  return block + MEM_HEADER;
+}
+
+static inline void*
+memCalloc(size_t n,
+          size_t size) {
+  /* n * size + MEM_HEADER wrapping around would hand back a short block */
+  if (size != 0 && n > (SIZE_MAX - MEM_HEADER) / size) {
+    return NULL;
+  }
+
+  uint8_t *block = calloc(1, n * size + MEM_HEADER);
+
+  if (block == NULL) {
+    return NULL;
+  }
+  *(size_t *)block = n * size;
+  memCount(n * size);
+
+  return block + MEM_HEADER;
+}
+
+static inline void*
+memRealloc(void *p,
+           size_t size) {
+  /* Counts as an allocation, it may well have been one, so a buffer growing every frame shows */
+  if (p == NULL) {
+    return memAlloc(size);
+  }
+  if (size > SIZE_MAX - MEM_HEADER) {
+    return NULL;
+  }
+
+  uint8_t *block = (uint8_t *)p - MEM_HEADER;
+  size_t old = *(size_t *)block;
+
+  block = realloc(block, size + MEM_HEADER);
+
+  if (block == NULL) {
+    return NULL;
+  }
+  *(size_t *)block = size;
+
+  mem_counters.allocs++;
+  mem_counters.live_bytes += (int64_t)size - (int64_t)old;
+
+  if (mem_counters.live_bytes > mem_counters.peak_bytes) {
+    mem_counters.peak_bytes = mem_counters.live_bytes;
+  }
+
+  return block + MEM_HEADER;
+}
+
+static inline void
+memFree(void *p) {
+  if (p == NULL) {
+    return;
+  }
+
+  uint8_t *block = (uint8_t *)p - MEM_HEADER;
+
+  mem_counters.frees++;
+  mem_counters.live_allocs--;
+  mem_counters.live_bytes -= (int64_t)*(size_t *)block;
+  free(block);
+}
+
+static inline size_t
+memReplySize(const void *reply) {
+  /* Replies are 32 bytes plus length words, events are always 32 */
+  const xcb_generic_reply_t *generic = reply;
+
+  if (generic->response_type == 1) {
+    return 32 + (size_t)generic->length * 4;
+  }
+  return 32;
+}
+
+static inline void*
+memReply(void *reply) {
+  /* Takes ownership of a reply or event from xcb, pass it straight through */
+  if (reply == NULL) {
+    return NULL;
+  }
+
+  mem_counters.replies++;
+  mem_counters.live_replies++;
+  mem_counters.reply_bytes += (int64_t)memReplySize(reply);
+
+  return reply;
+}
+
+static inline void
+memFreeReply(void *reply) {
+  if (reply == NULL) {
+    return;
+  }
+
+  mem_counters.live_replies--;
+  mem_counters.reply_bytes -= (int64_t)memReplySize(reply);
+  free(reply);
+}
+
+static inline long
+memRss(void) {
+  /* Resident set size in bytes, 0 if /proc isn't there */
+  long pages = 0;
+  long resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+
+  if (statm == NULL) {
+    return 0;
+  }
+  if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(statm);
+
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+static inline mem_stats_t
+memStats(void) {
+  mem_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+
+  stats.allocs = newStat("allocs/frame");
+  stats.replies = newStat("replies/frame");
+  stats.mallocs = newStat("mallocs/frame");
+
+  if (getenv("BLIT_SOAK") != NULL) {
+    stats.soak = strtoull(getenv("BLIT_SOAK"), NULL, 10);
+    stats.warmup = stats.soak / 10 > 100 ? stats.soak / 10 : 100;
+
+    /* Short soaks still need a baseline before the end, at worst the first frame */
+    if (stats.warmup > stats.soak / 2) {
+      stats.warmup = stats.soak / 2 > 0 ? stats.soak / 2 : 1;
+    }
+    stats.slack = 512 * 1024;
+
+    if (getenv("BLIT_SOAK_SLACK") != NULL) {
+      stats.slack = atol(getenv("BLIT_SOAK_SLACK")) * 1024;
+    }
+    printf("Soaking for %llu frames, %llu of warm-up\n",
+           (unsigned long long)stats.soak,
+           (unsigned long long)stats.warmup);
+  }
+
+  return stats;
+}
+
+static inline int
+memFrame(mem_stats_t *stats) {
+  /* Call once per frame, returns 1 when a soak run is over */
+  uint64_t mallocs = memMallocs();
+
+  statAdd(&stats->allocs, mem_counters.allocs - stats->last_allocs);
+  statAdd(&stats->replies, mem_counters.replies - stats->last_replies);
+  statAdd(&stats->mallocs, mallocs - stats->last_mallocs);
+  stats->last_allocs = mem_counters.allocs;
+  stats->last_replies = mem_counters.replies;
+  stats->last_mallocs = mallocs;
+
+  stats->frames++;
+
+  if (stats->soak > 0 && stats->frames == stats->warmup) {
+    stats->base_bytes = mem_counters.live_bytes;
+    stats->base_allocs = mem_counters.live_allocs;
+    stats->base_replies = mem_counters.live_replies;
+    stats->base_total_allocs = mem_counters.allocs;
+    stats->base_mallocs = mallocs;
+    stats->base_rss = memRss();
+  }
+
+  if (stats->frames % 100 == 0) {
+    printf("memory: %lld bytes in %lld live allocations (peak %lld), %lld live replies, rss = %ld KiB\n",
+           (long long)mem_counters.live_bytes,
+           (long long)mem_counters.live_allocs,
+           (long long)mem_counters.peak_bytes,
+           (long long)mem_counters.live_replies,
+           memRss() / 1024);
+    statPrint(&stats->allocs, 1, "");
+    statPrint(&stats->replies, 1, "");
+    if (blitMallocs != NULL) {
+      statPrint(&stats->mallocs, 1, "");
+    }
+    statReset(&stats->allocs);
+    statReset(&stats->replies);
+    statReset(&stats->mallocs);
+  }
+
+  return stats->soak > 0 && stats->frames >= stats->soak;
+}
+
+static inline int
+memSoakResult(const mem_stats_t *stats) {
+  /* Exit status for a soak run, 0 if nothing grew after warm-up */
+  if (stats->soak == 0) {
+    return 0;
+  }
+
+  int64_t bytes = mem_counters.live_bytes - stats->base_bytes;
+  int64_t allocs = mem_counters.live_allocs - stats->base_allocs;
+  int64_t replies = mem_counters.live_replies - stats->base_replies;
+  long rss = memRss() - stats->base_rss;
+  uint64_t mallocs = memMallocs() - stats->base_mallocs;
+  uint64_t own = mem_counters.allocs - stats->base_total_allocs;
+
+  printf("soak: %llu frames, after warm-up %+lld bytes, %+lld allocations, %+lld replies, rss %+ld KiB\n",
+         (unsigned long long)stats->frames,
+         (long long)bytes,
+         (long long)allocs,
+         (long long)replies,
+         rss / 1024);
+
+  printf("soak: %llu allocations from our code after warm-up\n", (unsigned long long)own);
+
+  /* Not a failure, the libraries underneath may allocate however they like */
+  if (blitMallocs != NULL) {
+    printf("soak: %llu mallocs in the process after warm-up, %.2f per frame\n",
+           (unsigned long long)mallocs,
+           stats->frames > stats->warmup ? (double)mallocs / (double)(stats->frames - stats->warmup) : 0.0);
+  }
+
+  if (stats->frames < stats->soak) {
+    fprintf(stderr, "soak: stopped early\n");
+    return 1;
+  }
+
+  if (bytes > 0 || allocs > 0 || replies > 0 || rss > stats->slack) {
+    fprintf(stderr, "soak: memory grew after warm-up\n");
+    return 1;
+  }
+
+  /* Per frame data belongs in the arena or in buffers kept between frames */
+  if (own > 0) {
+    fprintf(stderr, "soak: our code still allocates per frame after warm-up\n");
+    return 1;
+  }
+
+  printf("soak: ok\n");
+  return 0;
+}
+
+#endif
@@ -10,11 +10,23 @@
 #include <unistd.h>
 #include <xcb/xcb.h>
 
+#include "blit_cmd.h"
+#include "blit_diff.h"
+#include "blit_events.h"
+#include "blit_framesync.h"
+#include "blit_latency.h"
+#include "blit_mem.h"
+#include "blit_queue.h"
+#include "blit_randr.h"
+#include "blit_sched.h"
+
 xcb_window_t
 getWindow(xcb_connection_t*,
           xcb_colormap_t,
           int,
           xcb_screen_t*,
+          int16_t,
+          int16_t,
           uint16_t,
           uint16_t);
 
@@ -67,13 +79,482 @@ void draw(uint16_t height,
    glFlush();  // Render now
 }
 
-static struct timespec
-genSleep(time_t sec,
-         long nanosec) {
-  struct timespec t;
-  t.tv_sec = sec;
-  t.tv_nsec = nanosec;
-  return t;
+/* Command buffers replayed with GL, BLIT_COMMANDS=1 turns it on */
+/* The back buffer is undefined after a swap, so every frame is replayed even if it didn't change */
+typedef struct {
+  cmd_buffer_t buf;
+  surface_t atlases[CMD_ATLASES];
+  GLuint textures[CMD_ATLASES];
+  int sprites;
+  int v;
+} gl_commands_t;
+
+gl_commands_t*
+allocCommandsGL(void) {
+  if (getenv("BLIT_COMMANDS") == NULL || atoi(getenv("BLIT_COMMANDS")) == 0) {
+    return NULL;
+  }
+
+  gl_commands_t *commands = memCalloc(1, sizeof(gl_commands_t));
+
+  commands->sprites = getenv("BLIT_SPRITES") != NULL ? atoi(getenv("BLIT_SPRITES")) : 2000;
+  commands->atlases[0] = genAtlas(32);
+
+  /* Uploaded once, BGRA bytes are what a little endian ARGB uint32_t looks like */
+  glGenTextures(1, commands->textures);
+  glBindTexture(GL_TEXTURE_2D, commands->textures[0]);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D,
+               0,
+               GL_RGBA,
+               commands->atlases[0].width,
+               commands->atlases[0].height,
+               0,
+               GL_BGRA,
+               GL_UNSIGNED_BYTE,
+               commands->atlases[0].pixels);
+
+  return commands;
+}
+
+void
+freeCommandsGL(gl_commands_t *commands) {
+  if (commands == NULL) {
+    return;
+  }
+  glDeleteTextures(1, commands->textures);
+  cmdFree(&commands->buf);
+  memFree(commands->atlases[0].pixels);
+  memFree(commands);
+}
+
+static void
+colorGL(uint32_t color) {
+  glColor4ub((GLubyte)(color >> 16), (GLubyte)(color >> 8), (GLubyte)color, (GLubyte)(color >> 24));
+}
+
+void
+execCommandsGL(const cmd_buffer_t *buf,
+               const gl_commands_t *commands) {
+  /* Recorded coordinates map onto the whole viewport, so a smaller viewport scales them */
+  /* Consecutive blits from the same atlas with the same flags share one glBegin */
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+
+  glMatrixMode(GL_PROJECTION);
+  glPushMatrix();
+  glLoadIdentity();
+  glOrtho(0, buf->width, buf->height, 0, -1, 1);
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+
+  /* Everything is premultiplied */
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+
+  int quads = 0; /* inside glBegin(GL_QUADS) for blits */
+  int quad_atlas = -1;
+  int quad_flags = -1;
+  int quad_opacity = -1;
+
+  size_t offset = 0;
+  const cmd_t *cmd;
+
+  while (cmdNext(buf, &offset, &cmd)) {
+    if (quads && cmd->op != CMD_BLIT) {
+      glEnd();
+      glDisable(GL_TEXTURE_2D);
+      glEnable(GL_BLEND);
+      quads = 0;
+    }
+
+    switch (cmd->op) {
+      case CMD_FILL: {
+        const cmd_fill_t *c = (const cmd_fill_t *)cmd;
+
+        colorGL(c->color);
+        glRecti(c->x, c->y, c->x + c->width, c->y + c->height);
+        break;
+      }
+
+      case CMD_GRADIENT: {
+        const cmd_gradient_t *c = (const cmd_gradient_t *)cmd;
+
+        glBegin(GL_QUADS);
+          colorGL(c->from);
+          glVertex2i(c->x, c->y);
+          colorGL(c->vertical ? c->from : c->to);
+          glVertex2i(c->x + c->width, c->y);
+          colorGL(c->to);
+          glVertex2i(c->x + c->width, c->y + c->height);
+          colorGL(c->vertical ? c->to : c->from);
+          glVertex2i(c->x, c->y + c->height);
+        glEnd();
+        break;
+      }
+
+      case CMD_CLIP: {
+        const cmd_clip_t *c = (const cmd_clip_t *)cmd;
+
+        if (c->width == 0 || c->height == 0) {
+          glDisable(GL_SCISSOR_TEST);
+          break;
+        }
+
+        /* Scissor is in window pixels with y going up */
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(viewport[0] + c->x * viewport[2] / buf->width,
+                  viewport[1] + (buf->height - c->y - c->height) * viewport[3] / buf->height,
+                  c->width * viewport[2] / buf->width,
+                  c->height * viewport[3] / buf->height);
+        break;
+      }
+
+      case CMD_BLIT: {
+        const cmd_blit_t *c = (const cmd_blit_t *)cmd;
+
+        if (c->atlas >= CMD_ATLASES || commands->textures[c->atlas] == 0) {
+          break;
+        }
+
+        /* Color keys aren't supported here, the rest of the state only changes between batches */
+        if (!quads || c->atlas != quad_atlas || c->flags != quad_flags || c->opacity != quad_opacity) {
+          if (quads) {
+            glEnd();
+          }
+
+          glEnable(GL_TEXTURE_2D);
+          glBindTexture(GL_TEXTURE_2D, commands->textures[c->atlas]);
+
+          if (c->flags & BLIT_ALPHA) {
+            glEnable(GL_BLEND);
+          }
+          else {
+            glDisable(GL_BLEND);
+          }
+
+          glColor4ub(c->opacity, c->opacity, c->opacity, c->opacity);
+          glBegin(GL_QUADS);
+
+          quads = 1;
+          quad_atlas = c->atlas;
+          quad_flags = c->flags;
+          quad_opacity = c->opacity;
+        }
+
+        const surface_t *atlas = &commands->atlases[c->atlas];
+        GLfloat s1 = (GLfloat)c->src_x / atlas->width;
+        GLfloat t1 = (GLfloat)c->src_y / atlas->height;
+        GLfloat s2 = (GLfloat)(c->src_x + c->width) / atlas->width;
+        GLfloat t2 = (GLfloat)(c->src_y + c->height) / atlas->height;
+
+        glTexCoord2f(s1, t1);
+        glVertex2i(c->dst_x, c->dst_y);
+        glTexCoord2f(s2, t1);
+        glVertex2i(c->dst_x + c->width, c->dst_y);
+        glTexCoord2f(s2, t2);
+        glVertex2i(c->dst_x + c->width, c->dst_y + c->height);
+        glTexCoord2f(s1, t2);
+        glVertex2i(c->dst_x, c->dst_y + c->height);
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+
+  if (quads) {
+    glEnd();
+    glDisable(GL_TEXTURE_2D);
+  }
+
+  glDisable(GL_SCISSOR_TEST);
+  glDisable(GL_BLEND);
+
+  glMatrixMode(GL_MODELVIEW);
+  glPopMatrix();
+  glMatrixMode(GL_PROJECTION);
+  glPopMatrix();
+  glMatrixMode(GL_MODELVIEW);
+
+  glFlush();
+}
+
+/* CPU rendered frames shown through a texture, BLIT_GL_STREAM=1 turns it on */
+/* The CPU marks the 64x64 tiles it writes to, and only those get uploaded before the next present */
+/* Dirty tiles in a row of tiles go up in one glTexSubImage2D, unless the gap between them is wide */
+typedef struct {
+  surface_t frame; /* what the CPU draws into, same layout as the texture */
+  surface_t background;
+  surface_t atlas;
+  GLuint texture;
+  dirty_map_t dirty;
+  int sprites;
+  int size;
+  int *last; /* where each sprite was drawn last frame, x then y */
+  int v;
+  uint64_t frames;
+  stat_t bytes;
+  stat_t calls;
+} gl_stream_t;
+
+#define STREAM_GAP 2 /* clean tiles between two dirty runs that still get uploaded as one */
+
+static void
+streamSizeGL(gl_stream_t *stream,
+             int width,
+             int height) {
+  /* Everything that follows the window's size, the texture included, all of it dirty */
+  memFree(stream->frame.pixels);
+  memFree(stream->background.pixels);
+  dirtyMapFree(&stream->dirty);
+
+  stream->frame = surface(memAlloc((size_t)width * height * 4), width, height, width * 4);
+  stream->background = surface(memAlloc((size_t)width * height * 4), width, height, width * 4);
+
+  /* A static picture for the sprites to move over */
+  for (int y = 0; y < height; y++) {
+    uint32_t *row = surfaceRow(&stream->background, y);
+
+    for (int x = 0; x < width; x++) {
+      row[x] = ((x / 48) ^ (y / 48)) & 1 ? 0xff303848 : 0xff586070;
+    }
+  }
+  memcpy(stream->frame.pixels, stream->background.pixels, (size_t)width * height * 4);
+
+  /* Where the sprites were is in the old frame, the new one has nothing to put back */
+  memset(stream->last, 0, (size_t)stream->sprites * 2 * sizeof(int));
+
+  dirtyMapAlloc(&stream->dirty, width, height);
+  dirtyMapFill(&stream->dirty);
+
+  glBindTexture(GL_TEXTURE_2D, stream->texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+}
+
+gl_stream_t*
+allocStreamGL(int width,
+              int height) {
+  if (getenv("BLIT_GL_STREAM") == NULL || atoi(getenv("BLIT_GL_STREAM")) == 0) {
+    return NULL;
+  }
+
+  gl_stream_t *stream = memCalloc(1, sizeof(gl_stream_t));
+
+  stream->size = 32;
+  stream->sprites = getenv("BLIT_SPRITES") != NULL ? atoi(getenv("BLIT_SPRITES")) : 50;
+  stream->last = memCalloc((size_t)stream->sprites * 2, sizeof(int));
+  stream->atlas = genAtlas(stream->size);
+  stream->bytes = newStat("texture bytes/frame");
+  stream->calls = newStat("glTexSubImage2D calls/frame");
+
+  glGenTextures(1, &stream->texture);
+  glBindTexture(GL_TEXTURE_2D, stream->texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  streamSizeGL(stream, width, height);
+
+  printf("Streaming a %dx%d texture in %dx%d tiles\n", width, height, DIFF_TILE, DIFF_TILE);
+
+  return stream;
+}
+
+void
+freeStreamGL(gl_stream_t *stream) {
+  if (stream == NULL) {
+    return;
+  }
+  glDeleteTextures(1, &stream->texture);
+  dirtyMapFree(&stream->dirty);
+  memFree(stream->frame.pixels);
+  memFree(stream->background.pixels);
+  memFree(stream->atlas.pixels);
+  memFree(stream->last);
+  memFree(stream);
+}
+
+static void
+renderStream(gl_stream_t *stream) {
+  /* Moves the sprites, everything it writes is marked dirty */
+  surface_t *frame = &stream->frame;
+  int size = stream->size;
+  int v = stream->v++;
+
+  /* Frames no bigger than a sprite just get them all in the corner, clipped */
+  unsigned span_x = frame->width > size ? (unsigned)(frame->width - size) : 1;
+  unsigned span_y = frame->height > size ? (unsigned)(frame->height - size) : 1;
+
+  /* Put the background back where every sprite was, before any are drawn again */
+  for (int i = 0; i < stream->sprites && stream->frames > 0; i++) {
+    int x = stream->last[i * 2];
+    int y = stream->last[i * 2 + 1];
+
+    blitRect(frame, blit(&stream->background, x, y, size, size, x, y));
+    dirtyMapSetRect(&stream->dirty, x, y, x + size, y + size);
+  }
+
+  for (int i = 0; i < stream->sprites; i++) {
+    int sprite = i % 64;
+    int x = (int)(((unsigned)i * 7919u + (unsigned)v * (1 + i % 3)) % span_x);
+    int y = (int)(((unsigned)i * 104729u + (unsigned)v * (1 + i % 2)) % span_y);
+
+    blit_t b = blit(&stream->atlas, (sprite % 8) * size, (sprite / 8) * size, size, size, x, y);
+    b.flags = BLIT_ALPHA;
+    blitRect(frame, b);
+    dirtyMapSetRect(&stream->dirty, x, y, x + size, y + size);
+
+    stream->last[i * 2] = x;
+    stream->last[i * 2 + 1] = y;
+  }
+}
+
+static void
+uploadStream(gl_stream_t *stream) {
+  /* One call per run of dirty tiles in a tile row, runs with small gaps between them merge */
+  surface_t *frame = &stream->frame;
+  dirty_map_t *dirty = &stream->dirty;
+  uint64_t bytes = 0;
+  uint64_t calls = 0;
+
+  glBindTexture(GL_TEXTURE_2D, stream->texture);
+
+  /* The source rectangle is picked out of the whole frame, no copying it out first */
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, frame->stride / 4);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+  for (int ty = 0; ty < dirty->rows && dirty->dirty > 0; ty++) {
+    int y = ty * DIFF_TILE;
+    int h = frame->height - y < DIFF_TILE ? frame->height - y : DIFF_TILE;
+    int tx = 0;
+
+    while (tx < dirty->cols) {
+      if (!dirtyMapTest(dirty, tx, ty)) {
+        tx++;
+        continue;
+      }
+
+      int first = tx;
+      int end = tx + dirtyRunLength(dirty, tx, ty);
+
+      /* Carry on over short gaps, another call costs more than a few clean tiles */
+      for (;;) {
+        int next = end;
+
+        while (next < dirty->cols && next - end <= STREAM_GAP && !dirtyMapTest(dirty, next, ty)) {
+          next++;
+        }
+        if (next >= dirty->cols || next - end > STREAM_GAP) {
+          break;
+        }
+        end = next + dirtyRunLength(dirty, next, ty);
+      }
+
+      int x = first * DIFF_TILE;
+      int w = (end * DIFF_TILE < frame->width ? end * DIFF_TILE : frame->width) - x;
+
+      glPixelStorei(GL_UNPACK_SKIP_PIXELS, x);
+      glPixelStorei(GL_UNPACK_SKIP_ROWS, y);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_BGRA, GL_UNSIGNED_BYTE, frame->pixels);
+
+      bytes += (uint64_t)w * h * 4;
+      calls++;
+      tx = end;
+    }
+  }
+
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+  glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+
+  dirtyMapClear(dirty);
+
+  statAdd(&stream->bytes, bytes);
+  statAdd(&stream->calls, calls);
+
+  if (++stream->frames % 100 == 0) {
+    statPrint(&stream->bytes, 1024, "KiB");
+    statPrint(&stream->calls, 1, "");
+    printf("stream: %.1f%% of the %llu KiB a full upload would be\n",
+           100.0 * statAvg(&stream->bytes) / ((double)frame->width * frame->height * 4),
+           (unsigned long long)frame->width * frame->height * 4 / 1024);
+    statReset(&stream->bytes);
+    statReset(&stream->calls);
+  }
+}
+
+static void
+drawStream(gl_stream_t *stream) {
+  renderStream(stream);
+  uploadStream(stream);
+
+  /* Row 0 of the frame is the top, texture t = 0 goes at the top of the viewport */
+  glEnable(GL_TEXTURE_2D);
+  glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+  glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 1.0f); glVertex2f(-1.0f, -1.0f);
+    glTexCoord2f(1.0f, 1.0f); glVertex2f( 1.0f, -1.0f);
+    glTexCoord2f(1.0f, 0.0f); glVertex2f( 1.0f,  1.0f);
+    glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f,  1.0f);
+  glEnd();
+  glDisable(GL_TEXTURE_2D);
+}
+
+void
+drawFrame(uint16_t height,
+          uint16_t width,
+          gl_commands_t *commands,
+          gl_stream_t *stream) {
+  if (stream != NULL) {
+    drawStream(stream);
+    return;
+  }
+
+  if (commands == NULL) {
+    draw(height, width);
+    return;
+  }
+
+  /* Note that height is the window width here, like in draw */
+  cmdRecordDemo(&commands->buf, 32, commands->sprites, commands->v++, height, width);
+  execCommandsGL(&commands->buf, commands);
+}
+
+void
+drawScaled(uint16_t height,
+           uint16_t width,
+           gl_commands_t *commands,
+           gl_stream_t *stream,
+           int scale) {
+  /* Below 100% render into the bottom left of the viewport and stretch it over the rest */
+  if (scale >= 100) {
+    drawFrame(height, width, commands, stream);
+    return;
+  }
+
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+
+  GLsizei w = viewport[2] * scale / 100;
+  GLsizei h = viewport[3] * scale / 100;
+
+  glViewport(viewport[0], viewport[1], w, h);
+  glClear(GL_COLOR_BUFFER_BIT);
+  drawFrame(height, width, commands, stream);
+
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+  glRasterPos2f(-1.0f, -1.0f);
+  glPixelZoom((GLfloat)viewport[2] / w, (GLfloat)viewport[3] / h);
+  glCopyPixels(viewport[0], viewport[1], w, h, GL_COLOR);
+  glPixelZoom(1.0f, 1.0f);
 }
 
 int
@@ -81,7 +562,11 @@ message_loop(Display *display,
              xcb_connection_t *xcb_display,
              xcb_window_t window,
              xcb_screen_t *screen,
-             GLXDrawable drawable) {
+             uint16_t window_width,
+             uint16_t window_height,
+             GLXDrawable drawable,
+             framesync_t *framesync,
+             randr_t *randr) {
 
     int running = 1;
 
@@ -90,58 +575,149 @@ message_loop(Display *display,
 
     GLint x_offset = 0;
 
-    /* Used to handle the event loop */
-    struct timespec req = genSleep(0, 20000000);
-    struct timespec rem = genSleep(0, 0);
-
-    xcb_expose_event_t *expose;
+    /* Paces frames and trades resolution for time when they run over budget */
+    sched_t sched = frameSched();
 
-    uint16_t window_height = screen->height_in_pixels;
-    uint16_t window_width = screen->width_in_pixels;
+    /* One frame per refresh of the monitor the window is on */
+    schedRefresh(&sched, randrRefresh(randr));
 
     int exposed = 0;
 
+    event_batch_t batch;
+    event_stats_t event_stats = eventStats();
+    mem_stats_t mem_stats = memStats();
+
+    /* NULL unless BLIT_COMMANDS=1 */
+    gl_commands_t *commands = allocCommandsGL();
+
+    /* NULL unless BLIT_GL_STREAM=1 */
+    gl_stream_t *stream = allocStreamGL(window_width, window_height);
+
+    /* NULL unless BLIT_LATENCY=1 or BLIT_LATENCY_TEST=N */
+    latency_t *latency = allocLatency(xcb_display, window);
+
+    /* Polled once per frame, or read on a thread of its own with BLIT_EVENT_THREAD=1 */
+    event_source_t *events = allocEventSource(xcb_display, window);
+
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f); // Set background color to black and opaque
     glClear(GL_COLOR_BUFFER_BIT);         // Clear the color buffer (background)
 
     while (running) {
-        /* Poll for events */
+        /* Drain everything that is queued, not just one event per frame */
+        batchBegin(&batch);
 
-        xcb_generic_event_t *event = xcb_poll_for_event(xcb_display);
+        xcb_generic_event_t *event;
 
-        if (event != NULL) {
+        while ((event = eventNext(events, &batch)) != NULL) {
           switch (RECEIVE_EVENT(event)) {
             case XCB_KEY_PRESS:
                 /* Quit on key press */
                 // running = 0;
+                latencyInput(latency, (xcb_key_press_event_t *)event);
                 break;
             case XCB_EXPOSE:
-                expose = (xcb_expose_event_t *)event;
-
-                window_height = expose->height;
-                window_width = expose->width;
-
-                printf("Got expose event\n");
-                exposed = 1;
+                batchExpose(&batch, (xcb_expose_event_t *)event);
+                break;
+            case XCB_CLIENT_MESSAGE:
+                frameSyncMessage(framesync, (xcb_client_message_event_t *)event);
+                break;
+            case XCB_CONFIGURE_NOTIFY:
+                batchConfigure(&batch, (xcb_configure_notify_event_t *)event);
                 break;
             default:
+                /* RandR's event codes are only known at runtime */
+                if (randrEvent(randr, event)) {
+                  schedRefresh(&sched, randrRefresh(randr));
+                }
                 break;
           }
+        }
+
+        /* The window may have moved to another monitor */
+        if (batch.configures > 0 && randrMoved(randr)) {
+          schedRefresh(&sched, randrRefresh(randr));
+        }
+
+        /* One resize for however many configure notifies came in, exposes only say to draw */
+        if (batch.configures > 0 &&
+            (batch.width != window_width || batch.height != window_height)) {
+          window_height = batch.height;
+          window_width = batch.width;
+
+          glViewport(0, 0, window_width, window_height);
+
+          if (stream != NULL) {
+            streamSizeGL(stream, window_width, window_height);
+          }
+
+          printf("Got %d configure_notify events, w = %u, h = %u\n",
+                 batch.configures,
+                 window_width,
+                 window_height);
+        }
+
+        if (batch.exposes > 0) {
+          printf("Got %d expose events\n", batch.exposes);
+          exposed = 1;
+        }
 
-          free(event);
+        /* With a compositor driving, wait for it to draw the last frame before starting one */
+        if (exposed && !frameSyncReady(framesync)) {
+          frameSyncSleep(framesync);
         }
+        else if (exposed) {
+          /* Nothing animates here yet, so dropped frames only show up in the stats */
+          schedBegin(&sched);
 
-        if (exposed) {
-          draw(window_width, window_height);
+          uint64_t start = getTimeNs();
+
+          frameSyncBegin(framesync);
+
+          latencyFrame(latency);
+
+          drawScaled(window_width, window_height, commands, stream, schedScale(&sched));
 
           /* This is where the magic happens */
           /* This call will NOT block.*/
           /* It will be sync'd with vertical refresh */
           glXSwapBuffers(display, drawable);
-          nanosleep(&req, &rem);
+
+          /* Xlib and xcb share the connection, so the counter lands after the swap */
+          if (framesync != NULL) {
+            frameSyncEnd(framesync, (uint64_t)sched.estimate);
+            xcb_flush(xcb_display);
+          }
+
+          /* Only the CPU side of the frame, the swap is queued */
+          schedEnd(&sched, getTimeNs() - start);
+
+          /* The swap is queued, wait for it before timing a frame that carries input */
+          if (latencyWaiting(latency)) {
+            glFinish();
+            latencyPresent(latency);
+          }
+
+          eventStatsFrame(&event_stats, &batch);
+
+          if (memFrame(&mem_stats) || latencyTest(latency)) {
+            running = 0;
+          }
+
+          if (frameSyncPaced(framesync)) {
+            schedFollow(&sched);
+          }
+          else {
+            schedWait(&sched);
+          }
         }
     }
-    return 0;
+
+    freeEventSource(events);
+    freeCommandsGL(commands);
+    freeStreamGL(stream);
+    freeLatency(latency);
+
+    return memSoakResult(&mem_stats);
 }
 
 int
@@ -151,8 +727,8 @@ setup_message_loop(Display* display,
                    xcb_screen_t *screen) {
 
     int visualID = 0;
-    uint16_t width = screen->width_in_pixels;
-    uint16_t height = screen->height_in_pixels;
+    /* Open on the primary monitor, at its size */
+    monitor_t monitor = randrDefaultMonitor(xcb_display, screen);
 
     /* Query framebuffer configurations that match visual_attribs */
     GLXFBConfig *fb_configs = 0;
@@ -186,8 +762,16 @@ setup_message_loop(Display* display,
                                     colormap,
                                     visualID,
                                     screen,
-                                    width,
-                                    height);
+                                    monitor.x,
+                                    monitor.y,
+                                    monitor.width,
+                                    monitor.height);
+
+    /* BLIT_FRAMESYNC=1 lets a compositor pace the frames, the counters have to be there before mapping */
+    framesync_t *framesync = allocFrameSync(xcb_display, window);
+
+    /* Which monitor the window is on and how fast it refreshes, NULL without RandR */
+    randr_t *randr = allocRandr(xcb_display, screen, window);
 
     /* NOTE: window must be mapped before glXMakeContextCurrent */
     xcb_map_window(xcb_display, window);
@@ -231,12 +815,19 @@ setup_message_loop(Display* display,
         return -1;
     }
 
-    /* run message loop */
+    /* run message loop, at the size the window was made at */
     int retval = message_loop(display,
                               xcb_display,
                               window,
                               screen,
-                              drawable);
+                              monitor.width,
+                              monitor.height,
+                              drawable,
+                              framesync,
+                              randr);
+
+    freeFrameSync(framesync);
+    freeRandr(randr);
 
     /* Cleanup */
     glXDestroyWindow(display, glxwindow);
@@ -299,12 +890,14 @@ getWindow(xcb_connection_t *xcb_display,
           xcb_colormap_t colormap,
           int visualID,
           xcb_screen_t *screen,
+          int16_t x,
+          int16_t y,
           uint16_t width,
           uint16_t height) {
     xcb_window_t window = xcb_generate_id(xcb_display);
 
-    /* Create window */
-    uint32_t eventmask = XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS;
+    /* Create window, structure notify tells us when it moves */
+    uint32_t eventmask = XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS | XCB_EVENT_MASK_STRUCTURE_NOTIFY;
     uint32_t valuelist[] = { eventmask, colormap, 0 };
     uint32_t valuemask = XCB_CW_EVENT_MASK | XCB_CW_COLORMAP;
 
@@ -313,7 +906,7 @@ getWindow(xcb_connection_t *xcb_display,
         XCB_COPY_FROM_PARENT,
         window,
         screen->root,
-        0, 0, /* x y */
+        x, y, /* x y */
         width, height, /* width height */
         0, /* border width */
         XCB_WINDOW_CLASS_INPUT_OUTPUT,
@@ -381,6 +974,11 @@ getScreen(xcb_connection_t *xcb_display,
 
 int
 main(void) {
+    /* Xlib has to be told before anything else if another thread will touch the connection */
+    if (eventThreaded()) {
+      XInitThreads();
+    }
+
     Display *display = getDisplay();
 
     /* Get the XCB connection from the display */
@@ -388,6 +986,7 @@ main(void) {
 
     /* Acquire event queue ownership */
     /* See https://xcb.freedesktop.org/MixingCalls/ for why this is needed */
+    /* It's also what lets the event thread wait on xcb without Xlib reading events too */
     XSetEventQueueOwner(display, XCBOwnsEventQueue);
 
     int default_screen = DefaultScreen(display);
@@ -0,0 +1,235 @@
+#ifndef BLIT_QUEUE_H
+#define BLIT_QUEUE_H
+
+/*
+ * X events read on their own thread, BLIT_EVENT_THREAD=1 turns it on
+ * The thread blocks in xcb_wait_for_event and copies every event into a single producer,
+ * single consumer ring with its arrival time, the render loop drains the ring once per frame
+ * So a burst of events or a slow reply on the render thread can't hold the other up
+ *
+ * xcb locks the connection itself, so one thread waiting for events while the other sends
+ * requests and waits for replies is allowed, the only rule is that the render thread must not
+ * read events any more, everything goes through eventNext
+ * With Xlib on the same connection XInitThreads has to come first and xcb has to own the
+ * event queue (XSetEventQueueOwner), see blit_opengl.c
+ *
+ * Without the thread eventNext polls the connection like the loops used to
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <xcb/xcb.h>
+
+#include "blit_events.h"
+#include "blit_mem.h"
+#include "blit_stats.h"
+
+#define QUEUE_SIZE 1024 /* power of two */
+
+typedef struct {
+  xcb_generic_event_t event; /* every core event is 32 bytes, copied whole */
+  uint64_t arrived;
+} queued_event_t;
+
+/* Lock free, one thread pushes and one pops */
+/* head and tail sit on their own cache lines so the two threads don't share one */
+typedef struct {
+  queued_event_t slots[QUEUE_SIZE];
+  _Alignas(64) atomic_size_t head; /* next to pop, written by the consumer */
+  _Alignas(64) atomic_size_t tail; /* next to push, written by the producer */
+} event_queue_t;
+
+typedef struct {
+  xcb_connection_t *display;
+  xcb_window_t window; /* the wake up message goes here */
+  xcb_atom_t wake;
+
+  int threaded;
+  pthread_t thread;
+  atomic_int stop;
+  atomic_ullong stalls; /* times the ring was full and the thread had to wait */
+  event_queue_t *queue;
+
+  queued_event_t current; /* what eventNext handed out last, threaded */
+  xcb_generic_event_t *polled; /* same, not threaded */
+} event_source_t;
+
+static inline int
+queuePush(event_queue_t *queue,
+          const queued_event_t *event) {
+  /* Producer only, returns 0 if the ring is full */
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+  if (tail - head == QUEUE_SIZE) {
+    return 0;
+  }
+
+  queue->slots[tail & (QUEUE_SIZE - 1)] = *event;
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+
+  return 1;
+}
+
+static inline int
+queuePop(event_queue_t *queue,
+         queued_event_t *event) {
+  /* Consumer only, returns 0 if the ring is empty */
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+  if (head == tail) {
+    return 0;
+  }
+
+  *event = queue->slots[head & (QUEUE_SIZE - 1)];
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+  return 1;
+}
+
+static inline int
+eventThreaded(void) {
+  /* Checked before the display is opened too, Xlib needs to know early */
+  return getenv("BLIT_EVENT_THREAD") != NULL && strcmp(getenv("BLIT_EVENT_THREAD"), "1") == 0;
+}
+
+static inline void*
+eventThread(void *arg) {
+  event_source_t *source = arg;
+  struct timespec wait = {0, 100000};
+
+  while (!atomic_load(&source->stop)) {
+    /* Plain free below, the mem counters aren't thread safe and these never reach the loop */
+    xcb_generic_event_t *event = xcb_wait_for_event(source->display);
+
+    if (event == NULL) {
+      fprintf(stderr, "Event thread: the connection went away\n");
+      break;
+    }
+
+    /* Only sent to get us out of xcb_wait_for_event, the loop condition does the rest */
+    if ((event->response_type & ~0x80) == XCB_CLIENT_MESSAGE &&
+        ((xcb_client_message_event_t *)event)->type == source->wake) {
+      free(event);
+      continue;
+    }
+
+    queued_event_t queued;
+    queued.event = *event;
+    queued.arrived = getTimeNs();
+    free(event);
+
+    /* Full means the render thread is far behind, wait for it rather than lose an expose */
+    while (!queuePush(source->queue, &queued)) {
+      if (atomic_load(&source->stop)) {
+        return NULL;
+      }
+      atomic_fetch_add(&source->stalls, 1);
+      nanosleep(&wait, NULL);
+    }
+  }
+  return NULL;
+}
+
+static inline event_source_t*
+allocEventSource(xcb_connection_t *display,
+                 xcb_window_t window) {
+  event_source_t *source = memCalloc(1, sizeof(event_source_t));
+
+  source->display = display;
+  source->window = window;
+
+  if (!eventThreaded()) {
+    return source;
+  }
+
+  xcb_intern_atom_reply_t *atom =
+    memReply(xcb_intern_atom_reply(display, xcb_intern_atom(display, 0, 10, "_BLIT_WAKE"), NULL));
+
+  source->wake = atom != NULL ? atom->atom : XCB_ATOM_NONE;
+  memFreeReply(atom);
+
+  source->queue = aligned_alloc(64, sizeof(event_queue_t));
+
+  if (source->queue == NULL) {
+    fprintf(stderr, "Could not allocate the event queue, polling instead\n");
+    return source;
+  }
+  memset(source->queue, 0, sizeof(event_queue_t));
+
+  if (pthread_create(&source->thread, NULL, eventThread, source) != 0) {
+    fprintf(stderr, "Could not start the event thread, polling instead\n");
+    free(source->queue);
+    source->queue = NULL;
+    return source;
+  }
+
+  source->threaded = 1;
+  printf("Reading events on their own thread\n");
+
+  return source;
+}
+
+static inline void
+freeEventSource(event_source_t *source) {
+  if (source == NULL) {
+    return;
+  }
+
+  if (source->threaded) {
+    /* An empty event mask sends it to whoever created the window, i.e. us */
+    xcb_client_message_event_t wake;
+    memset(&wake, 0, sizeof(wake));
+
+    wake.response_type = XCB_CLIENT_MESSAGE;
+    wake.format = 32;
+    wake.window = source->window;
+    wake.type = source->wake;
+
+    atomic_store(&source->stop, 1);
+    xcb_send_event(source->display, 0, source->window, XCB_EVENT_MASK_NO_EVENT, (const char *)&wake);
+    xcb_flush(source->display);
+
+    pthread_join(source->thread, NULL);
+
+    printf("Event thread stalled on a full queue %llu times\n",
+           (unsigned long long)atomic_load(&source->stalls));
+    free(source->queue);
+  }
+
+  memFreeReply(source->polled);
+  memFree(source);
+}
+
+static inline xcb_generic_event_t*
+eventNext(event_source_t *source,
+          event_batch_t *batch) {
+  /* The next event for this frame, NULL once there are none left */
+  /* The source owns it, it stays valid until the next call */
+  if (source->threaded) {
+    if (!queuePop(source->queue, &source->current)) {
+      return NULL;
+    }
+    batchEventAt(batch, source->current.arrived);
+    return &source->current.event;
+  }
+
+  memFreeReply(source->polled);
+
+  /* Only the first poll reads from the connection, the rest just empty xcb's queue */
+  source->polled = memReply(batch->events == 0 ? xcb_poll_for_event(source->display)
+                                               : xcb_poll_for_queued_event(source->display));
+
+  if (source->polled != NULL) {
+    batchEvent(batch);
+  }
+  return source->polled;
+}
+
+#endif
@@ -0,0 +1,398 @@
+#ifndef BLIT_RANDR_H
+#define BLIT_RANDR_H
+
+/*
+ * Which monitor a window is on, and how fast it refreshes, from RandR 1.3
+ * A monitor here is an active CRTC, its refresh rate comes from the mode's timings
+ * The window is on the one its center is over, and the loops pace to that one's refresh
+ * rate instead of a fixed period (BLIT_FPS still wins when it's set)
+ * New windows open on the primary monitor at its size, not over the whole screen
+ * RRScreenChangeNotify, CRTC and output changes and the window moving all look again
+ * The monitors are read once per screen (randr_screen_t) and shared by every window on it,
+ * a window only keeps which one it's on, so moving a window costs two round trips
+ * Without RandR everything falls back to the screen and the old fixed periods
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xcb/randr.h>
+#include <xcb/xcb.h>
+
+#include "blit_mem.h"
+
+#define RANDR_MONITORS 16
+
+typedef struct {
+  xcb_randr_crtc_t crtc;
+  int16_t x;
+  int16_t y;
+  uint16_t width;
+  uint16_t height;
+  double hz; /* 0 if the mode doesn't say, e.g. a virtual display */
+} monitor_t;
+
+typedef struct {
+  xcb_connection_t *display;
+  xcb_window_t root;
+  uint8_t first_event;
+  monitor_t monitors[RANDR_MONITORS]; /* every active CRTC, read again on RandR events */
+  int count;
+} randr_screen_t;
+
+typedef struct {
+  randr_screen_t *screen;
+  int own_screen; /* made by allocRandr for this window alone */
+  xcb_window_t window;
+  monitor_t monitor; /* the one the window is on */
+  uint64_t changes;
+} randr_t;
+
+static inline double
+randrModeHz(const xcb_randr_mode_info_t *mode) {
+  /* Pixel clock over pixels per frame, blanking included */
+  double lines = mode->vtotal;
+
+  if (mode->mode_flags & XCB_RANDR_MODE_FLAG_DOUBLE_SCAN) {
+    lines *= 2;
+  }
+  if (mode->mode_flags & XCB_RANDR_MODE_FLAG_INTERLACE) {
+    lines /= 2;
+  }
+
+  if (mode->dot_clock == 0 || mode->htotal == 0 || lines == 0) {
+    return 0;
+  }
+  return (double)mode->dot_clock / ((double)mode->htotal * lines);
+}
+
+static inline int
+randrSupported(xcb_connection_t *display) {
+  /* GetScreenResourcesCurrent needs 1.3 */
+  const xcb_query_extension_reply_t *ext = xcb_get_extension_data(display, &xcb_randr_id);
+
+  if (ext == NULL || !ext->present) {
+    return 0;
+  }
+
+  xcb_randr_query_version_reply_t *version =
+    memReply(xcb_randr_query_version_reply(display, xcb_randr_query_version(display, 1, 3), NULL));
+
+  int ok = version != NULL && (version->major_version > 1 || version->minor_version >= 3);
+
+  memFreeReply(version);
+  return ok;
+}
+
+static inline int
+randrMonitors(xcb_connection_t *display,
+              xcb_window_t root,
+              monitor_t *monitors,
+              int *primary) {
+  /* Every active CRTC, returns how many, primary is the index of the primary output's or 0 */
+  xcb_randr_get_output_primary_cookie_t primary_cookie = xcb_randr_get_output_primary(display, root);
+  xcb_randr_get_screen_resources_current_reply_t *resources =
+    memReply(xcb_randr_get_screen_resources_current_reply(display,
+                                                          xcb_randr_get_screen_resources_current(display, root),
+                                                          NULL));
+  xcb_randr_get_output_primary_reply_t *primary_output =
+    memReply(xcb_randr_get_output_primary_reply(display, primary_cookie, NULL));
+
+  *primary = 0;
+
+  if (resources == NULL) {
+    memFreeReply(primary_output);
+    return 0;
+  }
+
+  xcb_randr_crtc_t *crtcs = xcb_randr_get_screen_resources_current_crtcs(resources);
+  xcb_randr_mode_info_t *modes = xcb_randr_get_screen_resources_current_modes(resources);
+  int crtc_count = xcb_randr_get_screen_resources_current_crtcs_length(resources);
+  int mode_count = xcb_randr_get_screen_resources_current_modes_length(resources);
+  xcb_randr_get_crtc_info_cookie_t cookies[RANDR_MONITORS];
+
+  crtc_count = crtc_count < RANDR_MONITORS ? crtc_count : RANDR_MONITORS;
+
+  /* All the CRTCs in one round trip, plus the primary output's while at it */
+  for (int i = 0; i < crtc_count; i++) {
+    cookies[i] = xcb_randr_get_crtc_info(display, crtcs[i], resources->config_timestamp);
+  }
+
+  xcb_randr_crtc_t primary_crtc = XCB_NONE;
+  xcb_randr_get_output_info_cookie_t output_cookie = {0};
+
+  if (primary_output != NULL && primary_output->output != XCB_NONE) {
+    output_cookie = xcb_randr_get_output_info(display, primary_output->output, resources->config_timestamp);
+  }
+
+  int count = 0;
+
+  for (int i = 0; i < crtc_count; i++) {
+    xcb_randr_get_crtc_info_reply_t *crtc = memReply(xcb_randr_get_crtc_info_reply(display, cookies[i], NULL));
+
+    /* No mode means the CRTC isn't driving anything */
+    if (crtc != NULL && crtc->mode != XCB_NONE && crtc->width > 0) {
+      monitor_t *monitor = &monitors[count++];
+
+      monitor->crtc = crtcs[i];
+      monitor->x = crtc->x;
+      monitor->y = crtc->y;
+      monitor->width = crtc->width;
+      monitor->height = crtc->height;
+      monitor->hz = 0;
+
+      for (int m = 0; m < mode_count; m++) {
+        if (modes[m].id == crtc->mode) {
+          monitor->hz = randrModeHz(&modes[m]);
+        }
+      }
+    }
+    memFreeReply(crtc);
+  }
+
+  if (primary_output != NULL && primary_output->output != XCB_NONE) {
+    xcb_randr_get_output_info_reply_t *output =
+      memReply(xcb_randr_get_output_info_reply(display, output_cookie, NULL));
+
+    primary_crtc = output != NULL ? output->crtc : XCB_NONE;
+    memFreeReply(output);
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (monitors[i].crtc == primary_crtc) {
+      *primary = i;
+    }
+  }
+
+  memFreeReply(primary_output);
+  memFreeReply(resources);
+  return count;
+}
+
+static inline int
+randrMonitorAt(const monitor_t *monitors,
+               int count,
+               int x,
+               int y) {
+  /* Index of the monitor with (x, y) on it, or the closest one when it's off every monitor */
+  int best = 0;
+  int64_t best_distance = INT64_MAX;
+
+  for (int i = 0; i < count; i++) {
+    const monitor_t *m = &monitors[i];
+    int dx = x < m->x ? m->x - x : x >= m->x + m->width ? x - (m->x + m->width - 1) : 0;
+    int dy = y < m->y ? m->y - y : y >= m->y + m->height ? y - (m->y + m->height - 1) : 0;
+    int64_t distance = (int64_t)dx * dx + (int64_t)dy * dy;
+
+    if (distance < best_distance) {
+      best = i;
+      best_distance = distance;
+    }
+  }
+  return best;
+}
+
+static inline monitor_t
+randrDefaultMonitor(xcb_connection_t *display,
+                    xcb_screen_t *screen) {
+  /* Where a new window should go, the primary monitor, or the whole screen without RandR */
+  monitor_t monitors[RANDR_MONITORS];
+  monitor_t monitor = {XCB_NONE, 0, 0, screen->width_in_pixels, screen->height_in_pixels, 0};
+  int primary = 0;
+
+  if (randrSupported(display) && randrMonitors(display, screen->root, monitors, &primary) > 0) {
+    monitor = monitors[primary];
+  }
+  return monitor;
+}
+
+static inline void
+randrScreenUpdate(randr_screen_t *screen) {
+  int primary;
+
+  screen->count = randrMonitors(screen->display, screen->root, screen->monitors, &primary);
+}
+
+static inline randr_screen_t*
+allocRandrScreen(xcb_connection_t *display,
+                 xcb_screen_t *screen) {
+  /* NULL without RandR 1.3 */
+  if (!randrSupported(display)) {
+    fprintf(stderr, "No RandR 1.3, pacing to a fixed rate\n");
+    return NULL;
+  }
+
+  randr_screen_t *randr = memCalloc(1, sizeof(randr_screen_t));
+
+  randr->display = display;
+  randr->root = screen->root;
+  randr->first_event = xcb_get_extension_data(display, &xcb_randr_id)->first_event;
+
+  /* Selected on the root, so there's one copy of each event however many windows there are */
+  xcb_randr_select_input(display,
+                         screen->root,
+                         XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE |
+                         XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE |
+                         XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE);
+
+  randrScreenUpdate(randr);
+
+  return randr;
+}
+
+static inline void
+freeRandrScreen(randr_screen_t *randr) {
+  memFree(randr);
+}
+
+static inline int
+randrScreenEvent(randr_screen_t *randr,
+                 const xcb_generic_event_t *event) {
+  /* Call for events the loop doesn't know, returns 1 if it was RandR's and the monitors were read again */
+  if (randr == NULL) {
+    return 0;
+  }
+
+  int type = event->response_type & ~0x80;
+
+  if (type == randr->first_event + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
+    const xcb_randr_screen_change_notify_event_t *change = (const xcb_randr_screen_change_notify_event_t *)event;
+
+    printf("randr: screen is now %ux%u\n", change->width, change->height);
+    randrScreenUpdate(randr);
+    return 1;
+  }
+
+  /* CRTC and output changes, a mode switch or a monitor plugged in or out */
+  if (type == randr->first_event + XCB_RANDR_NOTIFY) {
+    randrScreenUpdate(randr);
+    return 1;
+  }
+
+  return 0;
+}
+
+static inline int
+randrUpdate(randr_t *randr) {
+  /* Looks up the monitor under the window's center again, returns 1 if it changed */
+  randr_screen_t *screen = randr->screen;
+
+  if (screen->count == 0) {
+    return 0;
+  }
+
+  xcb_get_geometry_reply_t *geometry =
+    memReply(xcb_get_geometry_reply(screen->display, xcb_get_geometry(screen->display, randr->window), NULL));
+
+  if (geometry == NULL) {
+    return 0;
+  }
+
+  /* Relative to the parent, which a window manager may have put in between */
+  xcb_translate_coordinates_reply_t *center =
+    memReply(xcb_translate_coordinates_reply(screen->display,
+                                             xcb_translate_coordinates(screen->display,
+                                                                       randr->window,
+                                                                       screen->root,
+                                                                       (int16_t)(geometry->width / 2),
+                                                                       (int16_t)(geometry->height / 2)),
+                                             NULL));
+  memFreeReply(geometry);
+
+  if (center == NULL) {
+    return 0;
+  }
+
+  monitor_t monitor = screen->monitors[randrMonitorAt(screen->monitors, screen->count, center->dst_x, center->dst_y)];
+  memFreeReply(center);
+
+  if (monitor.crtc == randr->monitor.crtc &&
+      monitor.x == randr->monitor.x &&
+      monitor.y == randr->monitor.y &&
+      monitor.width == randr->monitor.width &&
+      monitor.height == randr->monitor.height &&
+      monitor.hz == randr->monitor.hz) {
+    return 0;
+  }
+
+  randr->monitor = monitor;
+  randr->changes++;
+
+  printf("randr: window 0x%x is on crtc 0x%x, %ux%u+%d+%d at %.2fHz\n",
+         randr->window,
+         monitor.crtc,
+         monitor.width,
+         monitor.height,
+         monitor.x,
+         monitor.y,
+         monitor.hz);
+
+  return 1;
+}
+
+static inline randr_t*
+allocRandrWindow(randr_screen_t *screen,
+                 xcb_window_t window) {
+  /* One window on a shared screen, NULL when there is no screen, i.e. no RandR */
+  if (screen == NULL) {
+    return NULL;
+  }
+
+  randr_t *randr = memCalloc(1, sizeof(randr_t));
+
+  randr->screen = screen;
+  randr->window = window;
+
+  randrUpdate(randr);
+
+  return randr;
+}
+
+static inline randr_t*
+allocRandr(xcb_connection_t *display,
+           xcb_screen_t *screen,
+           xcb_window_t window) {
+  /* A window with a screen of its own, for the backends with only one, NULL without RandR 1.3 */
+  randr_t *randr = allocRandrWindow(allocRandrScreen(display, screen), window);
+
+  if (randr != NULL) {
+    randr->own_screen = 1;
+  }
+  return randr;
+}
+
+static inline void
+freeRandr(randr_t *randr) {
+  if (randr == NULL) {
+    return;
+  }
+  if (randr->own_screen) {
+    freeRandrScreen(randr->screen);
+  }
+  memFree(randr);
+}
+
+static inline int
+randrEvent(randr_t *randr,
+           const xcb_generic_event_t *event) {
+  /* Call for events the loop doesn't know, returns 1 if the window's monitor changed */
+  return randr != NULL && randrScreenEvent(randr->screen, event) && randrUpdate(randr);
+}
+
+static inline int
+randrMoved(randr_t *randr) {
+  /* Call when the window may have moved, returns 1 if it's on another monitor now */
+  return randr != NULL && randrUpdate(randr);
+}
+
+static inline uint64_t
+randrRefresh(const randr_t *randr) {
+  /* ns per refresh of the window's monitor, 0 if it isn't known */
+  if (randr == NULL || randr->monitor.hz <= 0) {
+    return 0;
+  }
+  return (uint64_t)(1e9 / randr->monitor.hz);
+}
+
+#endif
@@ -0,0 +1,530 @@
+#ifndef BLIT_RENDER_H
+#define BLIT_RENDER_H
+
+/*
+ * Server side compositing with the RENDER extension
+ * Sprites and layers are uploaded once as Pictures, after that a frame is only a list of
+ * composite requests, so unchanged assets never cross the wire again
+ * Colored sprites are composited one request each (Over or Add, 36 bytes)
+ * Single color sprites live in an A8 glyphset and go out in composite_glyphs batches,
+ * 12 bytes per sprite and one request per color
+ * Every request is counted so a frame can be compared against blending on the client and
+ * uploading the result
+ * The formats, glyphset, tint and uploaded pictures are made once (render_shared_t) and used by
+ * every window, a render_t is only the picture of one window's backbuffer and its pending glyphs
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xcb/xcb.h>
+#include <xcb/render.h>
+
+#include "blit_mem.h"
+#include "blit_sprite.h"
+#include "blit_stats.h"
+
+/* Request sizes from the protocol, in bytes */
+#define RENDER_COMPOSITE_BYTES 36
+#define RENDER_FILL_BYTES 20
+#define RENDER_GLYPHS_BYTES 28
+#define RENDER_ELT_BYTES 12 /* one glyph element with a single glyph */
+#define PUT_IMAGE_BYTES 24
+#define COPY_AREA_BYTES 28
+
+typedef struct {
+  xcb_connection_t *display;
+
+  xcb_render_pictformat_t argb32;
+  xcb_render_pictformat_t a8;
+  xcb_render_pictformat_t visual; /* the format of the root visual */
+
+  xcb_render_glyphset_t glyphs;
+  xcb_render_picture_t tint; /* solid fill used as the source for glyphs */
+
+  size_t max_bytes; /* largest request the server takes */
+  uint64_t uploaded; /* sent once for assets */
+} render_shared_t;
+
+typedef struct {
+  render_shared_t *shared;
+  xcb_connection_t *display;
+
+  xcb_render_picture_t back; /* the backbuffer pixmap */
+
+  uint8_t *elts; /* pending glyph elements */
+  size_t elts_len;
+  size_t elts_cap;
+  int last_x; /* pen position after the last element */
+  int last_y;
+
+  uint64_t bytes; /* sent this frame */
+  uint64_t sent; /* every frame added up */
+  uint64_t frames;
+  stat_t frame_bytes;
+  stat_t client_bytes;
+  stat_t requests;
+  uint64_t frame_requests;
+} render_t;
+
+/* One element of a composite_glyphs_32 request that draws a single glyph */
+typedef struct {
+  uint8_t len;
+  uint8_t pad[3];
+  int16_t dx;
+  int16_t dy;
+  uint32_t glyph;
+} render_elt_t;
+
+static inline xcb_render_pictformat_t
+renderFindFormat(const xcb_render_query_pict_formats_reply_t *formats,
+                 uint8_t depth,
+                 uint16_t alpha_mask,
+                 uint16_t red_mask) {
+  /* The standard formats, ARGB32 is depth 32 with red at 16 and A8 is depth 8 alpha only */
+  xcb_render_pictforminfo_iterator_t iter = xcb_render_query_pict_formats_formats_iterator(formats);
+
+  for (; iter.rem; xcb_render_pictforminfo_next(&iter)) {
+    xcb_render_pictforminfo_t *info = iter.data;
+
+    if (info->type == XCB_RENDER_PICT_TYPE_DIRECT &&
+        info->depth == depth &&
+        info->direct.alpha_mask == alpha_mask &&
+        info->direct.red_mask == red_mask &&
+        (red_mask == 0 || info->direct.red_shift == 16)) {
+      return info->id;
+    }
+  }
+  return 0;
+}
+
+static inline xcb_render_pictformat_t
+renderVisualFormat(const xcb_render_query_pict_formats_reply_t *formats,
+                   xcb_visualid_t visual) {
+  xcb_render_pictscreen_iterator_t screens = xcb_render_query_pict_formats_screens_iterator(formats);
+
+  for (; screens.rem; xcb_render_pictscreen_next(&screens)) {
+    xcb_render_pictdepth_iterator_t depths = xcb_render_pictscreen_depths_iterator(screens.data);
+
+    for (; depths.rem; xcb_render_pictdepth_next(&depths)) {
+      xcb_render_pictvisual_iterator_t visuals = xcb_render_pictdepth_visuals_iterator(depths.data);
+
+      for (; visuals.rem; xcb_render_pictvisual_next(&visuals)) {
+        if (visuals.data->visual == visual) {
+          return visuals.data->format;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+static inline render_shared_t*
+allocRenderShared(xcb_connection_t *display,
+                  xcb_screen_t *screen) {
+  /* Returns NULL without RENDER 0.10 (solid fills), the caller keeps drawing with the core GC */
+  const xcb_query_extension_reply_t *ext = xcb_get_extension_data(display, &xcb_render_id);
+
+  if (ext == NULL || !ext->present) {
+    fprintf(stderr, "No RENDER extension\n");
+    return NULL;
+  }
+
+  xcb_render_query_version_reply_t *version =
+    xcb_render_query_version_reply(display, xcb_render_query_version(display, 0, 11), NULL);
+
+  if (version == NULL || (version->major_version == 0 && version->minor_version < 10)) {
+    fprintf(stderr, "RENDER is too old\n");
+    free(version);
+    return NULL;
+  }
+  free(version);
+
+  xcb_render_query_pict_formats_reply_t *formats =
+    xcb_render_query_pict_formats_reply(display, xcb_render_query_pict_formats(display), NULL);
+
+  if (formats == NULL) {
+    return NULL;
+  }
+
+  render_shared_t *shared = memCalloc(1, sizeof(render_shared_t));
+
+  shared->display = display;
+  shared->argb32 = renderFindFormat(formats, 32, 0xff, 0xff);
+  shared->a8 = renderFindFormat(formats, 8, 0xff, 0);
+  shared->visual = renderVisualFormat(formats, screen->root_visual);
+  free(formats);
+
+  if (shared->argb32 == 0 || shared->a8 == 0 || shared->visual == 0) {
+    fprintf(stderr, "Missing picture formats\n");
+    memFree(shared);
+    return NULL;
+  }
+
+  shared->max_bytes = (size_t)xcb_get_maximum_request_length(display) * 4;
+
+  shared->glyphs = xcb_generate_id(display);
+  xcb_render_create_glyph_set(display, shared->glyphs, shared->a8);
+
+  xcb_render_color_t white = {0xffff, 0xffff, 0xffff, 0xffff};
+  shared->tint = xcb_generate_id(display);
+  xcb_render_create_solid_fill(display, shared->tint, white);
+
+  return shared;
+}
+
+static inline void
+freeRenderShared(render_shared_t *shared) {
+  if (shared == NULL) {
+    return;
+  }
+  xcb_render_free_picture(shared->display, shared->tint);
+  xcb_render_free_glyph_set(shared->display, shared->glyphs);
+  memFree(shared);
+}
+
+static inline render_t*
+allocRender(render_shared_t *shared,
+            xcb_pixmap_t backbuffer) {
+  /* A window's backbuffer as a picture, everything it draws with comes from shared */
+  render_t *render = memCalloc(1, sizeof(render_t));
+
+  render->shared = shared;
+  render->display = shared->display;
+
+  render->back = xcb_generate_id(render->display);
+  xcb_render_create_picture(render->display, render->back, backbuffer, shared->visual, 0, NULL);
+
+  render->frame_bytes = newStat("bytes/frame");
+  render->client_bytes = newStat("client side bytes/frame");
+  render->requests = newStat("requests/frame");
+
+  return render;
+}
+
+static inline void
+renderBackBuffer(render_t *render,
+                 xcb_drawable_t backbuffer) {
+  /* Points the backbuffer picture at another pixmap, e.g. after the window was resized */
+  xcb_render_free_picture(render->display, render->back);
+
+  render->back = xcb_generate_id(render->display);
+  xcb_render_create_picture(render->display, render->back, backbuffer, render->shared->visual, 0, NULL);
+}
+
+static inline void
+freeRender(render_t *render) {
+  if (render == NULL) {
+    return;
+  }
+  xcb_render_free_picture(render->display, render->back);
+  memFree(render->elts);
+  memFree(render);
+}
+
+static inline xcb_render_picture_t
+renderUpload(render_shared_t *shared,
+             xcb_drawable_t root,
+             const surface_t *src,
+             int repeat) {
+  /* Uploads a premultiplied ARGB surface into a new Picture, once */
+  xcb_connection_t *display = shared->display;
+  xcb_pixmap_t pixmap = xcb_generate_id(display);
+  xcb_gcontext_t gc = xcb_generate_id(display);
+  xcb_render_picture_t picture = xcb_generate_id(display);
+
+  xcb_create_pixmap(display, 32, pixmap, root, (uint16_t)src->width, (uint16_t)src->height);
+  xcb_create_gc(display, gc, pixmap, 0, NULL);
+
+  size_t row_bytes = (size_t)src->width * 4;
+  int band = (int)((shared->max_bytes - 64) / row_bytes);
+
+  band = band > src->height ? src->height : band;
+
+  for (int top = 0; top < src->height; top += band) {
+    int n = src->height - top < band ? src->height - top : band;
+    uint8_t *data = memAlloc(row_bytes * n);
+
+    for (int row = 0; row < n; row++) {
+      memcpy(data + row_bytes * row, surfaceRow(src, top + row), row_bytes);
+    }
+
+    xcb_put_image(display,
+                  XCB_IMAGE_FORMAT_Z_PIXMAP,
+                  pixmap,
+                  gc,
+                  (uint16_t)src->width, (uint16_t)n,
+                  0, (int16_t)top,
+                  0,
+                  32,
+                  (uint32_t)(row_bytes * n),
+                  data);
+
+    shared->uploaded += PUT_IMAGE_BYTES + row_bytes * n;
+    memFree(data);
+  }
+
+  uint32_t values[1] = {repeat};
+  xcb_render_create_picture(display, picture, pixmap, shared->argb32, XCB_RENDER_CP_REPEAT, values);
+
+  /* The picture keeps the pixmap alive */
+  xcb_free_gc(display, gc);
+  xcb_free_pixmap(display, pixmap);
+
+  return picture;
+}
+
+static inline void
+renderAddGlyphs(render_shared_t *shared,
+                const surface_t *atlas,
+                int size,
+                int count) {
+  /* The alpha of each size x size cell of the atlas becomes glyph i + 1 */
+  /* A8 rows are padded to 4 bytes, no advance so every glyph is positioned on its own */
+  int per_row = atlas->width / size;
+  size_t pitch = ((size_t)size + 3) & ~(size_t)3;
+  size_t glyph_bytes = pitch * size;
+  int batch = (int)((shared->max_bytes - 64) / (glyph_bytes + 16));
+
+  batch = batch > count ? count : batch;
+
+  uint32_t *ids = memAlloc(sizeof(uint32_t) * batch);
+  xcb_render_glyphinfo_t *infos = memAlloc(sizeof(xcb_render_glyphinfo_t) * batch);
+  uint8_t *data = memCalloc(batch, glyph_bytes);
+
+  for (int first = 0; first < count; first += batch) {
+    int n = count - first < batch ? count - first : batch;
+
+    for (int i = 0; i < n; i++) {
+      int cell = first + i;
+
+      ids[i] = (uint32_t)cell + 1;
+      infos[i].width = (uint16_t)size;
+      infos[i].height = (uint16_t)size;
+      infos[i].x = 0;
+      infos[i].y = 0;
+      infos[i].x_off = 0;
+      infos[i].y_off = 0;
+
+      for (int y = 0; y < size; y++) {
+        const uint32_t *row = surfaceRow(atlas, (cell / per_row) * size + y) + (cell % per_row) * size;
+
+        for (int x = 0; x < size; x++) {
+          data[glyph_bytes * i + pitch * y + x] = (uint8_t)(row[x] >> 24);
+        }
+      }
+    }
+
+    xcb_render_add_glyphs(shared->display,
+                          shared->glyphs,
+                          (uint32_t)n,
+                          ids,
+                          infos,
+                          (uint32_t)(glyph_bytes * n),
+                          data);
+
+    shared->uploaded += 12 + (sizeof(uint32_t) + sizeof(xcb_render_glyphinfo_t) + glyph_bytes) * n;
+  }
+
+  memFree(ids);
+  memFree(infos);
+  memFree(data);
+}
+
+static inline xcb_render_color_t
+renderColor(uint32_t argb) {
+  /* Premultiplied 8 bit ARGB to RENDER's 16 bit channels, which are premultiplied too */
+  xcb_render_color_t color;
+  color.red = (uint16_t)(((argb >> 16) & 0xff) * 257);
+  color.green = (uint16_t)(((argb >> 8) & 0xff) * 257);
+  color.blue = (uint16_t)((argb & 0xff) * 257);
+  color.alpha = (uint16_t)((argb >> 24) * 257);
+  return color;
+}
+
+static inline void
+renderCompositeMask(render_t *render,
+                    uint8_t op,
+                    xcb_render_picture_t src,
+                    xcb_render_picture_t mask,
+                    int src_x,
+                    int src_y,
+                    int dst_x,
+                    int dst_y,
+                    int width,
+                    int height) {
+  xcb_render_composite(render->display,
+                       op,
+                       src,
+                       mask,
+                       render->back,
+                       (int16_t)src_x, (int16_t)src_y,
+                       0, 0,
+                       (int16_t)dst_x, (int16_t)dst_y,
+                       (uint16_t)width, (uint16_t)height);
+
+  render->bytes += RENDER_COMPOSITE_BYTES;
+  render->frame_requests++;
+}
+
+static inline void
+renderComposite(render_t *render,
+                uint8_t op,
+                xcb_render_picture_t src,
+                int src_x,
+                int src_y,
+                int dst_x,
+                int dst_y,
+                int width,
+                int height) {
+  renderCompositeMask(render, op, src, XCB_RENDER_PICTURE_NONE, src_x, src_y, dst_x, dst_y, width, height);
+}
+
+static inline void
+renderGradient(render_t *render,
+               int x,
+               int y,
+               int width,
+               int height,
+               uint32_t from,
+               uint32_t to,
+               int vertical) {
+  /* A linear gradient picture that only lives for this one composite */
+  xcb_render_picture_t gradient = xcb_generate_id(render->display);
+  xcb_render_pointfix_t p1 = {x << 16, y << 16};
+  xcb_render_pointfix_t p2 = {(vertical ? x : x + width) << 16, (vertical ? y + height : y) << 16};
+  xcb_render_fixed_t stops[2] = {0, 1 << 16};
+  xcb_render_color_t colors[2] = {renderColor(from), renderColor(to)};
+
+  xcb_render_create_linear_gradient(render->display, gradient, p1, p2, 2, stops, colors);
+  renderComposite(render, XCB_RENDER_PICT_OP_OVER, gradient, x, y, x, y, width, height);
+  xcb_render_free_picture(render->display, gradient);
+
+  render->bytes += 28 + 2 * 4 + 2 * 8 + 8;
+  render->frame_requests += 2;
+}
+
+static inline void
+renderClip(render_t *render,
+           const xcb_rectangle_t *rect) {
+  /* NULL turns clipping off */
+  if (rect == NULL) {
+    uint32_t values[1] = {XCB_NONE};
+
+    xcb_render_change_picture(render->display, render->back, XCB_RENDER_CP_CLIP_MASK, values);
+    render->bytes += 16;
+  }
+  else {
+    xcb_render_set_picture_clip_rectangles(render->display, render->back, 0, 0, 1, rect);
+    render->bytes += 12 + sizeof(xcb_rectangle_t);
+  }
+  render->frame_requests++;
+}
+
+static inline void
+renderFill(render_t *render,
+           uint8_t op,
+           xcb_render_color_t color,
+           xcb_rectangle_t rect) {
+  xcb_render_fill_rectangles(render->display, op, render->back, color, 1, &rect);
+
+  render->bytes += RENDER_FILL_BYTES + sizeof(xcb_rectangle_t);
+  render->frame_requests++;
+}
+
+static inline void
+renderGlyphsFlush(render_t *render,
+                  uint8_t op) {
+  if (render->elts_len == 0) {
+    return;
+  }
+
+  /* No mask format, so overlapping glyphs blend one after the other like separate sprites */
+  xcb_render_composite_glyphs_32(render->display,
+                                 op,
+                                 render->shared->tint,
+                                 render->back,
+                                 0,
+                                 render->shared->glyphs,
+                                 0, 0,
+                                 (uint32_t)render->elts_len,
+                                 render->elts);
+
+  render->bytes += RENDER_GLYPHS_BYTES + render->elts_len;
+  render->frame_requests++;
+  render->elts_len = 0;
+  render->last_x = 0;
+  render->last_y = 0;
+}
+
+static inline void
+renderTint(render_t *render,
+           uint8_t op,
+           xcb_render_color_t color) {
+  /* Glyphs queued so far keep their color, so send them first */
+  renderGlyphsFlush(render, op);
+
+  xcb_render_free_picture(render->display, render->shared->tint);
+  xcb_render_create_solid_fill(render->display, render->shared->tint, color);
+
+  render->bytes += 16 + 16;
+  render->frame_requests += 2;
+}
+
+static inline void
+renderGlyph(render_t *render,
+            uint8_t op,
+            uint32_t glyph,
+            int x,
+            int y) {
+  /* Queues a glyph, the offsets are relative to where the previous one was drawn */
+  if (render->elts_len + sizeof(render_elt_t) > render->shared->max_bytes - RENDER_GLYPHS_BYTES) {
+    renderGlyphsFlush(render, op);
+  }
+
+  if (render->elts_len + sizeof(render_elt_t) > render->elts_cap) {
+    render->elts_cap = render->elts_cap ? render->elts_cap * 2 : 4096;
+    render->elts = memRealloc(render->elts, render->elts_cap);
+  }
+
+  render_elt_t elt;
+  memset(&elt, 0, sizeof(elt));
+  elt.len = 1;
+  elt.dx = (int16_t)(x - render->last_x);
+  elt.dy = (int16_t)(y - render->last_y);
+  elt.glyph = glyph;
+
+  memcpy(render->elts + render->elts_len, &elt, sizeof(elt));
+  render->elts_len += sizeof(elt);
+  render->last_x = x;
+  render->last_y = y;
+}
+
+static inline void
+renderFrameEnd(render_t *render,
+               uint64_t client_bytes) {
+  /* client_bytes is what the same frame costs if it was blended here and uploaded */
+  render->sent += render->bytes;
+  statAdd(&render->frame_bytes, render->bytes);
+  statAdd(&render->client_bytes, client_bytes);
+  statAdd(&render->requests, render->frame_requests);
+
+  render->bytes = 0;
+  render->frame_requests = 0;
+
+  if (++render->frames % 100 == 0) {
+    printf("render: %llu bytes of assets uploaded once\n", (unsigned long long)render->shared->uploaded);
+    statPrint(&render->requests, 1, "");
+    statPrint(&render->frame_bytes, 1024, "KiB");
+    statPrint(&render->client_bytes, 1024, "KiB");
+    printf("render: %.1fx fewer bytes than blending on the client\n",
+           statAvg(&render->client_bytes) / (statAvg(&render->frame_bytes) + 1));
+
+    statReset(&render->requests);
+    statReset(&render->frame_bytes);
+    statReset(&render->client_bytes);
+  }
+}
+
+#endif
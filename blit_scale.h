@@ -0,0 +1,407 @@
+#ifndef BLIT_SCALE_H
+#define BLIT_SCALE_H
+
+/*
+ * Scales a 32 bit surface to another size, nearest neighbour or bilinear
+ * Used to render at a fixed internal resolution and present at whatever size the window is
+ * The destination rows are split between worker threads, the calling thread does a share too
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blit_mem.h"
+#include "blit_sprite.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCALE_X86 1
+#endif
+
+#define SCALE_MAX_THREADS 16
+
+typedef enum {
+  SCALE_NEAREST,
+  SCALE_BILINEAR
+} scale_filter_t;
+
+typedef struct scaler scaler_t;
+
+typedef struct {
+  scaler_t *scaler;
+  pthread_t thread;
+  int index;
+} scale_worker_t;
+
+struct scaler {
+  scale_filter_t filter;
+  int threads; /* including the calling thread */
+  int use_avx2;
+
+  /* Source column (and weight of the column after it) for every destination column */
+  /* Rebuilt whenever the sizes change */
+  int *x0;
+  int *fx;
+  uint16_t *wx; /* fx as 16 bit lanes, 4 x (256 - fx) then 4 x fx, 16 byte aligned */
+  int src_width;
+  int dst_width;
+
+  /* Per thread row of vertically blended source pixels, 4 16 bit lanes each */
+  uint16_t *rows[SCALE_MAX_THREADS];
+
+  /* The job the workers are on */
+  const surface_t *src;
+  const surface_t *dst;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  uint64_t generation;
+  int pending;
+  int quit;
+
+  scale_worker_t workers[SCALE_MAX_THREADS];
+};
+
+#ifdef SCALE_X86
+__attribute__((target("avx2")))
+static inline int
+scaleRowNearestAVX2(uint32_t *d,
+                    const uint32_t *s,
+                    const int *x0,
+                    int width) {
+  /* 8 pixels per gather, returns how many were done */
+  int x = 0;
+
+  for (; x + 8 <= width; x += 8) {
+    __m256i index = _mm256_loadu_si256((const __m256i *)(x0 + x));
+    _mm256_storeu_si256((__m256i *)(d + x),
+                        _mm256_i32gather_epi32((const int *)s, index, 4));
+  }
+  return x;
+}
+#endif
+
+static inline void
+scaleRowsNearest(const scaler_t *scaler,
+                 const surface_t *src,
+                 const surface_t *dst,
+                 int y0,
+                 int y1) {
+  int prev_sy = -1;
+
+  for (int y = y0; y < y1; y++) {
+    int sy = (int)(((int64_t)y * src->height) / dst->height);
+    uint32_t *d = surfaceRow(dst, y);
+
+    /* Upscaling repeats source rows, just copy the row above */
+    if (sy == prev_sy) {
+      memcpy(d, surfaceRow(dst, y - 1), (size_t)dst->width * 4);
+      continue;
+    }
+    prev_sy = sy;
+
+    const uint32_t *s = surfaceRow(src, sy);
+    int x = 0;
+
+#ifdef SCALE_X86
+    if (scaler->use_avx2) {
+      x = scaleRowNearestAVX2(d, s, scaler->x0, dst->width);
+    }
+#endif
+
+    for (; x < dst->width; x++) {
+      d[x] = s[scaler->x0[x]];
+    }
+  }
+}
+
+static inline uint32_t
+lerpPixel(uint32_t a,
+          uint32_t b,
+          uint32_t f) {
+  /* f is 0-256, weight of b */
+  uint32_t rb = (((a & 0x00ff00ff) * (256 - f) + (b & 0x00ff00ff) * f) >> 8) & 0x00ff00ff;
+  uint32_t ag = ((((a >> 8) & 0x00ff00ff) * (256 - f) + ((b >> 8) & 0x00ff00ff) * f)) & 0xff00ff00;
+  return rb | ag;
+}
+
+static inline void
+scaleRowsBilinear(const scaler_t *scaler,
+                  int index,
+                  const surface_t *src,
+                  const surface_t *dst,
+                  int y0,
+                  int y1) {
+  for (int y = y0; y < y1; y++) {
+    /* Sample at pixel centers, 8 bits of fraction */
+    int64_t pos = (((int64_t)y * 2 + 1) * src->height * 256) / (dst->height * 2) - 128;
+    int sy = pos < 0 ? 0 : (int)(pos >> 8);
+    int fy = pos < 0 ? 0 : (int)(pos & 0xff);
+
+    if (sy >= src->height - 1) {
+      sy = src->height - 2;
+      fy = 256;
+    }
+
+    const uint32_t *r0 = surfaceRow(src, sy);
+    const uint32_t *r1 = surfaceRow(src, sy + 1);
+    uint32_t *d = surfaceRow(dst, y);
+    int x = 0;
+
+#ifdef SCALE_X86
+    /* Vertical pass over the source columns into 16 bit lanes, 2 pixels at a time */
+    __m128i zero = _mm_setzero_si128();
+    __m128i wy1 = _mm_set1_epi16((short)fy);
+    __m128i wy0 = _mm_set1_epi16((short)(256 - fy));
+    uint16_t *v = scaler->rows[index];
+    int sx = 0;
+
+    for (; sx + 2 <= src->width; sx += 2) {
+      __m128i p0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(r0 + sx)), zero);
+      __m128i p1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(r1 + sx)), zero);
+
+      /* The weights add up to 256 so this never overflows 16 bits */
+      _mm_storeu_si128((__m128i *)(v + sx * 4),
+                       _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(p0, wy0),
+                                                    _mm_mullo_epi16(p1, wy1)), 8));
+    }
+
+    for (; sx < src->width; sx++) {
+      uint32_t p = lerpPixel(r0[sx], r1[sx], (uint32_t)fy);
+
+      for (int c = 0; c < 4; c++) {
+        v[sx * 4 + c] = (p >> (c * 8)) & 0xff;
+      }
+    }
+
+    /* Then horizontal, the left pixel times (256 - fx) plus the right one times fx */
+    /* 4 pixels per iteration so the results can be packed and stored together */
+    const __m128i *wx = (const __m128i *)scaler->wx;
+
+    for (; x + 4 <= dst->width; x += 4) {
+      __m128i h0 = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)(v + scaler->x0[x] * 4)), wx[x]);
+      __m128i h1 = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)(v + scaler->x0[x + 1] * 4)), wx[x + 1]);
+      __m128i h2 = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)(v + scaler->x0[x + 2] * 4)), wx[x + 2]);
+      __m128i h3 = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)(v + scaler->x0[x + 3] * 4)), wx[x + 3]);
+
+      __m128i p01 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(h0, h1),
+                                                 _mm_unpackhi_epi64(h0, h1)), 8);
+      __m128i p23 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(h2, h3),
+                                                 _mm_unpackhi_epi64(h2, h3)), 8);
+
+      _mm_storeu_si128((__m128i *)(d + x), _mm_packus_epi16(p01, p23));
+    }
+
+    for (; x < dst->width; x++) {
+      __m128i h = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)(v + scaler->x0[x] * 4)),
+                                  _mm_load_si128((const __m128i *)scaler->wx + x));
+
+      h = _mm_srli_epi16(_mm_add_epi16(h, _mm_srli_si128(h, 8)), 8);
+      d[x] = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(h, zero));
+    }
+#else
+    for (; x < dst->width; x++) {
+      int sx = scaler->x0[x];
+      int fx = scaler->fx[x];
+
+      d[x] = lerpPixel(lerpPixel(r0[sx], r1[sx], (uint32_t)fy),
+                       lerpPixel(r0[sx + 1], r1[sx + 1], (uint32_t)fy),
+                       (uint32_t)fx);
+    }
+#endif
+  }
+}
+
+static inline void
+scaleBand(scaler_t *scaler,
+          int index) {
+  const surface_t *dst = scaler->dst;
+  int y0 = (int)(((int64_t)dst->height * index) / scaler->threads);
+  int y1 = (int)(((int64_t)dst->height * (index + 1)) / scaler->threads);
+
+  /* Bilinear needs 2x2 source pixels */
+  if (scaler->filter == SCALE_BILINEAR &&
+      scaler->src->width > 1 &&
+      scaler->src->height > 1) {
+    scaleRowsBilinear(scaler, index, scaler->src, dst, y0, y1);
+  }
+  else {
+    scaleRowsNearest(scaler, scaler->src, dst, y0, y1);
+  }
+}
+
+static void*
+scaleWorker(void *arg) {
+  scale_worker_t *worker = arg;
+  scaler_t *scaler = worker->scaler;
+  uint64_t seen = 0;
+
+  pthread_mutex_lock(&scaler->lock);
+
+  while (1) {
+    while (scaler->generation == seen && !scaler->quit) {
+      pthread_cond_wait(&scaler->start, &scaler->lock);
+    }
+
+    if (scaler->quit) {
+      break;
+    }
+    seen = scaler->generation;
+
+    pthread_mutex_unlock(&scaler->lock);
+    scaleBand(scaler, worker->index);
+    pthread_mutex_lock(&scaler->lock);
+
+    if (--scaler->pending == 0) {
+      pthread_cond_signal(&scaler->done);
+    }
+  }
+
+  pthread_mutex_unlock(&scaler->lock);
+  return NULL;
+}
+
+static inline scaler_t*
+allocScaler(scale_filter_t filter,
+            int threads) {
+  scaler_t *scaler = memCalloc(1, sizeof(scaler_t));
+
+  threads = threads < 1 ? 1 : threads;
+  threads = threads > SCALE_MAX_THREADS ? SCALE_MAX_THREADS : threads;
+
+  scaler->filter = filter;
+  scaler->threads = threads;
+
+#ifdef SCALE_X86
+  __builtin_cpu_init();
+  scaler->use_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+  pthread_mutex_init(&scaler->lock, NULL);
+  pthread_cond_init(&scaler->start, NULL);
+  pthread_cond_init(&scaler->done, NULL);
+
+  /* Worker 0 is the calling thread */
+  for (int i = 1; i < threads; i++) {
+    scaler->workers[i].scaler = scaler;
+    scaler->workers[i].index = i;
+
+    if (pthread_create(&scaler->workers[i].thread, NULL, scaleWorker, &scaler->workers[i]) != 0) {
+      fprintf(stderr, "Could not start scaler thread %d\n", i);
+      scaler->threads = i;
+      break;
+    }
+  }
+
+  return scaler;
+}
+
+static inline void
+scalerColumns(scaler_t *scaler,
+              int src_width,
+              int dst_width) {
+  if (src_width == scaler->src_width && dst_width == scaler->dst_width) {
+    return;
+  }
+
+  memFree(scaler->x0);
+  memFree(scaler->fx);
+  memFree(scaler->wx);
+  scaler->x0 = memAlloc(sizeof(int) * dst_width);
+  scaler->fx = memAlloc(sizeof(int) * dst_width);
+  /* memAlloc keeps malloc's 16 byte alignment, that's all the SSE2 loads need */
+  scaler->wx = memAlloc(sizeof(uint16_t) * 8 * dst_width);
+
+  for (int i = 0; i < scaler->threads; i++) {
+    memFree(scaler->rows[i]);
+    scaler->rows[i] = memAlloc(sizeof(uint16_t) * 4 * (src_width + 1));
+  }
+
+  for (int x = 0; x < dst_width; x++) {
+    if (scaler->filter == SCALE_NEAREST || src_width < 2) {
+      scaler->x0[x] = (int)(((int64_t)x * src_width) / dst_width);
+      scaler->fx[x] = 0;
+      continue;
+    }
+
+    int64_t pos = (((int64_t)x * 2 + 1) * src_width * 256) / ((int64_t)dst_width * 2) - 128;
+    int sx = pos < 0 ? 0 : (int)(pos >> 8);
+    int fx = pos < 0 ? 0 : (int)(pos & 0xff);
+
+    /* Always read two columns, so the last one has to lean all the way right */
+    if (sx >= src_width - 1) {
+      sx = src_width - 2;
+      fx = 256;
+    }
+
+    scaler->x0[x] = sx;
+    scaler->fx[x] = fx;
+
+    for (int c = 0; c < 4; c++) {
+      scaler->wx[x * 8 + c] = (uint16_t)(256 - fx);
+      scaler->wx[x * 8 + 4 + c] = (uint16_t)fx;
+    }
+  }
+
+  scaler->src_width = src_width;
+  scaler->dst_width = dst_width;
+}
+
+static inline void
+scaleSurface(scaler_t *scaler,
+             const surface_t *src,
+             const surface_t *dst) {
+  /* Blocks until the whole destination is written */
+  scalerColumns(scaler, src->width, dst->width);
+
+  pthread_mutex_lock(&scaler->lock);
+  scaler->src = src;
+  scaler->dst = dst;
+  scaler->pending = scaler->threads - 1;
+  scaler->generation++;
+  pthread_cond_broadcast(&scaler->start);
+  pthread_mutex_unlock(&scaler->lock);
+
+  scaleBand(scaler, 0);
+
+  pthread_mutex_lock(&scaler->lock);
+  while (scaler->pending > 0) {
+    pthread_cond_wait(&scaler->done, &scaler->lock);
+  }
+  pthread_mutex_unlock(&scaler->lock);
+}
+
+static inline void
+freeScaler(scaler_t *scaler) {
+  if (scaler == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&scaler->lock);
+  scaler->quit = 1;
+  pthread_cond_broadcast(&scaler->start);
+  pthread_mutex_unlock(&scaler->lock);
+
+  for (int i = 1; i < scaler->threads; i++) {
+    pthread_join(scaler->workers[i].thread, NULL);
+  }
+
+  pthread_mutex_destroy(&scaler->lock);
+  pthread_cond_destroy(&scaler->start);
+  pthread_cond_destroy(&scaler->done);
+
+  for (int i = 0; i < scaler->threads; i++) {
+    memFree(scaler->rows[i]);
+  }
+
+  memFree(scaler->x0);
+  memFree(scaler->fx);
+  memFree(scaler->wx);
+  memFree(scaler);
+}
+
+#endif
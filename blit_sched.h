@@ -0,0 +1,210 @@
+#ifndef BLIT_SCHED_H
+#define BLIT_SCHED_H
+
+/*
+ * Frame budget scheduler
+ * Keeps a moving average of how long a frame takes to render and compares it to the budget,
+ * 1/BLIT_FPS seconds (60 if it isn't set)
+ * Over budget it steps down a quality level, under budget for long enough it steps back up
+ *   0 = everything
+ *   1 = skip passes that aren't needed to show the frame (e.g. mirroring to a viewer)
+ *   2 = render at 75% resolution and scale up
+ *   3 = render at 50% resolution and scale up
+ * Frames are paced against deadlines instead of a fixed sleep, and when a frame runs so long
+ * that the next slots are already gone they are dropped instead of rendered late
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blit_stats.h"
+
+#define SCHED_LEVELS 4
+#define SCHED_DOWN_FRAMES 5 /* over budget this many frames in a row before stepping down */
+#define SCHED_UP_FRAMES 60 /* under the headroom this many frames before stepping back up */
+#define SCHED_HEADROOM 0.6 /* fraction of the budget a frame has to fit in to step up */
+#define SCHED_OVER 0.9 /* fraction of the budget that counts as over */
+
+typedef struct {
+  uint64_t budget; /* ns per frame */
+  uint64_t deadline; /* when the current frame should be done */
+  double estimate; /* moving average of the render time, ns */
+  double alpha; /* weight of the newest sample */
+
+  int level;
+  int fresh; /* the level just changed, the old estimate says nothing about the new one */
+  int over; /* frames in a row over budget */
+  int under; /* frames in a row with headroom */
+  int up_frames; /* grows every time stepping up didn't last */
+  uint64_t stepped_up; /* frame the last step up happened on */
+
+  uint64_t frames;
+  uint64_t dropped;
+  uint64_t changes;
+  stat_t render;
+} sched_t;
+
+static inline sched_t
+frameSched(void) {
+  sched_t sched;
+  memset(&sched, 0, sizeof(sched));
+
+  double fps = getenv("BLIT_FPS") != NULL ? atof(getenv("BLIT_FPS")) : 60.0;
+
+  sched.budget = (uint64_t)(1e9 / (fps > 0 ? fps : 60.0));
+  sched.alpha = 0.1;
+  sched.up_frames = SCHED_UP_FRAMES;
+  sched.render = newStat("render");
+
+  printf("Frame budget is %.2fms\n", sched.budget / 1e6);
+
+  return sched;
+}
+
+static inline int
+schedPasses(const sched_t *sched) {
+  /* 1 if optional passes should run this frame */
+  return sched->level < 1;
+}
+
+static inline int
+levelScale(int level) {
+  /* Percentage of the full resolution each level renders at */
+  static const int scales[SCHED_LEVELS] = {100, 100, 75, 50};
+  return scales[level];
+}
+
+static inline int
+schedScale(const sched_t *sched) {
+  return levelScale(sched->level);
+}
+
+static inline int
+schedBegin(sched_t *sched) {
+  /* Call before rendering, returns how many frames were dropped to catch up */
+  uint64_t now = getTimeNs();
+
+  if (sched->deadline == 0) {
+    sched->deadline = now + sched->budget;
+    return 0;
+  }
+
+  /* Still inside this frame's slot, or only just behind it */
+  if (now < sched->deadline + sched->budget) {
+    return 0;
+  }
+
+  /* Whole slots went by, skip them rather than render each one late */
+  uint64_t missed = (now - sched->deadline) / sched->budget;
+
+  sched->deadline += missed * sched->budget;
+  sched->dropped += missed;
+
+  return (int)missed;
+}
+
+static inline void
+schedLevel(sched_t *sched,
+           int level,
+           const char *why) {
+  printf("sched: %s, level %d -> %d (%d%% resolution, passes %s), estimate %.2fms\n",
+         why,
+         sched->level,
+         level,
+         levelScale(level),
+         level < 1 ? "on" : "off",
+         sched->estimate / 1e6);
+
+  sched->level = level;
+  sched->fresh = 1;
+  sched->over = 0;
+  sched->under = 0;
+  sched->changes++;
+}
+
+static inline void
+schedEnd(sched_t *sched,
+         uint64_t render_time) {
+  /* Call with how long the frame took to render, before schedWait */
+  statAdd(&sched->render, render_time);
+
+  sched->estimate = sched->frames == 0 || sched->fresh ? (double)render_time
+                  : sched->alpha * render_time + (1 - sched->alpha) * sched->estimate;
+  sched->frames++;
+  sched->fresh = 0;
+
+  if (sched->estimate > sched->budget * SCHED_OVER) {
+    sched->over++;
+    sched->under = 0;
+  }
+  else if (sched->estimate < sched->budget * SCHED_HEADROOM) {
+    sched->under++;
+    sched->over = 0;
+  }
+  else {
+    sched->over = 0;
+    sched->under = 0;
+  }
+
+  if (sched->over >= SCHED_DOWN_FRAMES && sched->level < SCHED_LEVELS - 1) {
+    /* Stepping up didn't last, wait twice as long before trying again */
+    if (sched->stepped_up > 0 && sched->frames - sched->stepped_up < (uint64_t)sched->up_frames) {
+      sched->up_frames = sched->up_frames * 2 > 3600 ? 3600 : sched->up_frames * 2;
+    }
+    schedLevel(sched, sched->level + 1, "over budget");
+  }
+  else if (sched->under >= sched->up_frames && sched->level > 0) {
+    schedLevel(sched, sched->level - 1, "headroom");
+    sched->stepped_up = sched->frames;
+  }
+
+  if (sched->frames % 100 == 0) {
+    printf("sched: estimate %.2fms of %.2fms, level %d, %llu dropped, %llu changes\n",
+           sched->estimate / 1e6,
+           sched->budget / 1e6,
+           sched->level,
+           (unsigned long long)sched->dropped,
+           (unsigned long long)sched->changes);
+    statPrint(&sched->render, 1e6, "ms");
+    statReset(&sched->render);
+  }
+}
+
+static inline void
+schedWait(sched_t *sched) {
+  /* Sleeps until this frame's deadline, then moves on to the next slot */
+  struct timespec t;
+
+  if (getTimeNs() < sched->deadline) {
+    t.tv_sec = (time_t)(sched->deadline / 1000000000ull);
+    t.tv_nsec = (long)(sched->deadline % 1000000000ull);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+  }
+  sched->deadline += sched->budget;
+}
+
+static inline void
+schedRefresh(sched_t *sched,
+             uint64_t refresh) {
+  /* The display's refresh period becomes the budget, unless it isn't known or BLIT_FPS set one */
+  if (refresh == 0 || refresh == sched->budget || getenv("BLIT_FPS") != NULL) {
+    return;
+  }
+
+  printf("sched: budget %.2fms -> %.2fms to match the display\n", sched->budget / 1e6, refresh / 1e6);
+
+  sched->budget = refresh;
+  sched->deadline = 0;
+}
+
+static inline void
+schedFollow(sched_t *sched) {
+  /* Instead of schedWait when something else paces the frames, e.g. the compositor */
+  /* The next schedBegin starts a fresh slot rather than counting the gap as dropped frames */
+  sched->deadline = 0;
+}
+
+#endif
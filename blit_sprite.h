@@ -0,0 +1,454 @@
+#ifndef BLIT_SPRITE_H
+#define BLIT_SPRITE_H
+
+/*
+ * Rectangle blits from a sprite atlas into a 32 bit surface (the cairo image backbuffer)
+ * Pixels are cairo's ARGB32, i.e. premultiplied alpha in native endian uint32_t
+ * Every blit is clipped against the destination, and can use the per pixel alpha,
+ * a color key and a global opacity, or a tint for white alpha masks like glyphs
+ * Batches can be sorted by destination tile first so neighbouring sprites are drawn together
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blit_mem.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define SPRITE_SSE2 1
+#endif
+
+#define BLIT_ALPHA 1 /* blend with the source alpha, otherwise the source is treated as opaque */
+#define BLIT_COLORKEY 2 /* skip source pixels whose RGB equals colorkey */
+#define BLIT_TINT 4 /* multiply each channel by tint instead of all of them by opacity */
+
+typedef struct {
+  uint32_t *pixels;
+  int width;
+  int height;
+  int stride; /* in bytes */
+} surface_t;
+
+typedef struct {
+  const surface_t *atlas;
+  int src_x;
+  int src_y;
+  int width;
+  int height;
+  int dst_x;
+  int dst_y;
+  uint32_t colorkey;
+  uint8_t flags;
+  uint8_t opacity; /* 255 = as is */
+  uint32_t tint; /* premultiplied, only with BLIT_TINT */
+} blit_t;
+
+typedef struct {
+  blit_t *blits;
+  size_t count;
+  size_t cap;
+
+  /* Scratch space for sorting */
+  uint32_t *keys;
+  uint32_t *order;
+  uint32_t *tmp;
+  size_t sort_cap;
+} blit_batch_t;
+
+static inline surface_t
+surface(uint32_t *pixels,
+        int width,
+        int height,
+        int stride) {
+  surface_t s;
+  s.pixels = pixels;
+  s.width = width;
+  s.height = height;
+  s.stride = stride;
+  return s;
+}
+
+static inline uint32_t*
+surfaceRow(const surface_t *s,
+           int y) {
+  return (uint32_t *)((uint8_t *)s->pixels + (size_t)y * s->stride);
+}
+
+static inline blit_t
+blit(const surface_t *atlas,
+     int src_x,
+     int src_y,
+     int width,
+     int height,
+     int dst_x,
+     int dst_y) {
+  /* An opaque copy, set flags/opacity/colorkey afterwards for anything else */
+  blit_t b;
+  b.atlas = atlas;
+  b.src_x = src_x;
+  b.src_y = src_y;
+  b.width = width;
+  b.height = height;
+  b.dst_x = dst_x;
+  b.dst_y = dst_y;
+  b.colorkey = 0;
+  b.flags = 0;
+  b.opacity = 255;
+  b.tint = 0xffffffff;
+  return b;
+}
+
+static inline int
+clipBlit(const surface_t *dst,
+         blit_t *b) {
+  /* Clips against both the atlas and the destination, returns 0 if nothing is left */
+  if (b->src_x < 0) {
+    b->dst_x -= b->src_x;
+    b->width += b->src_x;
+    b->src_x = 0;
+  }
+  if (b->src_y < 0) {
+    b->dst_y -= b->src_y;
+    b->height += b->src_y;
+    b->src_y = 0;
+  }
+  if (b->dst_x < 0) {
+    b->src_x -= b->dst_x;
+    b->width += b->dst_x;
+    b->dst_x = 0;
+  }
+  if (b->dst_y < 0) {
+    b->src_y -= b->dst_y;
+    b->height += b->dst_y;
+    b->dst_y = 0;
+  }
+  if (b->src_x + b->width > b->atlas->width) {
+    b->width = b->atlas->width - b->src_x;
+  }
+  if (b->src_y + b->height > b->atlas->height) {
+    b->height = b->atlas->height - b->src_y;
+  }
+  if (b->dst_x + b->width > dst->width) {
+    b->width = dst->width - b->dst_x;
+  }
+  if (b->dst_y + b->height > dst->height) {
+    b->height = dst->height - b->dst_y;
+  }
+
+  return b->width > 0 && b->height > 0;
+}
+
+static inline uint32_t
+mulDiv255(uint32_t x,
+          uint32_t y) {
+  /* x * y / 255, rounded */
+  uint32_t t = x * y + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+static inline uint32_t
+overPixel(uint32_t s,
+          uint32_t d,
+          uint32_t opacity) {
+  /* Premultiplied source over destination, with the source scaled by opacity first */
+  if (opacity != 255) {
+    s = mulDiv255(s & 0xff, opacity) |
+        mulDiv255((s >> 8) & 0xff, opacity) << 8 |
+        mulDiv255((s >> 16) & 0xff, opacity) << 16 |
+        mulDiv255(s >> 24, opacity) << 24;
+  }
+
+  uint32_t inv = 255 - (s >> 24);
+
+  return s +
+         (mulDiv255(d & 0xff, inv) |
+          mulDiv255((d >> 8) & 0xff, inv) << 8 |
+          mulDiv255((d >> 16) & 0xff, inv) << 16 |
+          mulDiv255(d >> 24, inv) << 24);
+}
+
+static inline uint32_t
+sourcePixel(uint32_t s,
+            uint8_t flags,
+            uint32_t colorkey) {
+  /* Applies the color key and the opaque flag, so everything after is a plain over */
+  if ((flags & BLIT_COLORKEY) && (s & 0x00ffffff) == colorkey) {
+    return 0;
+  }
+  if (!(flags & BLIT_ALPHA)) {
+    return s | 0xff000000;
+  }
+  return s;
+}
+
+static inline uint32_t
+tintPixel(uint32_t s,
+          uint32_t tint) {
+  /* A white mask pixel (a, a, a, a) becomes the tint color at coverage a */
+  return mulDiv255(s & 0xff, tint & 0xff) |
+         mulDiv255((s >> 8) & 0xff, (tint >> 8) & 0xff) << 8 |
+         mulDiv255((s >> 16) & 0xff, (tint >> 16) & 0xff) << 16 |
+         mulDiv255(s >> 24, tint >> 24) << 24;
+}
+
+static inline void
+blitRowScalar(uint32_t *d,
+              const uint32_t *s,
+              int n,
+              uint8_t flags,
+              uint32_t colorkey,
+              uint32_t opacity,
+              uint32_t tint) {
+  if (flags & BLIT_TINT) {
+    for (int i = 0; i < n; i++) {
+      d[i] = overPixel(tintPixel(sourcePixel(s[i], flags, colorkey), tint), d[i], 255);
+    }
+    return;
+  }
+
+  for (int i = 0; i < n; i++) {
+    d[i] = overPixel(sourcePixel(s[i], flags, colorkey), d[i], opacity);
+  }
+}
+
+#ifdef SPRITE_SSE2
+static inline __m128i
+div255Epi16(__m128i x) {
+  /* Same rounding as mulDiv255, on 8 16 bit lanes */
+  x = _mm_add_epi16(x, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+static inline __m128i
+over4(__m128i s,
+      __m128i d,
+      __m128i opacity) {
+  __m128i zero = _mm_setzero_si128();
+
+  __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+  __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+  __m128i d_lo = _mm_unpacklo_epi8(d, zero);
+  __m128i d_hi = _mm_unpackhi_epi8(d, zero);
+
+  s_lo = div255Epi16(_mm_mullo_epi16(s_lo, opacity));
+  s_hi = div255Epi16(_mm_mullo_epi16(s_hi, opacity));
+
+  /* Broadcast each pixel's alpha to its 4 lanes */
+  __m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, _MM_SHUFFLE(3, 3, 3, 3)),
+                                     _MM_SHUFFLE(3, 3, 3, 3));
+  __m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, _MM_SHUFFLE(3, 3, 3, 3)),
+                                     _MM_SHUFFLE(3, 3, 3, 3));
+
+  __m128i inv = _mm_set1_epi16(255);
+
+  d_lo = div255Epi16(_mm_mullo_epi16(d_lo, _mm_sub_epi16(inv, a_lo)));
+  d_hi = div255Epi16(_mm_mullo_epi16(d_hi, _mm_sub_epi16(inv, a_hi)));
+
+  return _mm_packus_epi16(_mm_add_epi16(s_lo, d_lo),
+                          _mm_add_epi16(s_hi, d_hi));
+}
+
+static inline void
+blitRowSSE2(uint32_t *d,
+            const uint32_t *s,
+            int n,
+            uint8_t flags,
+            uint32_t colorkey,
+            uint32_t opacity,
+            uint32_t tint) {
+  __m128i key = _mm_set1_epi32((int)colorkey);
+  __m128i rgb = _mm_set1_epi32(0x00ffffff);
+  __m128i alpha = _mm_set1_epi32((int)0xff000000);
+  __m128i op = _mm_set1_epi16((short)opacity);
+
+  /* over4 scales by 16 bit lanes, so a tint is just a different opacity per channel */
+  if (flags & BLIT_TINT) {
+    op = _mm_unpacklo_epi8(_mm_set1_epi32((int)tint), _mm_setzero_si128());
+  }
+
+  int i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m128i sp = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i dp = _mm_loadu_si128((const __m128i *)(d + i));
+    __m128i keyed = _mm_setzero_si128();
+
+    if (flags & BLIT_COLORKEY) {
+      keyed = _mm_cmpeq_epi32(_mm_and_si128(sp, rgb), key);
+    }
+
+    if (!(flags & BLIT_ALPHA)) {
+      sp = _mm_or_si128(sp, alpha);
+
+      /* Opaque and not faded, so keyed pixels just keep the destination */
+      if (opacity == 255 && !(flags & BLIT_TINT)) {
+        _mm_storeu_si128((__m128i *)(d + i),
+                         _mm_or_si128(_mm_and_si128(keyed, dp),
+                                      _mm_andnot_si128(keyed, sp)));
+        continue;
+      }
+    }
+
+    sp = _mm_andnot_si128(keyed, sp);
+    _mm_storeu_si128((__m128i *)(d + i), over4(sp, dp, op));
+  }
+
+  blitRowScalar(d + i, s + i, n - i, flags, colorkey, opacity, tint);
+}
+#endif
+
+static inline void
+blitRect(const surface_t *dst,
+         blit_t b) {
+  /* One blit, clipped */
+  if (!clipBlit(dst, &b)) {
+    return;
+  }
+
+  uint32_t colorkey = b.colorkey & 0x00ffffff;
+
+  for (int y = 0; y < b.height; y++) {
+    uint32_t *d = surfaceRow(dst, b.dst_y + y) + b.dst_x;
+    const uint32_t *s = surfaceRow(b.atlas, b.src_y + y) + b.src_x;
+
+    /* Plain copy */
+    if (b.flags == 0 && b.opacity == 255) {
+      memcpy(d, s, (size_t)b.width * 4);
+      continue;
+    }
+
+#ifdef SPRITE_SSE2
+    blitRowSSE2(d, s, b.width, b.flags, colorkey, b.opacity, b.tint);
+#else
+    blitRowScalar(d, s, b.width, b.flags, colorkey, b.opacity, b.tint);
+#endif
+  }
+}
+
+static inline surface_t
+genAtlas(int size) {
+  /* 8x8 premultiplied circles of size pixels, each a different color, free with memFree */
+  surface_t atlas = surface(memAlloc((size_t)size * size * 64 * 4), size * 8, size * 8, size * 8 * 4);
+
+  for (int y = 0; y < atlas.height; y++) {
+    uint32_t *row = surfaceRow(&atlas, y);
+
+    for (int x = 0; x < atlas.width; x++) {
+      int cx = x % size - size / 2;
+      int cy = y % size - size / 2;
+      uint32_t a = cx * cx + cy * cy < (size / 2) * (size / 2) ? 200 : 0;
+      uint32_t sprite = (uint32_t)((y / size) * 8 + x / size);
+
+      row[x] = a << 24 |
+               mulDiv255((sprite * 37) & 0xff, a) << 16 |
+               mulDiv255((sprite * 91) & 0xff, a) << 8 |
+               mulDiv255((sprite * 53) & 0xff, a);
+    }
+  }
+  return atlas;
+}
+
+static inline void
+blitBatchAdd(blit_batch_t *batch,
+             blit_t b) {
+  if (batch->count == batch->cap) {
+    batch->cap = batch->cap ? batch->cap * 2 : 1024;
+    batch->blits = memRealloc(batch->blits, batch->cap * sizeof(blit_t));
+  }
+  batch->blits[batch->count++] = b;
+}
+
+static inline void
+blitBatchClear(blit_batch_t *batch) {
+  batch->count = 0;
+}
+
+static inline void
+blitBatchFree(blit_batch_t *batch) {
+  memFree(batch->blits);
+  memFree(batch->keys);
+  memFree(batch->order);
+  memFree(batch->tmp);
+  memset(batch, 0, sizeof(blit_batch_t));
+}
+
+static inline uint32_t
+blitSortKey(const blit_t *b) {
+  /* Destination 64x64 tile first (row, then column), then the atlas row the sprite comes from */
+  uint32_t ty = (uint32_t)(b->dst_y < 0 ? 0 : b->dst_y) >> 6;
+  uint32_t tx = (uint32_t)(b->dst_x < 0 ? 0 : b->dst_x) >> 6;
+  uint32_t sy = (uint32_t)(b->src_y < 0 ? 0 : b->src_y) >> 4;
+
+  return (ty < 2047 ? ty : 2047) << 21 |
+         (tx < 2047 ? tx : 2047) << 10 |
+         (sy < 1023 ? sy : 1023);
+}
+
+static inline void
+blitBatchSort(blit_batch_t *batch) {
+  /* Stable radix sort of the indices, two 16 bit passes */
+  /* Stable, so blits that end up with the same key keep their order */
+  size_t n = batch->count;
+
+  if (n > batch->sort_cap) {
+    batch->sort_cap = n;
+    batch->keys = memRealloc(batch->keys, n * sizeof(uint32_t));
+    batch->order = memRealloc(batch->order, n * sizeof(uint32_t));
+    batch->tmp = memRealloc(batch->tmp, n * sizeof(uint32_t));
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    batch->keys[i] = blitSortKey(&batch->blits[i]);
+    batch->order[i] = (uint32_t)i;
+  }
+
+  static size_t counts[65536];
+
+  for (int shift = 0; shift < 32; shift += 16) {
+    memset(counts, 0, sizeof(counts));
+
+    for (size_t i = 0; i < n; i++) {
+      counts[(batch->keys[batch->order[i]] >> shift) & 0xffff]++;
+    }
+
+    size_t total = 0;
+
+    for (size_t k = 0; k < 65536; k++) {
+      size_t c = counts[k];
+      counts[k] = total;
+      total += c;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      uint32_t index = batch->order[i];
+      batch->tmp[counts[(batch->keys[index] >> shift) & 0xffff]++] = index;
+    }
+
+    uint32_t *swap = batch->order;
+    batch->order = batch->tmp;
+    batch->tmp = swap;
+  }
+}
+
+static inline void
+blitBatchRun(const surface_t *dst,
+             blit_batch_t *batch,
+             int sort) {
+  /* Only sort when the draw order doesn't matter, i.e. blended sprites don't overlap */
+  if (!sort) {
+    for (size_t i = 0; i < batch->count; i++) {
+      blitRect(dst, batch->blits[i]);
+    }
+    return;
+  }
+
+  blitBatchSort(batch);
+
+  for (size_t i = 0; i < batch->count; i++) {
+    blitRect(dst, batch->blits[batch->order[i]]);
+  }
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef BLIT_STATS_H
+#define BLIT_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Small helpers for timing things and printing running numbers */
+/* Everything is header only so each program can still be built with ./build.sh file.c */
+
+typedef struct {
+  const char *name;
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+} stat_t;
+
+static inline uint64_t
+getTimeNs(void) {
+  /* CLOCK_MONOTONIC is shared between processes on the same machine */
+  /* So timestamps taken here can be compared across the socket */
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ull + (uint64_t)t.tv_nsec;
+}
+
+static inline stat_t
+newStat(const char *name) {
+  stat_t s;
+  s.name = name;
+  s.count = 0;
+  s.sum = 0;
+  s.min = UINT64_MAX;
+  s.max = 0;
+  return s;
+}
+
+static inline void
+statAdd(stat_t *s,
+        uint64_t value) {
+  s->count++;
+  s->sum += value;
+
+  if (value < s->min) {
+    s->min = value;
+  }
+  if (value > s->max) {
+    s->max = value;
+  }
+}
+
+static inline double
+statAvg(const stat_t *s) {
+  return s->count ? (double)s->sum / (double)s->count : 0.0;
+}
+
+static inline void
+statPrint(const stat_t *s,
+          double scale,
+          const char *unit) {
+  /* scale is used to turn e.g. nanoseconds into microseconds */
+  if (s->count == 0) {
+    printf("%s: no samples\n", s->name);
+    return;
+  }
+
+  printf("%s: avg = %.2f%s, min = %.2f%s, max = %.2f%s (n = %llu)\n",
+         s->name,
+         statAvg(s) / scale, unit,
+         (double)s->min / scale, unit,
+         (double)s->max / scale, unit,
+         (unsigned long long)s->count);
+}
+
+static inline void
+statReset(stat_t *s) {
+  *s = newStat(s->name);
+}
+
+#endif
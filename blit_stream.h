@@ -0,0 +1,438 @@
+#ifndef BLIT_STREAM_H
+#define BLIT_STREAM_H
+
+/*
+ * Streams presented frames to another local process over a unix socket
+ * Only tiles that changed since the last frame the viewer got are sent, each one RLE compressed
+ * If the viewer can't keep up, whole frames are dropped instead of queueing them up
+ * See blit_viewer.c for the other end
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "blit_diff.h"
+#include "blit_mem.h"
+#include "blit_stats.h"
+
+#define STREAM_MAGIC 0x534c4258 /* "XBLS" */
+#define STREAM_TILE DIFF_TILE
+
+/* Worst case for a tile is all literals, one control byte per 128 pixels */
+#define STREAM_TILE_MAX_ENCODED (STREAM_TILE*STREAM_TILE*4 + (STREAM_TILE*STREAM_TILE)/128 + 1)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t frame;
+  uint64_t timestamp; /* getTimeNs() when the frame was presented */
+  uint16_t width;
+  uint16_t height;
+  uint16_t tile_size;
+  uint16_t tiles; /* number of tile records that follow */
+  uint32_t length; /* payload bytes that follow this header */
+  uint32_t reserved;
+} stream_frame_t;
+
+typedef struct {
+  uint16_t x; /* tile column */
+  uint16_t y; /* tile row */
+  uint32_t length; /* encoded bytes that follow */
+} stream_tile_t;
+
+typedef struct {
+  int listen_fd;
+  int client_fd;
+  char path[108];
+
+  /* What the viewer currently has, used to find the changed tiles */
+  uint8_t *prev;
+  dirty_map_t dirty;
+  row_differs_fn differs;
+  uint16_t width;
+  uint16_t height;
+  int stride;
+  int keyframe;
+
+  /* Encoded frame that is (partially) waiting to go out */
+  uint8_t *out;
+  size_t out_cap;
+  size_t out_len;
+  size_t out_sent;
+
+  uint64_t presented;
+  uint64_t sent;
+  uint64_t dropped;
+
+  stat_t encode_time;
+  stat_t frame_bytes;
+  stat_t frame_tiles;
+} stream_server_t;
+
+static inline size_t
+rleEncode(const uint32_t *pixels,
+          size_t n,
+          uint8_t *out) {
+  /* Control byte with the high bit set = repeat the next pixel (c & 0x7f) + 1 times */
+  /* Otherwise = c + 1 literal pixels follow */
+  size_t i = 0;
+  size_t o = 0;
+
+  while (i < n) {
+    size_t run = 1;
+
+    while (i + run < n && run < 128 && pixels[i + run] == pixels[i]) {
+      run++;
+    }
+
+    if (run >= 2) {
+      out[o++] = (uint8_t)(0x80 | (run - 1));
+      memcpy(out + o, &pixels[i], 4);
+      o += 4;
+      i += run;
+      continue;
+    }
+
+    /* Keep going until the next repeat starts */
+    size_t lit = 1;
+
+    while (i + lit < n &&
+           lit < 128 &&
+           !(i + lit + 1 < n && pixels[i + lit] == pixels[i + lit + 1])) {
+      lit++;
+    }
+
+    out[o++] = (uint8_t)(lit - 1);
+    memcpy(out + o, &pixels[i], lit * 4);
+    o += lit * 4;
+    i += lit;
+  }
+
+  return o;
+}
+
+static inline int
+rleDecode(const uint8_t *in,
+          size_t length,
+          uint32_t *pixels,
+          size_t n) {
+  /* Returns -1 if the data doesn't decode to exactly n pixels */
+  size_t i = 0;
+  size_t o = 0;
+
+  while (i < length) {
+    uint8_t c = in[i++];
+    size_t count = (size_t)(c & 0x7f) + 1;
+
+    if (o + count > n) {
+      return -1;
+    }
+
+    if (c & 0x80) {
+      uint32_t pixel;
+
+      if (i + 4 > length) {
+        return -1;
+      }
+      memcpy(&pixel, in + i, 4);
+      i += 4;
+
+      for (size_t k = 0; k < count; k++) {
+        pixels[o++] = pixel;
+      }
+    }
+    else {
+      if (i + count * 4 > length) {
+        return -1;
+      }
+      memcpy(pixels + o, in + i, count * 4);
+      i += count * 4;
+      o += count;
+    }
+  }
+
+  return o == n ? 0 : -1;
+}
+
+static inline void
+streamResize(stream_server_t *server,
+             uint16_t width,
+             uint16_t height,
+             int stride) {
+  size_t tiles = (size_t)((width + STREAM_TILE - 1) / STREAM_TILE) *
+                 (size_t)((height + STREAM_TILE - 1) / STREAM_TILE);
+
+  memFree(server->prev);
+  memFree(server->out);
+  dirtyMapFree(&server->dirty);
+
+  server->prev = memCalloc((size_t)stride * height, 1);
+  server->out_cap = sizeof(stream_frame_t) +
+                    tiles * (sizeof(stream_tile_t) + STREAM_TILE_MAX_ENCODED);
+  server->out = memAlloc(server->out_cap);
+  dirtyMapAlloc(&server->dirty, width, height);
+
+  if (server->prev == NULL || server->out == NULL || server->dirty.bits == NULL) {
+    fprintf(stderr, "Could not allocate the stream buffers\n");
+    exit(1);
+  }
+
+  server->width = width;
+  server->height = height;
+  server->stride = stride;
+  server->keyframe = 1;
+  server->out_len = 0;
+  server->out_sent = 0;
+}
+
+static inline stream_server_t*
+streamServerOpen(const char *path) {
+  /* Returns NULL if the socket can't be set up, the caller just runs without streaming then */
+  struct sockaddr_un addr;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Stream socket path too long: %s\n", path);
+    return NULL;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+  if (fd < 0) {
+    perror("socket");
+    return NULL;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  /* Left over from a previous run */
+  unlink(path);
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+    perror("bind/listen");
+    close(fd);
+    return NULL;
+  }
+
+  stream_server_t *server = memCalloc(1, sizeof(stream_server_t));
+
+  if (server == NULL) {
+    close(fd);
+    return NULL;
+  }
+
+  server->listen_fd = fd;
+  server->client_fd = -1;
+  server->differs = getRowDiffer();
+  strcpy(server->path, path);
+
+  server->encode_time = newStat("Stream encode");
+  server->frame_bytes = newStat("Stream frame size");
+  server->frame_tiles = newStat("Stream tiles per frame");
+
+  printf("Streaming frames on %s\n", path);
+
+  return server;
+}
+
+static inline void
+streamDisconnect(stream_server_t *server) {
+  close(server->client_fd);
+  server->client_fd = -1;
+  server->out_len = 0;
+  server->out_sent = 0;
+  printf("Stream viewer disconnected\n");
+}
+
+static inline int
+streamFlush(stream_server_t *server) {
+  /* Returns 1 once the pending frame is completely written */
+  while (server->out_sent < server->out_len) {
+    ssize_t n = send(server->client_fd,
+                     server->out + server->out_sent,
+                     server->out_len - server->out_sent,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      streamDisconnect(server);
+      return 0;
+    }
+    server->out_sent += (size_t)n;
+  }
+  return 1;
+}
+
+static inline void
+streamReport(stream_server_t *server) {
+  printf("Stream: %llu presented, %llu sent, %llu dropped\n",
+         (unsigned long long)server->presented,
+         (unsigned long long)server->sent,
+         (unsigned long long)server->dropped);
+
+  statPrint(&server->encode_time, 1000.0, "us");
+  statPrint(&server->frame_bytes, 1024.0, "KiB");
+  statPrint(&server->frame_tiles, 1.0, "");
+
+  statReset(&server->encode_time);
+  statReset(&server->frame_bytes);
+  statReset(&server->frame_tiles);
+}
+
+static inline void
+streamEncode(stream_server_t *server,
+             const uint8_t *data) {
+  static uint32_t pixels[STREAM_TILE*STREAM_TILE];
+
+  uint64_t start = getTimeNs();
+
+  stream_frame_t header;
+  size_t o = sizeof(header);
+  uint16_t tiles = 0;
+
+  if (server->keyframe) {
+    dirtyMapFill(&server->dirty);
+  }
+  else {
+    diffFrame(server->differs,
+              data,
+              server->prev,
+              server->stride,
+              server->width,
+              server->height,
+              &server->dirty);
+  }
+
+  for (int y = 0; y < server->height; y += STREAM_TILE) {
+    int h = server->height - y < STREAM_TILE ? server->height - y : STREAM_TILE;
+
+    for (int x = 0; x < server->width; x += STREAM_TILE) {
+      int w = server->width - x < STREAM_TILE ? server->width - x : STREAM_TILE;
+
+      if (!dirtyMapTest(&server->dirty, x / STREAM_TILE, y / STREAM_TILE)) {
+        continue;
+      }
+
+      /* Gather the tile rows and remember them as what the viewer has */
+      for (int row = 0; row < h; row++) {
+        size_t offset = (size_t)(y + row) * server->stride + (size_t)x * 4;
+
+        memcpy(pixels + row * w, data + offset, (size_t)w * 4);
+        memcpy(server->prev + offset, data + offset, (size_t)w * 4);
+      }
+
+      stream_tile_t tile;
+      tile.x = (uint16_t)(x / STREAM_TILE);
+      tile.y = (uint16_t)(y / STREAM_TILE);
+      tile.length = (uint32_t)rleEncode(pixels,
+                                        (size_t)w * h,
+                                        server->out + o + sizeof(tile));
+
+      memcpy(server->out + o, &tile, sizeof(tile));
+      o += sizeof(tile) + tile.length;
+      tiles++;
+    }
+  }
+
+  header.magic = STREAM_MAGIC;
+  /* Numbered by presented frame, so the ones dropped above show up as gaps in the viewer */
+  header.frame = (uint32_t)server->presented;
+  header.timestamp = getTimeNs();
+  header.width = server->width;
+  header.height = server->height;
+  header.tile_size = STREAM_TILE;
+  header.tiles = tiles;
+  header.length = (uint32_t)(o - sizeof(header));
+  header.reserved = 0;
+
+  memcpy(server->out, &header, sizeof(header));
+
+  server->out_len = o;
+  server->out_sent = 0;
+  server->keyframe = 0;
+
+  statAdd(&server->encode_time, header.timestamp - start);
+  statAdd(&server->frame_bytes, o);
+  statAdd(&server->frame_tiles, tiles);
+}
+
+static inline void
+streamPresent(stream_server_t *server,
+              const uint8_t *data,
+              uint16_t width,
+              uint16_t height,
+              int stride) {
+  /* Called once per presented frame with the backbuffer pixels (32 bits per pixel) */
+  server->presented++;
+
+  if (server->presented % 100 == 0) {
+    streamReport(server);
+  }
+
+  if (server->client_fd < 0) {
+    int fd = accept(server->listen_fd, NULL, NULL);
+
+    if (fd < 0) {
+      return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    printf("Stream viewer connected\n");
+    server->client_fd = fd;
+    server->keyframe = 1;
+    server->out_len = 0;
+    server->out_sent = 0;
+  }
+
+  if (width != server->width ||
+      height != server->height ||
+      stride != server->stride) {
+    streamResize(server, width, height, stride);
+  }
+
+  /* The viewer is still busy with an older frame, skip this one */
+  /* prev is left alone so the next frame is diffed against what the viewer really has */
+  if (!streamFlush(server)) {
+    if (server->client_fd >= 0) {
+      server->dropped++;
+    }
+    return;
+  }
+
+  streamEncode(server, data);
+  server->sent++;
+  streamFlush(server);
+}
+
+static inline void
+streamServerClose(stream_server_t *server) {
+  if (server == NULL) {
+    return;
+  }
+
+  if (server->client_fd >= 0) {
+    close(server->client_fd);
+  }
+  close(server->listen_fd);
+  unlink(server->path);
+
+  memFree(server->prev);
+  memFree(server->out);
+  dirtyMapFree(&server->dirty);
+  memFree(server);
+}
+
+#endif
@@ -0,0 +1,410 @@
+#ifndef BLIT_TEXT_H
+#define BLIT_TEXT_H
+
+/*
+ * Text drawn from a glyph atlas instead of through cairo every frame
+ * Each glyph is rasterized once with cairo into a cell of an ARGB32 atlas, white and
+ * premultiplied, so it is an alpha mask in the backbuffer's own format
+ * Strings then become tinted blits (BLIT_TINT) added to a blit batch
+ * Cells are all the same size, when they run out the least recently used glyph is thrown out,
+ * but never one already queued this frame, the batch is flushed first if it comes to that
+ */
+
+#include <cairo.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blit_mem.h"
+#include "blit_sprite.h"
+
+#define TEXT_PAD 2 /* empty pixels around each glyph so antialiasing doesn't bleed */
+
+typedef struct {
+  uint32_t codepoint; /* 0 for a free cell */
+  int16_t x; /* inked box inside the cell, relative to the cell */
+  int16_t y;
+  uint16_t width;
+  uint16_t height;
+  int16_t left; /* where that box goes relative to the pen */
+  int16_t top;
+  int16_t advance;
+  uint64_t used; /* frame it was last drawn in */
+} glyph_t;
+
+typedef struct {
+  cairo_surface_t *atlas_surface;
+  cairo_t *cr;
+  surface_t atlas;
+
+  int cell_width;
+  int cell_height;
+  int cols;
+  int cells;
+  int filled; /* cells handed out before eviction starts */
+  double ascent;
+  int line_height;
+
+  glyph_t *glyphs;
+
+  /* Codepoint -> cell, open addressing with linear probing, -1 is empty */
+  int32_t *table;
+  uint32_t table_mask;
+
+  uint64_t frame;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t flushes; /* batches run early to free a cell */
+} text_t;
+
+static inline uint32_t
+textHash(uint32_t codepoint) {
+  return codepoint * 2654435761u;
+}
+
+static inline int
+textLookup(const text_t *text,
+           uint32_t codepoint) {
+  for (uint32_t i = textHash(codepoint) & text->table_mask;; i = (i + 1) & text->table_mask) {
+    int32_t cell = text->table[i];
+
+    if (cell < 0) {
+      return -1;
+    }
+    if (text->glyphs[cell].codepoint == codepoint) {
+      return cell;
+    }
+  }
+}
+
+static inline void
+textInsert(text_t *text,
+           uint32_t codepoint,
+           int cell) {
+  uint32_t i = textHash(codepoint) & text->table_mask;
+
+  while (text->table[i] >= 0) {
+    i = (i + 1) & text->table_mask;
+  }
+  text->table[i] = cell;
+}
+
+static inline void
+textRemove(text_t *text,
+           uint32_t codepoint) {
+  /* Backward shift deletion, so lookups never need tombstones */
+  uint32_t i = textHash(codepoint) & text->table_mask;
+
+  while (text->glyphs[text->table[i]].codepoint != codepoint) {
+    i = (i + 1) & text->table_mask;
+  }
+
+  for (uint32_t j = (i + 1) & text->table_mask; text->table[j] >= 0; j = (j + 1) & text->table_mask) {
+    uint32_t home = textHash(text->glyphs[text->table[j]].codepoint) & text->table_mask;
+
+    /* Move j back into the hole if its home isn't between the hole and j */
+    if (((j - home) & text->table_mask) >= ((j - i) & text->table_mask)) {
+      text->table[i] = text->table[j];
+      i = j;
+    }
+  }
+  text->table[i] = -1;
+}
+
+static inline text_t*
+allocText(const char *family,
+          double size,
+          int atlas_size) {
+  text_t *text = memCalloc(1, sizeof(text_t));
+
+  text->atlas_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, atlas_size, atlas_size);
+  text->cr = cairo_create(text->atlas_surface);
+
+  cairo_select_font_face(text->cr, family, CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+  cairo_set_font_size(text->cr, size);
+
+  cairo_font_extents_t extents;
+  cairo_font_extents(text->cr, &extents);
+
+  text->ascent = extents.ascent;
+  text->line_height = (int)ceil(extents.height);
+  text->cell_width = (int)ceil(extents.max_x_advance) + 2 * TEXT_PAD;
+  text->cell_height = (int)ceil(extents.ascent + extents.descent) + 1 + 2 * TEXT_PAD;
+  text->cols = atlas_size / text->cell_width;
+  text->cells = text->cols * (atlas_size / text->cell_height);
+
+  /* Not even one glyph fits, there'd be nothing to evict either */
+  if (text->cells == 0) {
+    fprintf(stderr, "Glyph atlas %dx%d is smaller than one %dx%d cell\n",
+            atlas_size,
+            atlas_size,
+            text->cell_width,
+            text->cell_height);
+    cairo_destroy(text->cr);
+    cairo_surface_destroy(text->atlas_surface);
+    memFree(text);
+    return NULL;
+  }
+
+  text->atlas = surface((uint32_t *)cairo_image_surface_get_data(text->atlas_surface),
+                        atlas_size,
+                        atlas_size,
+                        cairo_image_surface_get_stride(text->atlas_surface));
+
+  text->glyphs = memCalloc(text->cells, sizeof(glyph_t));
+
+  /* At most half full */
+  uint32_t table_size = 16;
+  while (table_size < (uint32_t)text->cells * 2) {
+    table_size *= 2;
+  }
+  text->table = memAlloc(sizeof(int32_t) * table_size);
+  text->table_mask = table_size - 1;
+  memset(text->table, 0xff, sizeof(int32_t) * table_size);
+
+  printf("Glyph atlas %dx%d, %d cells of %dx%d\n",
+         atlas_size,
+         atlas_size,
+         text->cells,
+         text->cell_width,
+         text->cell_height);
+
+  return text;
+}
+
+static inline void
+freeText(text_t *text) {
+  if (text == NULL) {
+    return;
+  }
+  cairo_destroy(text->cr);
+  cairo_surface_destroy(text->atlas_surface);
+  memFree(text->glyphs);
+  memFree(text->table);
+  memFree(text);
+}
+
+static inline void
+textFrame(text_t *text) {
+  /* Call once per frame before drawing any text */
+  text->frame++;
+}
+
+static inline int
+utf8Decode(const char **s) {
+  /* Next codepoint, 0 at the end, invalid bytes come out as U+FFFD */
+  const uint8_t *p = (const uint8_t *)*s;
+  uint32_t c = p[0];
+  int n = c < 0x80 ? 0 : c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : -1;
+
+  if (c == 0) {
+    return 0;
+  }
+  if (n < 0) {
+    *s += 1;
+    return 0xfffd;
+  }
+
+  c &= 0x7f >> n;
+
+  for (int i = 1; i <= n; i++) {
+    if ((p[i] & 0xc0) != 0x80) {
+      *s += i;
+      return 0xfffd;
+    }
+    c = c << 6 | (p[i] & 0x3f);
+  }
+
+  *s += n + 1;
+  return (int)c;
+}
+
+static inline void
+utf8Encode(uint32_t c,
+           char *out) {
+  if (c < 0x80) {
+    out[0] = (char)c;
+    out[1] = 0;
+  }
+  else if (c < 0x800) {
+    out[0] = (char)(0xc0 | c >> 6);
+    out[1] = (char)(0x80 | (c & 0x3f));
+    out[2] = 0;
+  }
+  else if (c < 0x10000) {
+    out[0] = (char)(0xe0 | c >> 12);
+    out[1] = (char)(0x80 | ((c >> 6) & 0x3f));
+    out[2] = (char)(0x80 | (c & 0x3f));
+    out[3] = 0;
+  }
+  else {
+    out[0] = (char)(0xf0 | c >> 18);
+    out[1] = (char)(0x80 | ((c >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((c >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (c & 0x3f));
+    out[4] = 0;
+  }
+}
+
+static inline void
+textFlush(text_t *text,
+          blit_batch_t *batch,
+          const surface_t *dst) {
+  /* Unsorted, so text drawn on top of other text (shadows) stays on top */
+  (void)text;
+  blitBatchRun(dst, batch, 0);
+  blitBatchClear(batch);
+}
+
+static inline int
+textEvict(text_t *text,
+          blit_batch_t *batch,
+          const surface_t *dst) {
+  /* Picks the cell to reuse, the least recently used one */
+  if (text->filled < text->cells) {
+    return text->filled++;
+  }
+
+  int oldest = 0;
+
+  for (int i = 1; i < text->cells; i++) {
+    if (text->glyphs[i].used < text->glyphs[oldest].used) {
+      oldest = i;
+    }
+  }
+
+  /* Everything is queued for this frame, draw what's queued so the cell can be reused */
+  if (text->glyphs[oldest].used == text->frame) {
+    textFlush(text, batch, dst);
+    text->flushes++;
+  }
+
+  textRemove(text, text->glyphs[oldest].codepoint);
+  text->evictions++;
+
+  return oldest;
+}
+
+static inline void
+textRasterize(text_t *text,
+              int cell,
+              uint32_t codepoint) {
+  /* One glyph into its cell with cairo, white so it can be tinted any color later */
+  glyph_t *glyph = &text->glyphs[cell];
+  int cell_x = (cell % text->cols) * text->cell_width;
+  int cell_y = (cell / text->cols) * text->cell_height;
+
+  char utf8[8];
+  utf8Encode(codepoint, utf8);
+
+  cairo_text_extents_t extents;
+  cairo_text_extents(text->cr, utf8, &extents);
+
+  cairo_t *cr = text->cr;
+
+  cairo_save(cr);
+  cairo_rectangle(cr, cell_x, cell_y, text->cell_width, text->cell_height);
+  cairo_clip(cr);
+  cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+  cairo_paint(cr);
+  cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+  cairo_set_source_rgba(cr, 1, 1, 1, 1);
+  cairo_move_to(cr, cell_x + TEXT_PAD, cell_y + TEXT_PAD + lround(text->ascent));
+  cairo_show_text(cr, utf8);
+  cairo_restore(cr);
+  cairo_surface_flush(text->atlas_surface);
+
+  /* Only the inked part gets blitted, clamped to the cell */
+  int x1 = TEXT_PAD + (int)floor(extents.x_bearing) - 1;
+  int y1 = TEXT_PAD + (int)lround(text->ascent) + (int)floor(extents.y_bearing) - 1;
+  int x2 = TEXT_PAD + (int)ceil(extents.x_bearing + extents.width) + 1;
+  int y2 = TEXT_PAD + (int)lround(text->ascent) + (int)ceil(extents.y_bearing + extents.height) + 1;
+
+  x1 = x1 < 0 ? 0 : x1;
+  y1 = y1 < 0 ? 0 : y1;
+  x2 = x2 > text->cell_width ? text->cell_width : x2;
+  y2 = y2 > text->cell_height ? text->cell_height : y2;
+
+  glyph->codepoint = codepoint;
+  glyph->x = (int16_t)x1;
+  glyph->y = (int16_t)y1;
+  glyph->width = (uint16_t)(extents.width > 0 && x2 > x1 ? x2 - x1 : 0);
+  glyph->height = (uint16_t)(extents.height > 0 && y2 > y1 ? y2 - y1 : 0);
+  glyph->left = (int16_t)(x1 - TEXT_PAD);
+  glyph->top = (int16_t)(y1 - TEXT_PAD - (int)lround(text->ascent));
+  glyph->advance = (int16_t)lround(extents.x_advance);
+}
+
+static inline const glyph_t*
+textGlyph(text_t *text,
+          uint32_t codepoint,
+          blit_batch_t *batch,
+          const surface_t *dst) {
+  int cell = textLookup(text, codepoint);
+
+  if (cell >= 0) {
+    text->hits++;
+  }
+  else {
+    text->misses++;
+    cell = textEvict(text, batch, dst);
+    textRasterize(text, cell, codepoint);
+    textInsert(text, codepoint, cell);
+  }
+
+  text->glyphs[cell].used = text->frame;
+
+  return &text->glyphs[cell];
+}
+
+static inline int
+textDraw(text_t *text,
+         blit_batch_t *batch,
+         const surface_t *dst,
+         int x,
+         int y,
+         const char *utf8,
+         uint32_t color) {
+  /* Queues a string with its baseline at y, color is premultiplied ARGB */
+  /* Returns where the pen ended up, the batch is drawn by textFlush */
+  int pen = x;
+  int c;
+
+  while ((c = utf8Decode(&utf8)) != 0) {
+    const glyph_t *glyph = textGlyph(text, (uint32_t)c, batch, dst);
+    int cell = (int)(glyph - text->glyphs);
+
+    if (glyph->width > 0 && glyph->height > 0) {
+      blit_t b = blit(&text->atlas,
+                      (cell % text->cols) * text->cell_width + glyph->x,
+                      (cell / text->cols) * text->cell_height + glyph->y,
+                      glyph->width,
+                      glyph->height,
+                      pen + glyph->left,
+                      y + glyph->top);
+
+      b.flags = BLIT_ALPHA | BLIT_TINT;
+      b.tint = color;
+      blitBatchAdd(batch, b);
+    }
+    pen += glyph->advance;
+  }
+  return pen;
+}
+
+static inline void
+textReport(const text_t *text) {
+  uint64_t lookups = text->hits + text->misses;
+
+  printf("text: %llu lookups, %.2f%% hits, %llu rasterized, %llu evicted, %llu early flushes\n",
+         (unsigned long long)lookups,
+         lookups ? 100.0 * text->hits / lookups : 0.0,
+         (unsigned long long)text->misses,
+         (unsigned long long)text->evictions,
+         (unsigned long long)text->flushes);
+}
+
+#endif
@@ -0,0 +1,327 @@
+/*
+ * Reference viewer for the frame stream in blit_stream.h
+ * Usage: blit_viewer [socket path] [headless]
+ * Rebuilds every frame from the changed tiles and shows it in a window with xcb_put_image
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <xcb/xcb.h>
+
+#include "blit_stats.h"
+#include "blit_stream.h"
+
+/* Macro definition to parse X server events
+ * The ~0x80 is needed to get the lower 7 bits
+ */
+#define RECEIVE_EVENT(ev) (ev->response_type & ~0x80)
+
+typedef struct {
+  uint32_t *pixels;
+  uint16_t width;
+  uint16_t height;
+} frame_t;
+
+static int
+connectStream(const char *path) {
+  struct sockaddr_un addr;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0) {
+    perror("socket");
+    exit(1);
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("connect");
+    exit(1);
+  }
+
+  return fd;
+}
+
+static int
+readFull(int fd,
+         void *buf,
+         size_t length) {
+  /* Returns 0 when the stream is closed */
+  size_t done = 0;
+
+  while (done < length) {
+    ssize_t n = read(fd, (uint8_t *)buf + done, length - done);
+
+    if (n <= 0) {
+      return 0;
+    }
+    done += (size_t)n;
+  }
+  return 1;
+}
+
+static xcb_window_t
+getWindow(xcb_connection_t *display,
+          xcb_screen_t *screen,
+          uint16_t width,
+          uint16_t height) {
+  xcb_window_t window = xcb_generate_id(display);
+
+  uint32_t mask = XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK;
+  uint32_t valwin[2] = {screen->black_pixel,
+                        XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS};
+
+  xcb_create_window(display,
+                    XCB_COPY_FROM_PARENT,
+                    window,
+                    screen->root,
+                    0, 0,
+                    width, height,
+                    0,
+                    XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                    screen->root_visual,
+                    mask,
+                    valwin);
+
+  return window;
+}
+
+static void
+putRegion(xcb_connection_t *display,
+          xcb_window_t window,
+          xcb_gcontext_t gc,
+          uint8_t depth,
+          frame_t *frame,
+          int x,
+          int y,
+          int w,
+          int h) {
+  /* Copies a region of the frame to the window */
+  /* Split up in bands of rows so every request stays under the max request length */
+  size_t max_bytes = (size_t)xcb_get_maximum_request_length(display) * 4 - 64;
+  int band = (int)(max_bytes / ((size_t)w * 4));
+  uint32_t *rows = malloc((size_t)w * 4 * (band < h ? band : h));
+
+  assert(band > 0);
+
+  for (int top = y; top < y + h; top += band) {
+    int rows_left = y + h - top;
+    int n = rows_left < band ? rows_left : band;
+
+    for (int row = 0; row < n; row++) {
+      memcpy(rows + (size_t)row * w,
+             frame->pixels + (size_t)(top + row) * frame->width + x,
+             (size_t)w * 4);
+    }
+
+    xcb_put_image(display,
+                  XCB_IMAGE_FORMAT_Z_PIXMAP,
+                  window,
+                  gc,
+                  w, n,
+                  x, top,
+                  0,
+                  depth,
+                  (uint32_t)w * 4 * n,
+                  (uint8_t *)rows);
+  }
+
+  free(rows);
+}
+
+static int
+decodeFrame(frame_t *frame,
+            const stream_frame_t *header,
+            const uint8_t *payload,
+            xcb_connection_t *display,
+            xcb_window_t window,
+            xcb_gcontext_t gc,
+            uint8_t depth) {
+  static uint32_t pixels[STREAM_TILE*STREAM_TILE];
+  size_t offset = 0;
+
+  /* Tiles are decoded into pixels, anything bigger than what it holds would run past it */
+  if (header->tile_size != STREAM_TILE) {
+    return -1;
+  }
+
+  for (uint16_t i = 0; i < header->tiles; i++) {
+    stream_tile_t tile;
+
+    if (offset + sizeof(tile) > header->length) {
+      return -1;
+    }
+    memcpy(&tile, payload + offset, sizeof(tile));
+    offset += sizeof(tile);
+
+    int x = tile.x * header->tile_size;
+    int y = tile.y * header->tile_size;
+
+    if (x >= frame->width ||
+        y >= frame->height ||
+        offset + tile.length > header->length) {
+      return -1;
+    }
+
+    int w = frame->width - x < header->tile_size ? frame->width - x : header->tile_size;
+    int h = frame->height - y < header->tile_size ? frame->height - y : header->tile_size;
+
+    if (rleDecode(payload + offset, tile.length, pixels, (size_t)w * h) < 0) {
+      return -1;
+    }
+    offset += tile.length;
+
+    for (int row = 0; row < h; row++) {
+      memcpy(frame->pixels + (size_t)(y + row) * frame->width + x,
+             pixels + row * w,
+             (size_t)w * 4);
+    }
+
+    if (display != NULL) {
+      putRegion(display, window, gc, depth, frame, x, y, w, h);
+    }
+  }
+
+  return 0;
+}
+
+int
+main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : "/tmp/xblit.sock";
+  int headless = argc > 2 && strcmp(argv[2], "headless") == 0;
+
+  int fd = connectStream(path);
+
+  xcb_connection_t *display = NULL;
+  xcb_screen_t *screen = NULL;
+  xcb_window_t window = 0;
+  xcb_gcontext_t gc = 0;
+
+  if (!headless) {
+    display = xcb_connect(NULL, NULL);
+
+    if (xcb_connection_has_error(display)) {
+      fprintf(stderr, "Could not open the display! :(\n");
+      exit(1);
+    }
+
+    screen = xcb_setup_roots_iterator(xcb_get_setup(display)).data;
+  }
+
+  frame_t frame = {NULL, 0, 0};
+
+  uint8_t *payload = NULL;
+  size_t payload_cap = 0;
+
+  stat_t latency = newStat("Viewer latency");
+  stat_t frame_bytes = newStat("Viewer frame size");
+  uint64_t frames = 0;
+  uint64_t report_start = getTimeNs();
+  uint64_t report_bytes = 0;
+  uint32_t last_frame = 0;
+  uint64_t skipped = 0;
+
+  stream_frame_t header;
+
+  while (readFull(fd, &header, sizeof(header))) {
+    if (header.magic != STREAM_MAGIC) {
+      fprintf(stderr, "Bad frame magic %x\n", header.magic);
+      break;
+    }
+
+    if (header.length > payload_cap) {
+      payload_cap = header.length;
+      payload = realloc(payload, payload_cap);
+    }
+
+    if (!readFull(fd, payload, header.length)) {
+      break;
+    }
+
+    if (header.width != frame.width || header.height != frame.height) {
+      free(frame.pixels);
+      frame.width = header.width;
+      frame.height = header.height;
+      frame.pixels = calloc((size_t)frame.width * frame.height, 4);
+
+      if (display != NULL) {
+        if (gc) {
+          xcb_free_gc(display, gc);
+        }
+        if (window) {
+          xcb_destroy_window(display, window);
+        }
+        window = getWindow(display, screen, frame.width, frame.height);
+        gc = xcb_generate_id(display);
+        xcb_create_gc(display, gc, window, 0, NULL);
+        xcb_map_window(display, window);
+      }
+    }
+
+    if (decodeFrame(&frame, &header, payload, display, window, gc,
+                    screen != NULL ? screen->root_depth : 24) < 0) {
+      fprintf(stderr, "Corrupt frame %u\n", header.frame);
+      break;
+    }
+
+    if (display != NULL) {
+      xcb_generic_event_t *event;
+
+      while ((event = xcb_poll_for_event(display)) != NULL) {
+        if (RECEIVE_EVENT(event) == XCB_EXPOSE) {
+          putRegion(display, window, gc, screen->root_depth,
+                    &frame, 0, 0, frame.width, frame.height);
+        }
+        free(event);
+      }
+      xcb_flush(display);
+    }
+
+    /* Frames the server dropped because we were too slow */
+    if (frames > 0 && header.frame != last_frame + 1) {
+      skipped += header.frame - last_frame - 1;
+    }
+    last_frame = header.frame;
+
+    statAdd(&latency, getTimeNs() - header.timestamp);
+    statAdd(&frame_bytes, sizeof(header) + header.length);
+    report_bytes += sizeof(header) + header.length;
+    frames++;
+
+    if (frames % 100 == 0) {
+      double seconds = (double)(getTimeNs() - report_start) / 1e9;
+
+      printf("Viewer: %.1f fps, %.2f MiB/s, %llu frames skipped by the server\n",
+             100.0 / seconds,
+             (double)report_bytes / (1024.0 * 1024.0) / seconds,
+             (unsigned long long)skipped);
+      statPrint(&latency, 1000.0, "us");
+      statPrint(&frame_bytes, 1024.0, "KiB");
+
+      statReset(&latency);
+      statReset(&frame_bytes);
+      report_start = getTimeNs();
+      report_bytes = 0;
+    }
+  }
+
+  printf("Stream closed after %llu frames\n", (unsigned long long)frames);
+
+  free(payload);
+  free(frame.pixels);
+  close(fd);
+
+  if (display != NULL) {
+    xcb_disconnect(display);
+  }
+
+  return 0;
+}
@@ -10,12 +10,43 @@
 #include <unistd.h>
 #include <xcb/xcb.h>
 
+#include "blit_arena.h"
+#include "blit_cmd.h"
+#include "blit_convert.h"
+#include "blit_events.h"
+#include "blit_framesync.h"
+#include "blit_mem.h"
+#include "blit_queue.h"
+#include "blit_randr.h"
+#include "blit_render.h"
+
 typedef struct {
   unsigned short r;
   unsigned short g;
   unsigned short b;
 } color_t;
 
+/* Sprites composited on the server with RENDER, BLIT_RENDER=1 turns it on */
+/* BLIT_COMMANDS=1 draws the command buffer demo scene with RENDER instead */
+/* The pictures and glyphs are uploaded once for every window, each only has its own target */
+typedef struct {
+  render_shared_t *render;
+  xcb_render_picture_t atlas;
+  xcb_render_picture_t layer;
+  int size;
+  int count;
+  int commands;
+} scene_shared_t;
+
+typedef struct {
+  const scene_shared_t *shared;
+  render_t *render;
+
+  cmd_buffer_t cur;
+  cmd_buffer_t last;
+  uint64_t reused;
+} scene_t;
+
 typedef struct {
   xcb_point_t *points;
   uint16_t width;
@@ -63,6 +94,8 @@ getScreen(xcb_connection_t *display) {
 xcb_window_t
 getWindow(xcb_connection_t *display,
           xcb_screen_t *screen,
+          int16_t x,
+          int16_t y,
           uint16_t width,
           uint16_t height) {
   /* Create the window */
@@ -74,14 +107,15 @@ getWindow(xcb_connection_t *display,
   /* XCB_EVENT_MASK_EXPOSURE is the "exposure" event */
   /* I.e. it fires when our window shows up on the screen */
 
-  uint32_t valwin[2] = {screen->white_pixel, XCB_EVENT_MASK_EXPOSURE};
+  uint32_t valwin[2] = {screen->white_pixel,
+                        XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_STRUCTURE_NOTIFY};
 
   xcb_create_window(display,
                     XCB_COPY_FROM_PARENT,  /* depth (same as root) */
                     window,
                     screen->root, /* parent window */
-                    0, /* x */
-                    0, /* y */
+                    x, /* x */
+                    y, /* y */
                     width,/* width */
                     height,/* height */
                     10, /* border_width  */
@@ -114,42 +148,84 @@ getColorFromCmap(xcb_connection_t *display,
   /* Allocate a color in the color map */
   /* Initialize it with RGB */
 
-  xcb_alloc_color_reply_t *reply = xcb_alloc_color_reply(display,
+  xcb_alloc_color_reply_t *reply = memReply(xcb_alloc_color_reply(display,
                                                          xcb_alloc_color(display,
                                                                          colormap,
                                                                          color.r,
                                                                          color.g,
                                                                          color.b),
-                                                         NULL);
+                                                         NULL));
 
   return reply;
 }
 
-static struct timespec
-genSleep(time_t sec,
-         long nanosec) {
-  struct timespec t;
-  t.tv_sec = sec;
-  t.tv_nsec = nanosec;
-  return t;
+static xcb_visualtype_t*
+getVisual(xcb_connection_t *display,
+          xcb_screen_t *screen) {
+  /* Finds the visual type of the root visual */
+  xcb_depth_iterator_t depth_iter = xcb_screen_allowed_depths_iterator(screen);
+
+  for (; depth_iter.rem; xcb_depth_next(&depth_iter)) {
+    xcb_visualtype_iterator_t visual_iter = xcb_depth_visuals_iterator(depth_iter.data);
+
+    for (; visual_iter.rem; xcb_visualtype_next(&visual_iter)) {
+      if (visual_iter.data->visual_id == screen->root_visual) {
+        return visual_iter.data;
+      }
+    }
+  }
+  return NULL;
+}
+
+static converter_t*
+getConverter(xcb_connection_t *display,
+             xcb_screen_t *screen) {
+  /* On TrueColor visuals pixel values can be worked out locally with the lookup tables */
+  /* Anything else still has to go through xcb_alloc_color */
+  xcb_visualtype_t *visual = getVisual(display, screen);
+
+  if (visual == NULL || visual->_class != XCB_VISUAL_CLASS_TRUE_COLOR) {
+    return NULL;
+  }
+  return allocConverter(display, screen, visual);
+}
+
+static uint32_t
+colorPixel(const converter_t *conv,
+           color_t color) {
+  /* Top 8 bits of each channel, with the middle dither threshold so it rounds */
+  uint32_t rgb = (uint32_t)(color.r >> 8) << 16 |
+                 (uint32_t)(color.g >> 8) << 8 |
+                 (uint32_t)(color.b >> 8);
+
+  return convertPixel(conv, rgb, 8);
 }
 
 static xcb_gcontext_t
 getGC(xcb_connection_t *display,
       xcb_screen_t *screen,
       xcb_colormap_t colormap,
+      converter_t *conv,
       color_t color) {
 
   xcb_drawable_t window = screen->root;
 
   xcb_gcontext_t foreground = xcb_generate_id(display);
 
-  xcb_alloc_color_reply_t *xcolor = getColorFromCmap(display,
-                                                     colormap,
-                                                     color);
-
   uint32_t mask = XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES;
-  uint32_t values[2] = {xcolor->pixel, 0};
+  uint32_t values[2] = {0, 0};
+
+  if (conv != NULL) {
+    values[0] = colorPixel(conv, color);
+  }
+  else {
+    xcb_alloc_color_reply_t *xcolor = getColorFromCmap(display,
+                                                       colormap,
+                                                       color);
+    /* Only the pixel is needed, the reply used to leak once per frame */
+    values[0] = xcolor != NULL ? xcolor->pixel : 0;
+    memFreeReply(xcolor);
+  }
 
   xcb_create_gc(display,
                 foreground,
@@ -164,15 +240,25 @@ static xcb_void_cookie_t
 updateGCColor(xcb_connection_t *display,
               xcb_gcontext_t gc,
               xcb_colormap_t colormap,
+              converter_t *conv,
               color_t color) {
   /* https://www.x.org/releases/X11R7.6/doc/libxcb/tutorial/index.html#changegc */
 
-  xcb_alloc_color_reply_t *xcolor = getColorFromCmap(display,
-                                                     colormap,
-                                                     color);
-
   uint32_t mask = XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES;
-  uint32_t values[2] = {xcolor->pixel, 0};
+  uint32_t values[2] = {0, 0};
+
+  /* No round trip to the server if the pixel can be computed here */
+  if (conv != NULL) {
+    values[0] = colorPixel(conv, color);
+  }
+  else {
+    xcb_alloc_color_reply_t *xcolor = getColorFromCmap(display,
+                                                       colormap,
+                                                       color);
+    /* Only the pixel is needed, the reply used to leak once per frame */
+    values[0] = xcolor != NULL ? xcolor->pixel : 0;
+    memFreeReply(xcolor);
+  }
 
   return xcb_change_gc(display,
                        gc,
@@ -181,12 +267,13 @@ updateGCColor(xcb_connection_t *display,
 }
 
 points_t
-genPoints(uint16_t width,
+genPoints(arena_t *arena,
+          uint16_t width,
           uint16_t height,
           uint16_t x_offset,
           uint16_t y_offset) {
-  /* Fills the entire screen with pixels */
-  xcb_point_t *points = malloc( sizeof(xcb_point_t) * height * width);
+  /* Fills the entire screen with pixels, the points are gone at the end of the frame */
+  xcb_point_t *points = arenaAlloc(arena, sizeof(xcb_point_t) * height * width);
 
   xcb_point_t point;
 
@@ -232,25 +319,15 @@ displayBuffer(xcb_pixmap_t pixmap_buffer,
                 points.width, /* pixel width of source */
                 points.height /* pixel height of source */
                 );
-
-  xcb_flush(display);
 }
 
 void
 writePixmap(xcb_pixmap_t pixmap_buffer,
-            color_t color,
-            xcb_colormap_t colormap,
             points_t points,
             xcb_gcontext_t gc,
             xcb_connection_t *display,
             xcb_window_t window) {
-
-  printf("Drawing pixmap\nr = %u, g = %u, b = %u\n", color.r, color.g, color.b);
-  updateGCColor(display,
-                gc,
-                colormap,
-                color);
-
+  /* The GC is shared by every window, its color is set once per frame by the caller */
   xcb_poly_point(display,
                  XCB_COORD_MODE_ORIGIN, /* Coordinate mode, usually set to XCB_COORD_MODE_ORIGIN */
                  pixmap_buffer,
@@ -285,6 +362,269 @@ getPixmap(xcb_connection_t *display,
     return pixmapId;
 }
 
+static surface_t
+genLayer(void) {
+  /* A 64x64 checkerboard, repeated over the whole window as the background */
+  surface_t layer = surface(memAlloc(64 * 64 * 4), 64, 64, 64 * 4);
+
+  for (int y = 0; y < 64; y++) {
+    uint32_t *row = surfaceRow(&layer, y);
+
+    for (int x = 0; x < 64; x++) {
+      row[x] = ((x / 32) ^ (y / 32)) ? 0xff303040 : 0xff505060;
+    }
+  }
+  return layer;
+}
+
+static scene_shared_t*
+allocSceneShared(xcb_connection_t *display,
+                 xcb_screen_t *screen) {
+  int commands = getenv("BLIT_COMMANDS") != NULL && atoi(getenv("BLIT_COMMANDS")) != 0;
+
+  if (!commands && (getenv("BLIT_RENDER") == NULL || atoi(getenv("BLIT_RENDER")) == 0)) {
+    return NULL;
+  }
+
+  render_shared_t *render = allocRenderShared(display, screen);
+
+  if (render == NULL) {
+    return NULL;
+  }
+
+  scene_shared_t *shared = memCalloc(1, sizeof(scene_shared_t));
+
+  shared->render = render;
+  shared->commands = commands;
+  shared->size = 32;
+  shared->count = getenv("BLIT_SPRITES") != NULL ? atoi(getenv("BLIT_SPRITES")) : 2000;
+
+  /* The only pixel data that is ever sent, whatever the number of windows */
+  surface_t atlas = genAtlas(shared->size);
+  surface_t layer = genLayer();
+
+  shared->atlas = renderUpload(render, screen->root, &atlas, 0);
+  shared->layer = renderUpload(render, screen->root, &layer, 1);
+  renderAddGlyphs(render, &atlas, shared->size, 64);
+
+  memFree(atlas.pixels);
+  memFree(layer.pixels);
+
+  return shared;
+}
+
+static void
+freeSceneShared(scene_shared_t *shared) {
+  if (shared == NULL) {
+    return;
+  }
+  xcb_render_free_picture(shared->render->display, shared->atlas);
+  xcb_render_free_picture(shared->render->display, shared->layer);
+  freeRenderShared(shared->render);
+  memFree(shared);
+}
+
+static scene_t*
+allocScene(const scene_shared_t *shared,
+           xcb_pixmap_t pixmap_buffer) {
+  /* NULL when there's no shared scene, the window draws with the core GC then */
+  if (shared == NULL) {
+    return NULL;
+  }
+
+  scene_t *scene = memCalloc(1, sizeof(scene_t));
+
+  scene->shared = shared;
+  scene->render = allocRender(shared->render, pixmap_buffer);
+
+  return scene;
+}
+
+static void
+freeScene(scene_t *scene) {
+  if (scene == NULL) {
+    return;
+  }
+  freeRender(scene->render);
+
+  if (scene->shared->commands) {
+    printf("Reused %llu command buffers\n", (unsigned long long)scene->reused);
+  }
+  cmdFree(&scene->cur);
+  cmdFree(&scene->last);
+  memFree(scene);
+}
+
+static void
+drawScene(scene_t *scene,
+          xcb_connection_t *display,
+          xcb_window_t window,
+          xcb_gcontext_t gc,
+          xcb_pixmap_t pixmap_buffer,
+          uint16_t width,
+          uint16_t height,
+          uint32_t frame) {
+  const scene_shared_t *shared = scene->shared;
+  render_t *render = scene->render;
+  int size = shared->size;
+
+  /* Background layer, then a colored sprite pass and a tinted glyph pass on top */
+  renderComposite(render, XCB_RENDER_PICT_OP_SRC, shared->layer, 0, 0, 0, 0, width, height);
+
+  int colored = shared->count / 2;
+
+  for (int i = 0; i < colored; i++) {
+    int sprite = i % 64;
+    int x = (int)(((uint32_t)(i * 97) + frame * (1 + i % 5)) % (uint32_t)(width + size)) - size;
+    int y = (int)(((uint32_t)(i * 61) + frame * (1 + i % 3)) % (uint32_t)(height + size)) - size;
+
+    renderComposite(render,
+                    i % 4 == 0 ? XCB_RENDER_PICT_OP_ADD : XCB_RENDER_PICT_OP_OVER,
+                    shared->atlas,
+                    (sprite % 8) * size,
+                    (sprite / 8) * size,
+                    x,
+                    y,
+                    size,
+                    size);
+  }
+
+  static const xcb_render_color_t tints[4] = {
+    {0x8000, 0x2000, 0x2000, 0x8000},
+    {0x2000, 0x8000, 0x2000, 0x8000},
+    {0x2000, 0x2000, 0x8000, 0x8000},
+    {0x8000, 0x8000, 0x8000, 0x8000}
+  };
+
+  for (int t = 0; t < 4; t++) {
+    renderTint(render, XCB_RENDER_PICT_OP_OVER, tints[t]);
+
+    for (int i = colored + t; i < shared->count; i += 4) {
+      int x = (int)(((uint32_t)(i * 53) + frame * (1 + i % 7)) % (uint32_t)(width + size)) - size;
+      int y = (int)(((uint32_t)(i * 89) + frame * (1 + i % 4)) % (uint32_t)(height + size)) - size;
+
+      renderGlyph(render, XCB_RENDER_PICT_OP_OVER, (uint32_t)(i % 64) + 1, x, y);
+    }
+  }
+  renderGlyphsFlush(render, XCB_RENDER_PICT_OP_OVER);
+
+  xcb_copy_area(display, pixmap_buffer, window, gc, 0, 0, 0, 0, width, height);
+  render->bytes += COPY_AREA_BYTES;
+  xcb_flush(display);
+
+  /* Blending on the client means uploading the whole backbuffer every frame */
+  renderFrameEnd(render, PUT_IMAGE_BYTES + (uint64_t)width * height * 4);
+}
+
+static void
+execCommandsRender(const cmd_buffer_t *buf,
+                   render_t *render,
+                   const xcb_render_picture_t *atlases) {
+  /* Command buffer executor for RENDER, every command is one or two requests */
+  /* Color keys can't be done on the server, those blits are drawn without one */
+  size_t offset = 0;
+  const cmd_t *cmd;
+
+  while (cmdNext(buf, &offset, &cmd)) {
+    switch (cmd->op) {
+      case CMD_FILL: {
+        const cmd_fill_t *c = (const cmd_fill_t *)cmd;
+        xcb_rectangle_t rect = {c->x, c->y, c->width, c->height};
+
+        renderFill(render,
+                   c->color >> 24 == 255 ? XCB_RENDER_PICT_OP_SRC : XCB_RENDER_PICT_OP_OVER,
+                   renderColor(c->color),
+                   rect);
+        break;
+      }
+
+      case CMD_GRADIENT: {
+        const cmd_gradient_t *c = (const cmd_gradient_t *)cmd;
+
+        renderGradient(render, c->x, c->y, c->width, c->height, c->from, c->to, c->vertical);
+        break;
+      }
+
+      case CMD_CLIP: {
+        const cmd_clip_t *c = (const cmd_clip_t *)cmd;
+        xcb_rectangle_t rect = {c->x, c->y, c->width, c->height};
+
+        renderClip(render, c->width == 0 || c->height == 0 ? NULL : &rect);
+        break;
+      }
+
+      case CMD_BLIT: {
+        const cmd_blit_t *c = (const cmd_blit_t *)cmd;
+
+        if (c->atlas >= CMD_ATLASES || atlases[c->atlas] == 0) {
+          break;
+        }
+
+        uint8_t op = c->flags & BLIT_ALPHA ? XCB_RENDER_PICT_OP_OVER : XCB_RENDER_PICT_OP_SRC;
+
+        if (c->opacity == 255) {
+          renderComposite(render, op, atlases[c->atlas], c->src_x, c->src_y, c->dst_x, c->dst_y, c->width, c->height);
+          break;
+        }
+
+        /* Opacity goes through a solid alpha mask */
+        xcb_render_color_t alpha = {0, 0, 0, (uint16_t)(c->opacity * 257)};
+        xcb_render_picture_t mask = xcb_generate_id(render->display);
+
+        xcb_render_create_solid_fill(render->display, mask, alpha);
+        renderCompositeMask(render,
+                            op,
+                            atlases[c->atlas],
+                            mask,
+                            c->src_x,
+                            c->src_y,
+                            c->dst_x,
+                            c->dst_y,
+                            c->width,
+                            c->height);
+        xcb_render_free_picture(render->display, mask);
+
+        render->bytes += 16 + 8;
+        render->frame_requests += 2;
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+}
+
+static void
+drawCommands(scene_t *scene,
+             xcb_connection_t *display,
+             xcb_window_t window,
+             xcb_gcontext_t gc,
+             xcb_pixmap_t pixmap_buffer,
+             uint16_t width,
+             uint16_t height,
+             uint32_t frame) {
+  render_t *render = scene->render;
+  xcb_render_picture_t atlases[CMD_ATLASES] = {scene->shared->atlas};
+
+  cmdRecordDemo(&scene->cur, scene->shared->size, scene->shared->count, (int)frame, width, height);
+
+  /* The pixmap still holds the last replay, only the copy to the window is needed */
+  if (cmdEqual(&scene->cur, &scene->last)) {
+    scene->reused++;
+  }
+  else {
+    execCommandsRender(&scene->cur, render, atlases);
+    cmdSwap(&scene->cur, &scene->last);
+  }
+
+  xcb_copy_area(display, pixmap_buffer, window, gc, 0, 0, 0, 0, width, height);
+  render->bytes += COPY_AREA_BYTES;
+  xcb_flush(display);
+
+  renderFrameEnd(render, PUT_IMAGE_BYTES + (uint64_t)width * height * 4);
+}
+
 static color_t
 color(unsigned short r,
       unsigned short g,
@@ -297,6 +637,331 @@ color(unsigned short r,
   return color;
 }
 
+/* One output window with its own backbuffer and present state */
+/* BLIT_WINDOWS=N opens N of them on the one connection, the GC, colormap, converter, RENDER */
+/* assets and RandR's monitors are shared since they only depend on the screen */
+typedef struct {
+  xcb_window_t window;
+  xcb_pixmap_t pixmap_buffer;
+  scene_t *scene; /* NULL unless BLIT_RENDER=1 or BLIT_COMMANDS=1 */
+  uint16_t width;
+  uint16_t height;
+  uint16_t y_offset;
+  int was_exposed;
+  uint32_t frame;
+  event_batch_t batch; /* only this window's events */
+  framesync_t *framesync; /* NULL unless BLIT_FRAMESYNC=1 */
+  randr_t *randr; /* the monitor it's on, NULL without RandR */
+  uint64_t period; /* ns per frame, the monitor's refresh */
+  uint64_t deadline; /* when the next frame is due */
+} output_t;
+
+/* Aggregate throughput over all the windows, only with BLIT_WINDOWS set */
+typedef struct {
+  int enabled;
+  uint64_t loops;
+  uint64_t frames; /* summed over every window */
+  uint64_t bytes; /* estimated from request sizes */
+  uint64_t last; /* when the previous loop ended */
+  uint64_t elapsed; /* wall time, sleeping included */
+  unsigned int sequence; /* last request the server answered */
+  stat_t busy; /* drawing and waiting for the server, per loop */
+  stat_t requests;
+} traffic_t;
+
+#define MAX_WINDOWS 256
+#define DEFAULT_PERIOD 20000000ull /* ns per frame when the refresh rate isn't known */
+
+/* Request sizes from the protocol, in bytes */
+#define POLY_POINT_BYTES 12
+#define CHANGE_GC_BYTES 20
+
+static int
+getWindowCount(void) {
+  int count = getenv("BLIT_WINDOWS") != NULL ? atoi(getenv("BLIT_WINDOWS")) : 1;
+
+  if (count < 1) {
+    return 1;
+  }
+  return count > MAX_WINDOWS ? MAX_WINDOWS : count;
+}
+
+static uint64_t
+outputPeriod(const output_t *output) {
+  /* One frame per refresh of the window's monitor */
+  uint64_t refresh = randrRefresh(output->randr);
+
+  return refresh != 0 ? refresh : DEFAULT_PERIOD;
+}
+
+static output_t*
+allocOutputs(xcb_connection_t *display,
+             xcb_screen_t *screen,
+             const scene_shared_t *scene,
+             randr_screen_t *randr,
+             int count) {
+  /* Tiles the primary monitor in a grid, one window per cell */
+  output_t *outputs = memCalloc(count, sizeof(output_t));
+  monitor_t monitor = randrDefaultMonitor(display, screen);
+  int cols = 1;
+
+  while (cols * cols < count) {
+    cols++;
+  }
+
+  int rows = (count + cols - 1) / cols;
+  uint16_t width = monitor.width / cols;
+  uint16_t height = monitor.height / rows;
+
+  for (int i = 0; i < count; i++) {
+    output_t *output = &outputs[i];
+
+    output->width = width;
+    output->height = height;
+    output->window = getWindow(display,
+                               screen,
+                               (int16_t)(monitor.x + (i % cols) * width),
+                               (int16_t)(monitor.y + (i / cols) * height),
+                               width,
+                               height);
+
+    /* Has to be set up before mapping, that's when a compositor looks for the counters */
+    output->framesync = allocFrameSync(display, output->window);
+
+    xcb_map_window(display, output->window);
+
+    output->pixmap_buffer = getPixmap(display,
+                                      screen,
+                                      output->window,
+                                      width,
+                                      height);
+
+    output->scene = allocScene(scene, output->pixmap_buffer);
+
+    /* Each window paces to the monitor it's on */
+    output->randr = allocRandrWindow(randr, output->window);
+    output->period = outputPeriod(output);
+    output->deadline = getTimeNs();
+  }
+
+  if (count > 1) {
+    printf("%d windows of %ux%u\n", count, width, height);
+  }
+
+  return outputs;
+}
+
+static void
+resizeOutput(xcb_connection_t *display,
+             xcb_screen_t *screen,
+             output_t *output,
+             uint16_t width,
+             uint16_t height) {
+  /* The backbuffer is only as big as the window was, drawing has to go into one that fits */
+  if (width == output->width && height == output->height) {
+    return;
+  }
+
+  xcb_free_pixmap(display, output->pixmap_buffer);
+  output->pixmap_buffer = getPixmap(display, screen, output->window, width, height);
+
+  if (output->scene != NULL) {
+    renderBackBuffer(output->scene->render, output->pixmap_buffer);
+  }
+
+  output->width = width;
+  output->height = height;
+}
+
+static void
+freeOutputs(xcb_connection_t *display,
+            output_t *outputs,
+            int count) {
+  for (int i = 0; i < count; i++) {
+    freeScene(outputs[i].scene);
+    freeFrameSync(outputs[i].framesync);
+    freeRandr(outputs[i].randr);
+    xcb_free_pixmap(display, outputs[i].pixmap_buffer);
+    xcb_destroy_window(display, outputs[i].window);
+  }
+  memFree(outputs);
+}
+
+static output_t*
+findOutput(output_t *outputs,
+           int count,
+           xcb_window_t window) {
+  /* Routes an event to the window it's for, a scan is fine for a few hundred windows */
+  for (int i = 0; i < count; i++) {
+    if (outputs[i].window == window) {
+      return &outputs[i];
+    }
+  }
+  return NULL;
+}
+
+static int
+outputReady(output_t *output,
+            uint64_t now) {
+  /* A compositor pacing the window decides when it draws, otherwise its own period does */
+  if (!output->was_exposed) {
+    return 0;
+  }
+
+  if (frameSyncPaced(output->framesync)) {
+    return frameSyncReady(output->framesync);
+  }
+  return now >= output->deadline;
+}
+
+static int
+outputsReady(output_t *outputs,
+             int count,
+             uint64_t now) {
+  /* 1 if any window is due to draw */
+  for (int i = 0; i < count; i++) {
+    if (outputReady(&outputs[i], now)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static uint64_t
+outputWake(const output_t *output,
+           uint64_t wake) {
+  /* The earlier of wake and when this window is next due */
+  if (!output->was_exposed) {
+    return wake;
+  }
+
+  if (frameSyncPaced(output->framesync)) {
+    return frameSyncWake(output->framesync, wake);
+  }
+  return output->deadline < wake ? output->deadline : wake;
+}
+
+static void
+outputDrawn(output_t *output,
+            uint64_t now) {
+  /* Next slot on the window's own grid, slots that already went by are skipped */
+  output->deadline += output->period;
+
+  if (output->deadline <= now) {
+    output->deadline = now + output->period;
+  }
+}
+
+static uint64_t
+drawOutput(output_t *output,
+           xcb_connection_t *display,
+           xcb_gcontext_t gc,
+           arena_t *arena) {
+  /* Draws one frame into the window's backbuffer and presents it, returns the bytes sent */
+  scene_t *scene = output->scene;
+
+  if (scene != NULL) {
+    uint64_t sent = scene->render->sent;
+
+    if (scene->shared->commands) {
+      drawCommands(scene,
+                   display,
+                   output->window,
+                   gc,
+                   output->pixmap_buffer,
+                   output->width,
+                   output->height,
+                   output->frame++);
+    }
+    else {
+      drawScene(scene,
+                display,
+                output->window,
+                gc,
+                output->pixmap_buffer,
+                output->width,
+                output->height,
+                output->frame++);
+    }
+    return scene->render->sent - sent;
+  }
+
+  points_t points = genPoints(arena, output->width/2, output->height/2, 0, output->y_offset++);
+
+  writePixmap(output->pixmap_buffer,
+              points,
+              gc,
+              display,
+              output->window);
+
+  output->frame++;
+
+  return POLY_POINT_BYTES + (uint64_t)points.width * points.height * sizeof(xcb_point_t) + COPY_AREA_BYTES;
+}
+
+static traffic_t
+trafficStats(void) {
+  traffic_t traffic;
+  memset(&traffic, 0, sizeof(traffic));
+
+  traffic.enabled = getenv("BLIT_WINDOWS") != NULL;
+  traffic.busy = newStat("busy/loop");
+  traffic.requests = newStat("requests/loop");
+  traffic.last = getTimeNs();
+
+  return traffic;
+}
+
+static void
+trafficLoop(traffic_t *traffic,
+            xcb_connection_t *display,
+            int count,
+            int frames,
+            uint64_t bytes,
+            uint64_t loop_start) {
+  /* Waits for the server so the numbers are what it actually finished, not what was queued */
+  /* The reply's sequence number says how many requests went out since last time */
+  if (!traffic->enabled) {
+    return;
+  }
+
+  xcb_get_input_focus_cookie_t cookie = xcb_get_input_focus(display);
+  memFreeReply(memReply(xcb_get_input_focus_reply(display, cookie, NULL)));
+
+  if (traffic->loops > 0) {
+    /* Sequence numbers are 32 bits on the client, wrapping is fine with unsigned math */
+    statAdd(&traffic->requests, cookie.sequence - traffic->sequence);
+  }
+  traffic->sequence = cookie.sequence;
+
+  uint64_t now = getTimeNs();
+
+  statAdd(&traffic->busy, now - loop_start);
+  traffic->elapsed += now - traffic->last;
+  traffic->last = now;
+  traffic->loops++;
+  traffic->frames += (uint64_t)frames;
+  traffic->bytes += bytes;
+
+  if (traffic->loops % 100 == 0) {
+    double seconds = traffic->elapsed / 1e9;
+
+    printf("windows: %d, %.1f frames/s in total, %.1f per window, %.1f KiB/s\n",
+           count,
+           traffic->frames / seconds,
+           traffic->frames / seconds / count,
+           traffic->bytes / seconds / 1024);
+    statPrint(&traffic->busy, 1e6, "ms");
+    statPrint(&traffic->requests, 1, "");
+
+    statReset(&traffic->busy);
+    statReset(&traffic->requests);
+    traffic->elapsed = 0;
+    traffic->frames = 0;
+    traffic->bytes = 0;
+  }
+}
+
 int
 main(void) {
   /* Open up the display */
@@ -305,115 +970,210 @@ main(void) {
   /* Get a handle to the screen */
   xcb_screen_t *screen = getScreen(display);
 
-  uint16_t window_height = screen->height_in_pixels;
-  uint16_t window_width = screen->width_in_pixels;
+  /* Create the windows, one unless BLIT_WINDOWS says otherwise, and map them */
+  /* Each gets its own backbuffer pixmap, plus a RENDER scene if BLIT_RENDER=1 */
+  int count = getWindowCount();
 
-  /* Create a window */
-  xcb_window_t window = getWindow(display,
-                                  screen,
-                                  window_width,
-                                  window_height);
+  /* Made once and shared, NULL without BLIT_RENDER or BLIT_COMMANDS and without RandR */
+  scene_shared_t *scene = allocSceneShared(display, screen);
+  randr_screen_t *randr = allocRandrScreen(display, screen);
 
-  /* Map the window to the display */
-  xcb_map_window(display, window);
+  output_t *outputs = allocOutputs(display, screen, scene, randr, count);
 
   /* Allocate a colormap, for creating colors */
-  xcb_colormap_t colormap = allocateColorMap(display, window, screen);
+  xcb_colormap_t colormap = allocateColorMap(display, outputs[0].window, screen);
 
   /* Flush all commands */
   xcb_flush(display);
 
-  /* Used to handle the event loop */
-  struct timespec req = genSleep(0, 20000000);
-  struct timespec rem = genSleep(0, 0);
 
   color_t draw_color = color(0, 0, 0);
 
   xcb_generic_event_t *event;
-  xcb_expose_event_t *expose;
+
+  event_batch_t batch;
+  event_stats_t event_stats = eventStats();
+  mem_stats_t mem_stats = memStats();
+  traffic_t traffic = trafficStats();
+  int running = 1;
+
+  /* Lookup tables for turning colors into pixel values, NULL if the server has to do it */
+  converter_t *conv = getConverter(display, screen);
 
   xcb_gcontext_t gc = getGC(display,
                             screen,
                             colormap,
+                            conv,
                             draw_color);
 
-  /* The pixmap that acts as our backbuffer */
-  xcb_pixmap_t pixmap_buffer = getPixmap(display,
-                                         screen,
-                                         window,
-                                         window_width,
-                                         window_height);
+  /* Polled once per frame, or read on a thread of its own with BLIT_EVENT_THREAD=1 */
+  event_source_t *events = allocEventSource(display, outputs[0].window);
+
+  /* Per frame scratch, reset once every window has drawn */
+  arena_t *arena = allocArena();
 
   int was_exposed = 0;
 
   int side = 0;
-  points_t points;
-  uint16_t x_offset = 0;
-  uint16_t y_offset = 0;
 
-  while (1) {
-    event = xcb_poll_for_event(display);
+  while (running) {
+    uint64_t loop_start = getTimeNs();
 
-    if (event != NULL) {
+    /* Drain everything that is queued, not just one event per frame */
+    batchBegin(&batch);
+
+    for (int i = 0; i < count; i++) {
+      batchBegin(&outputs[i].batch);
+    }
+
+    while ((event = eventNext(events, &batch)) != NULL) {
       switch RECEIVE_EVENT(event) {
         case XCB_EXPOSE: {
-          expose = (xcb_expose_event_t *)event;
+          xcb_expose_event_t *expose = (xcb_expose_event_t *)event;
+          output_t *output = findOutput(outputs, count, expose->window);
 
-          window_width = expose->width;
-          window_height = expose->height;
+          batchExpose(&batch, expose);
 
-          printf("Window %u exposed. Region to be redrawn at location (%u,%u), with dimension (%u,%u)\n",
-                 expose->window, expose->x,
-                 expose->y,
-                 expose->width,
-                 expose->height);
+          if (output != NULL) {
+            batchExpose(&output->batch, expose);
+          }
+          break;
+        }
 
-          points = genPoints(window_width/2, window_height/2, x_offset, y_offset++);
+        case XCB_CONFIGURE_NOTIFY: {
+          xcb_configure_notify_event_t *configure_notify = (xcb_configure_notify_event_t *)event;
+          output_t *output = findOutput(outputs, count, configure_notify->window);
 
-          writePixmap(pixmap_buffer,
-                      draw_color,
-                      colormap,
-                      points,
-                      gc,
-                      display,
-                      window);
+          batchConfigure(&batch, configure_notify);
 
-          was_exposed = 1;
-          free(points.points);
+          if (output != NULL) {
+            batchConfigure(&output->batch, configure_notify);
+          }
+          break;
+        }
 
+        case XCB_CLIENT_MESSAGE: {
+          xcb_client_message_event_t *message = (xcb_client_message_event_t *)event;
+          output_t *output = findOutput(outputs, count, message->window);
+
+          if (output != NULL) {
+            frameSyncMessage(output->framesync, message);
+          }
           break;
         }
 
         default: {
-          printf ("Unknown event: %u\n", event->response_type);
+          /* RandR events are only known at runtime, the monitors are read once for every window */
+          if (!randrScreenEvent(randr, event)) {
+            printf ("Unknown event: %u\n", event->response_type);
+            break;
+          }
+
+          for (int i = 0; i < count; i++) {
+            if (randrUpdate(outputs[i].randr)) {
+              outputs[i].period = outputPeriod(&outputs[i]);
+            }
+          }
           break;
         }
+      }
+    }
+
+    for (int i = 0; i < count; i++) {
+      output_t *output = &outputs[i];
+
+      if (output->batch.configures > 0) {
+        resizeOutput(display, screen, output, output->batch.width, output->batch.height);
+
+        /* It may have moved to another monitor */
+        if (randrMoved(output->randr)) {
+          output->period = outputPeriod(output);
+        }
+      }
 
-        free(event);
+      if (output->batch.exposes > 0) {
+        printf("Window %u exposed %d times. Region to be redrawn at location (%d,%d), with dimension (%d,%d)\n",
+               output->window,
+               output->batch.exposes,
+               output->batch.x1,
+               output->batch.y1,
+               output->batch.x2 - output->batch.x1,
+               output->batch.y2 - output->batch.y1);
+
+        output->was_exposed = 1;
+        was_exposed = 1;
       }
     }
-    if (was_exposed) {
-      points = genPoints(window_width/2, window_height/2, x_offset, y_offset++);
-
-      writePixmap(pixmap_buffer,
-                  draw_color,
-                  colormap,
-                  points,
-                  gc,
-                  display,
-                  window);
-
-      free(points.points);
+
+    uint64_t now = getTimeNs();
+
+    if (was_exposed && outputsReady(outputs, count, now)) {
+      int frames = 0;
+      uint64_t bytes = 0;
+
+      /* Every window draws with the same color, so the shared GC only changes once */
+      if (outputs[0].scene == NULL) {
+        printf("Drawing pixmap\nr = %u, g = %u, b = %u\n", draw_color.r, draw_color.g, draw_color.b);
+        updateGCColor(display,
+                      gc,
+                      colormap,
+                      conv,
+                      draw_color);
+        bytes += CHANGE_GC_BYTES;
+      }
+
+      /* Draw once per window, however many exposes came in */
+      /* Windows a compositor paces wait until it has drawn their last frame */
+      for (int i = 0; i < count; i++) {
+        if (outputReady(&outputs[i], now)) {
+          uint64_t start = getTimeNs();
+
+          frameSyncBegin(outputs[i].framesync);
+          bytes += drawOutput(&outputs[i], display, gc, arena);
+          frameSyncEnd(outputs[i].framesync, getTimeNs() - start);
+          outputDrawn(&outputs[i], now);
+          frames++;
+        }
+      }
+      xcb_flush(display);
+
+      eventStatsFrame(&event_stats, &batch);
+      trafficLoop(&traffic, display, count, frames, bytes, loop_start);
+
+      /* xcb has copied or written out everything the frame's requests pointed at by now */
+      arenaReset(arena);
+
+      if (memFrame(&mem_stats)) {
+        running = 0;
+      }
     }
 
     draw_color.r += 100;
     draw_color.g -= 100;
 
-    nanosleep(&req, &rem);
+    /* Sleep until the next window is due, each one has its own period */
+    /* Until something is exposed that's the default period, to look at events again */
+    uint64_t wake = getTimeNs() + DEFAULT_PERIOD;
+
+    for (int i = 0; i < count; i++) {
+      wake = outputWake(&outputs[i], wake);
+    }
+
+    if (getTimeNs() < wake) {
+      struct timespec t;
+      t.tv_sec = (time_t)(wake / 1000000000ull);
+      t.tv_nsec = (long)(wake % 1000000000ull);
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+    }
   }
 
-  xcb_free_pixmap(display, pixmap_buffer);
+  freeEventSource(events);
+  freeOutputs(display, outputs, count);
+  freeSceneShared(scene);
+  freeRandrScreen(randr);
+  freeConverter(conv);
+  freeArena(arena);
   xcb_disconnect(display);
-  return 0;
+  return memSoakResult(&mem_stats);
 
 }
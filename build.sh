@@ -1,3 +1,2 @@
 #! /usr/bin/env bash
-$CC -Wall --pedantic --std=gnu11 $(pkg-config --cflags --libs cairo x11 x11-xcb xcb gl glu xcb-glx) $1
-
+$CC -Wall --pedantic --std=gnu11 -O2 -pthread $(pkg-config --cflags --libs cairo x11 x11-xcb xcb xcb-randr xcb-render xcb-sync xcb-xtest gl glu xcb-glx) $1
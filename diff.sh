@@ -0,0 +1,20 @@
+#! /usr/bin/env bash
+# Runs bench_diff with a real display, so the break-even is against xcb_put_image and not a memcpy
+# Usage: ./diff.sh [WxH...]
+# Needs Xvfb, CC is used to build like build.sh
+
+SIZES=${@:-1920x1080 3840x2160}
+DISPLAY_NUM=${DIFF_DISPLAY:-:92}
+
+Xvfb $DISPLAY_NUM -screen 0 3840x2160x24 -nolisten tcp &
+XVFB=$!
+trap "kill $XVFB; rm -f ./diff_bench_diff" EXIT
+sleep 1
+
+$CC -Wall --pedantic --std=gnu11 -O2 -pthread -o ./diff_bench_diff bench_diff.c \
+  $(pkg-config --cflags --libs xcb) || exit 1
+
+for size in $SIZES; do
+  echo "== $size"
+  DISPLAY=$DISPLAY_NUM ./diff_bench_diff ${size%x*} ${size#*x} || exit 1
+done
@@ -0,0 +1,49 @@
+#! /usr/bin/env bash
+# Runs each backend with BLIT_FRAMESYNC=1 next to blit_compositor on a virtual display, so
+# frames are paced by _NET_WM_FRAME_DRAWN instead of the backend's own timer
+# Usage: ./framesync.sh [frames] [programs...]
+# BLIT_REFRESH sets the compositor's repaint rate, BLIT_SYNC_REQUESTS how often it sends sync requests
+# Needs Xvfb, CC is used to build like build.sh
+
+FRAMES=${1:-600}
+shift
+PROGRAMS=${@:-blit_cairo.c blit_xcb.c blit_opengl.c}
+DISPLAY_NUM=${FRAMESYNC_DISPLAY:-:95}
+LIBS="$(pkg-config --cflags --libs cairo x11 x11-xcb xcb xcb-randr xcb-render xcb-sync xcb-xtest gl glu xcb-glx)"
+
+Xvfb $DISPLAY_NUM -screen 0 1280x720x24 -nolisten tcp &
+XVFB=$!
+sleep 1
+
+$CC -Wall --pedantic --std=gnu11 -O2 -pthread -o ./framesync_compositor blit_compositor.c $LIBS || exit 1
+
+DISPLAY=$DISPLAY_NUM ./framesync_compositor > ./framesync_compositor.log 2>&1 &
+COMPOSITOR=$!
+trap "kill $COMPOSITOR $XVFB; rm -f ./framesync_compositor ./framesync_compositor.log" EXIT
+
+STATUS=0
+
+for program in $PROGRAMS; do
+  binary=./framesync_$(basename $program .c)
+
+  $CC -Wall --pedantic --std=gnu11 -O2 -pthread -o $binary $program $LIBS || exit 1
+
+  echo "== $program, $FRAMES frames"
+
+  DISPLAY=$DISPLAY_NUM BLIT_FRAMESYNC=1 BLIT_SOAK=$FRAMES $binary > $binary.log 2>&1
+  result=$?
+
+  # The last report, from when the window went away
+  grep "^framesync" $binary.log | tail -n 4
+
+  if [ $result -ne 0 ] || ! grep -q "paced by the compositor" $binary.log; then
+    echo "== $program FAILED"
+    STATUS=1
+  fi
+
+  rm -f $binary $binary.log
+done
+
+grep "sync requests answered" ./framesync_compositor.log | tail -n 1
+
+exit $STATUS
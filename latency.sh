@@ -0,0 +1,41 @@
+#! /usr/bin/env bash
+# Injects N key presses into each backend through XTEST on a virtual display
+# and prints the input to present latency distribution
+# Usage: ./latency.sh [presses] [programs...]
+# Needs Xvfb, CC is used to build like build.sh
+
+PRESSES=${1:-200}
+shift
+PROGRAMS=${@:-blit_cairo.c blit_opengl.c}
+DISPLAY_NUM=${LATENCY_DISPLAY:-:98}
+
+Xvfb $DISPLAY_NUM -screen 0 1280x720x24 -nolisten tcp +extension XTEST &
+XVFB=$!
+trap "kill $XVFB" EXIT
+sleep 1
+
+STATUS=0
+
+for program in $PROGRAMS; do
+  binary=./latency_$(basename $program .c)
+
+  $CC -Wall --pedantic --std=gnu11 -O2 -pthread -o $binary $program \
+    $(pkg-config --cflags --libs cairo x11 x11-xcb xcb xcb-randr xcb-render xcb-sync xcb-xtest gl glu xcb-glx) || exit 1
+
+  echo "== $program, $PRESSES presses"
+
+  DISPLAY=$DISPLAY_NUM BLIT_LATENCY_TEST=$PRESSES $binary > $binary.log 2>&1
+  result=$?
+
+  sed -n '/^input queued/,$p' $binary.log | grep -v "^sched\|^memory\|^render\|^allocs\|^replies"
+  grep "^latency:.*never" $binary.log
+
+  if [ $result -ne 0 ]; then
+    echo "== $program FAILED"
+    STATUS=1
+  fi
+
+  rm -f $binary $binary.log
+done
+
+exit $STATUS
@@ -0,0 +1,59 @@
+#! /usr/bin/env bash
+# Checks each backend follows the refresh rate of its monitor on a virtual display
+# Xvfb's own mode has no timings, so a 144Hz mode is added and set with xrandr first, and
+# halfway through the run the monitor is switched to 60Hz, which the backend has to notice
+# Usage: ./randr.sh [frames] [programs...]
+# Needs Xvfb and xrandr, CC is used to build like build.sh
+
+FRAMES=${1:-600}
+shift
+PROGRAMS=${@:-blit_cairo.c blit_xcb.c blit_opengl.c}
+DISPLAY_NUM=${RANDR_DISPLAY:-:94}
+LIBS="$(pkg-config --cflags --libs cairo x11 x11-xcb xcb xcb-randr xcb-render xcb-sync xcb-xtest gl glu xcb-glx)"
+
+Xvfb $DISPLAY_NUM -screen 0 1280x720x24 -nolisten tcp +extension RANDR &
+XVFB=$!
+trap "kill $XVFB" EXIT
+sleep 1
+
+# Same size, different refresh, 1440x750 total pixels per frame
+export DISPLAY=$DISPLAY_NUM
+OUTPUT=$(xrandr | awk '/ connected/ { print $1; exit }')
+
+xrandr --newmode blit144 155.52 1280 1328 1360 1440 720 723 728 750 || exit 1
+xrandr --newmode blit60 64.80 1280 1328 1360 1440 720 723 728 750 || exit 1
+xrandr --addmode $OUTPUT blit144
+xrandr --addmode $OUTPUT blit60
+
+STATUS=0
+
+for program in $PROGRAMS; do
+  binary=./randr_$(basename $program .c)
+
+  $CC -Wall --pedantic --std=gnu11 -O2 -pthread -o $binary $program $LIBS || exit 1
+
+  xrandr --output $OUTPUT --mode blit144
+
+  echo "== $program, $FRAMES frames"
+
+  BLIT_SOAK=$FRAMES $binary > $binary.log 2>&1 &
+  PROGRAM=$!
+
+  sleep 2
+  xrandr --output $OUTPUT --mode blit60
+
+  wait $PROGRAM
+  result=$?
+
+  grep "^randr:\|budget" $binary.log | sort | uniq -c
+
+  # It has to have paced at both rates
+  if [ $result -ne 0 ] || ! grep -q "144.00Hz" $binary.log || ! grep -q "60.00Hz" $binary.log; then
+    echo "== $program FAILED"
+    STATUS=1
+  fi
+
+  rm -f $binary $binary.log
+done
+
+exit $STATUS
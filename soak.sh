@@ -0,0 +1,44 @@
+#! /usr/bin/env bash
+# Runs each backend for N frames on a virtual display and fails if memory grows after warm-up,
+# or if our own code still allocates per frame, every malloc in the process is counted with the
+# blit_mallocs.so shim so the libraries' share shows up too
+# Usage: ./soak.sh [frames] [programs...]
+# Needs Xvfb, CC is used to build like build.sh
+
+FRAMES=${1:-5000}
+shift
+PROGRAMS=${@:-blit_xcb.c blit_cairo.c blit_opengl.c}
+DISPLAY_NUM=${SOAK_DISPLAY:-:99}
+
+Xvfb $DISPLAY_NUM -screen 0 1280x720x24 -nolisten tcp &
+XVFB=$!
+trap "kill $XVFB; rm -f ./blit_mallocs.so" EXIT
+sleep 1
+
+$CC -shared -fPIC -O2 -o ./blit_mallocs.so blit_mallocs.c -ldl || exit 1
+
+STATUS=0
+
+for program in $PROGRAMS; do
+  binary=./soak_$(basename $program .c)
+
+  $CC -Wall --pedantic --std=gnu11 -O2 -pthread -o $binary $program \
+    $(pkg-config --cflags --libs cairo x11 x11-xcb xcb xcb-randr xcb-render xcb-sync xcb-xtest gl glu xcb-glx) || exit 1
+
+  echo "== $program, $FRAMES frames"
+
+  DISPLAY=$DISPLAY_NUM BLIT_SOAK=$FRAMES LD_PRELOAD=./blit_mallocs.so $binary > $binary.log 2>&1
+  result=$?
+
+  grep "^memory\|^soak" $binary.log | tail -n 6
+  grep "^mallocs/frame\|^arena: high" $binary.log | tail -n 2
+
+  if [ $result -ne 0 ]; then
+    echo "== $program FAILED"
+    STATUS=1
+  fi
+
+  rm -f $binary $binary.log
+done
+
+exit $STATUS
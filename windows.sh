@@ -0,0 +1,39 @@
+#! /usr/bin/env bash
+# Opens more and more windows from blit_xcb on one connection and prints the aggregate
+# frames/sec and X traffic for each count, to find where it stops scaling
+# Usage: ./windows.sh [loops] [counts...]
+# Extra settings pass through, e.g. BLIT_RENDER=1 ./windows.sh
+# Needs Xvfb, CC is used to build like build.sh
+
+LOOPS=${1:-600}
+shift
+COUNTS=${@:-1 2 4 8 16 32 64}
+DISPLAY_NUM=${WINDOWS_DISPLAY:-:97}
+
+Xvfb $DISPLAY_NUM -screen 0 1920x1080x24 -nolisten tcp &
+XVFB=$!
+trap "kill $XVFB; rm -f ./windows_blit_xcb ./windows_blit_xcb.log" EXIT
+sleep 1
+
+$CC -Wall --pedantic --std=gnu11 -O2 -pthread -o ./windows_blit_xcb blit_xcb.c \
+  $(pkg-config --cflags --libs cairo x11 x11-xcb xcb xcb-randr xcb-render xcb-sync xcb-xtest gl glu xcb-glx) || exit 1
+
+STATUS=0
+
+for count in $COUNTS; do
+  echo "== $count windows, $LOOPS loops"
+
+  # Also a soak run, so leaks that only show up with many windows fail it
+  DISPLAY=$DISPLAY_NUM BLIT_WINDOWS=$count BLIT_SOAK=$LOOPS ./windows_blit_xcb > ./windows_blit_xcb.log 2>&1
+  result=$?
+
+  grep -A2 "^windows:" ./windows_blit_xcb.log | tail -n 3
+  grep "^soak" ./windows_blit_xcb.log
+
+  if [ $result -ne 0 ]; then
+    echo "== $count windows FAILED"
+    STATUS=1
+  fi
+done
+
+exit $STATUS